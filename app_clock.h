@@ -0,0 +1,95 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "esphome/components/time/real_time_clock.h"
+
+////////////////////////////////////////////////////////
+// AppClock: the app's time
+//
+// Time is uptime (millis(), widened to 64 bits so it does
+// not wrap) plus an epoch offset taken from SNTP. The app
+// takes a snapshot at the start of each entry point that
+// uses time and every query until the next snapshot
+// returns the same time, so a sample is handled at one
+// instant and nothing queries the SNTP component or
+// converts to local time per sample.
+//
+// Resyncing steps the offset only when it is off by more
+// than max_slew_ms. Smaller errors are slewed a second
+// per sync, so a resync cannot make a running session
+// jump or go backwards.
+////////////////////////////////////////////////////////
+
+// The storage of the app's globals. A host build that runs a device a
+// thread makes it thread_local (see test/CMakeLists.txt).
+#ifndef APP_GLOBAL_STORAGE
+#define APP_GLOBAL_STORAGE
+#endif
+
+struct AppClock {
+  // Epochs before this (2019-01-01) are a clock that is not set yet
+  static const time_t valid_epoch = 1546300800;
+  static const int max_slew_ms = 120000;
+  static const int slew_step_ms = 1000;
+
+  uint32_t last_ms_ = 0;
+  uint64_t uptime_ms_ = 0;
+  // Uptime of the snapshot
+  uint64_t snapshot_ms_ = 0;
+  int64_t  epoch_offset_ms_ = 0;
+  bool     valid_ = false;
+
+  void snapshot() {
+    uint32_t ms = millis();
+    uptime_ms_ += uint32_t(ms - last_ms_);
+    last_ms_ = ms;
+    snapshot_ms_ = uptime_ms_;
+  }
+
+  // Makes the snapshot an earlier uptime, for handling samples taken
+  // before the clock was set. The next snapshot() is the present again.
+  void replay_at(uint64_t uptime_ms) {
+    snapshot_ms_ = uptime_ms;
+  }
+
+  bool is_valid() const { return valid_; }
+
+  uint64_t uptime_ms() const { return snapshot_ms_; }
+
+  // Epoch seconds at the snapshot, 0 until synced
+  time_t now() const {
+    return valid_ ? time_t((int64_t(snapshot_ms_) + epoch_offset_ms_) / 1000) : 0;
+  }
+
+  // Local time at the snapshot. Converts, so not for the per sample path.
+  time::ESPTime local() const {
+    return time::ESPTime::from_epoch_local(now());
+  }
+
+  // epoch is the SNTP time now. Returns false if SNTP is not set yet.
+  bool sync(time_t epoch) {
+    if (epoch < valid_epoch) {
+      return false;
+    }
+
+    snapshot();
+    // epoch is whole seconds, on average half a second behind
+    int64_t offset_ms = int64_t(epoch) * 1000 + 500 - int64_t(uptime_ms_);
+    int64_t error_ms = offset_ms - epoch_offset_ms_;
+
+    if (!valid_ || error_ms > max_slew_ms || error_ms < -max_slew_ms) {
+      epoch_offset_ms_ = offset_ms;
+      valid_ = true;
+    } else if (error_ms > slew_step_ms) {
+      // Within a second is the resolution of epoch, so left alone
+      epoch_offset_ms_ += slew_step_ms;
+    } else if (error_ms < -slew_step_ms) {
+      epoch_offset_ms_ -= slew_step_ms;
+    }
+
+    return true;
+  }
+};
+
+extern APP_GLOBAL_STORAGE AppClock app_clock;
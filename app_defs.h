@@ -1,4 +1,10 @@
+// Ends a session on its first report without flow, whatever
+// end_session_secs and min_session_secs are (see water_usage.h). 
+// APP_RELEASE_SESSIONS builds the sessions as released, e.g., for the 
+// host fleet simulator to tune them.
+#ifndef APP_RELEASE_SESSIONS
 #define DEBUG_SESSION
+#endif
 
 // If any of above are defined then define APP_DEBUG_MODE below, 
 // otherwise comment out
@@ -21,10 +27,71 @@
 #define APP_LOG
 #endif
 
+// Flow meters (FlowChannel) per device, at most one per PCNT unit. Each
+// channel's state is allocated whether it is used or not.
+#define APP_MAX_FLOW_CHANNELS 4
+
+// Zones (steady flow stretches, e.g., irrigation zones) kept per water 
+// usage session. Each closed session keeps room for this many.
+#define APP_MAX_SESSION_ZONES 16
+
+// Closed sessions kept per channel ("closed_sessions_max" is capped to
+// this). With the zones a session is about 180 bytes, so this is about
+// 3 KB of heap per channel in use, 12 KB with APP_MAX_FLOW_CHANNELS.
+#define APP_MAX_CLOSED_SESSIONS 16
+
+// Closed units per get_closed message (see dApp::publish_closed()), so
+// the longest lists (168 units) go out in pages that fit the json arena
+// (json_arena.h). A session carries up to APP_MAX_SESSION_ZONES zones, 
+// so fewer fit.
+#define APP_CLOSED_PAGE_UNITS 48
+#define APP_CLOSED_PAGE_SESSIONS 8
+
+// Flow samples kept from boot until the time server sets the clock
+// (see early_samples.h)
+#define APP_EARLY_SAMPLES 128
+
+// State saved to flash for a warm restart (see app_snapshot.h): the
+// allowances kept and the room for the properties json
+#define APP_SNAPSHOT_ALLOWANCES 8
+#define APP_SNAPSHOT_PROPERTIES_SIZE 1536
+
+// Reads the PCNT units in a task of its own, pinned to a core with a
+// priority above the loop task, instead of in the loop task, so a slow
+// loop (a big publish, an MQTT reconnect) cannot delay or stretch a
+// sample (see water_flow_sensor.h). The over limit decision, and a wwh
+// device's valve closing, go with it. Reports wait in a queue of this
+// many for the loop. Uncomment to enable; the host tests build it
+// either way (see test/test_acquisition.cpp).
+//#define APP_ACQUISITION_TASK
+#define APP_ACQUISITION_QUEUE 32
+#define APP_ACQUISITION_CORE 1
+#define APP_ACQUISITION_PRIORITY 5
+
+// Records raw pulse edge times around sudden flow rate jumps, e.g., the
+// water hammer of a valve slamming, and publishes them on 
+// /sensor/wf/edges/state (see edge_capture.h). Each sensor keeps the
+// last APP_CAPTURE_EDGES edges and a capture runs from 
+// APP_CAPTURE_SECS before the jump to APP_CAPTURE_SECS after it.
+// Uncomment to enable.
+//#define APP_EDGE_CAPTURE
+#define APP_CAPTURE_EDGES 1024
+#define APP_CAPTURE_SECS 5
+
+// The time a sample or a tick may take before optional work (display, 
+// signature matching, session zones) is shed (see tick_budget.h)
+#define APP_TICK_BUDGET_US 50000
+
+// Entry point latency, allocation and heap metrics published on 
+// cmnd/get_metrics. Comment out to remove the instrumentation.
+#define APP_METRICS
+
+#include "app_metrics.h"
+
 #include "app_logger.h"
 
 #ifdef APP_LOG
-extern AppLog app_log;
+extern APP_GLOBAL_STORAGE AppLog app_log;
 #endif
 
 // Documents APIs that are entry points into the app from
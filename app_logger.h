@@ -1,6 +1,7 @@
 #pragma once
 
 #include "esphome.h"
+#include "app_metrics.h"
 using namespace esphome;
 
 //#define APP_LOG
@@ -78,7 +79,7 @@ using namespace esphome;
     }
   };
 
-  struct AppLog: public std::vector<AppLogLine> {
+  struct AppLog: public tracked_vector<AppLogLine, AllocSubsystem::app_log> {
     // The option to not emit is too embargo debug lines on
     // device start up, during which time the logger is not
     // active, and any debug statements will be lost. The logger 
@@ -0,0 +1,406 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include <esp_heap_caps.h>
+
+// See app_clock.h
+#ifndef APP_GLOBAL_STORAGE
+#define APP_GLOBAL_STORAGE
+#endif
+
+// Subsystems that allocate at run time. Allocations are attributed to
+// one of these by TrackedAllocator (std containers and strings) or by
+// APP_TRACKED_NEW (class level operator new/delete).
+enum class AllocSubsystem : uint8_t {
+  usage_lists,
+  usage_names,
+  allowances,
+  signatures,
+  app_log,
+  count
+};
+
+#ifdef APP_METRICS
+
+////////////////////////////////////////////////////////
+// Entry point latency metrics
+//
+// Every _entry_point function is timed with the cpu cycle
+// counter. For each entry point we keep a count, min, max
+// and a fixed log2 histogram of microseconds, so memory
+// use is constant no matter how long the device runs. The
+// p99 value is estimated from the histogram and is the
+// upper bound of the bucket holding the 99th percentile.
+//
+// Use "<topic-prefix>/cmnd/get_metrics" to have these
+// published (see dApp::get_metrics()).
+////////////////////////////////////////////////////////
+
+enum class EntryPoint : uint8_t {
+  create_wf_sensor,
+  on_boot,
+  process_properties,
+  send_retained_properties,
+  process_stat,
+  reset,
+  process_wf_on_value,
+  add_allowance,
+  delete_allowance,
+  on_new_hour,
+  on_new_day,
+  get_closed,
+  clear_closed,
+  set_valve_status,
+  toggle_valve,
+  add_named_usage,
+  delete_named_usage,
+  set_report_period_secs,
+  get_metrics,
+  process_stat_property,
+  on_tick,
+  on_shutdown,
+  count
+};
+
+struct EntryPointStats {
+  // Bucket i holds durations of [2^i, 2^(i+1)) microseconds. The last
+  // bucket also holds everything above it (> 8 secs).
+  static const int bucket_count = 24;
+
+  uint32_t count = 0;
+  uint32_t min_us = 0;
+  uint32_t max_us = 0;
+  uint32_t buckets[bucket_count] = {0};
+
+  void record(uint32_t us) {
+    if (count == 0 || us < min_us) {
+      min_us = us;
+    }
+    if (us > max_us) {
+      max_us = us;
+    }
+    ++count;
+
+    int bucket = us ? 31 - __builtin_clz(us) : 0;
+    if (bucket >= bucket_count) {
+      bucket = bucket_count - 1;
+    }
+    ++buckets[bucket];
+  }
+
+  uint32_t percentile_us(float percentile) const {
+    if (count == 0) {
+      return 0;
+    }
+    uint32_t wanted = uint32_t(count * percentile);
+    uint32_t so_far = 0;
+    for (int i = 0; i < bucket_count; ++i) {
+      so_far += buckets[i];
+      if (so_far > wanted) {
+        // Upper bound of the bucket, but never more than we have seen
+        uint32_t upper = (uint32_t(2) << i) - 1;
+        return upper < max_us ? upper : max_us;
+      }
+    }
+    return max_us;
+  }
+
+  void clear() {
+    *this = EntryPointStats();
+  }
+};
+
+////////////////////////////////////////////////////////
+// Allocation accounting
+//
+// Live allocation count and bytes per subsystem with their
+// high water marks. The heap itself is sampled hourly into
+// a small ring so fragmentation (free heap vs the largest
+// free block) can be seen over the last day.
+////////////////////////////////////////////////////////
+
+struct AllocStats {
+  uint32_t allocs = 0;
+  uint32_t frees = 0;
+  uint32_t bytes = 0;
+  uint32_t high_water_bytes = 0;
+
+  void on_alloc(size_t size) {
+    ++allocs;
+    bytes += size;
+    if (bytes > high_water_bytes) {
+      high_water_bytes = bytes;
+    }
+  }
+
+  void on_free(size_t size) {
+    ++frees;
+    bytes -= size;
+  }
+};
+
+struct AllocTracker {
+  AllocStats subsystems[int(AllocSubsystem::count)];
+
+  struct HeapSample {
+    uint32_t free = 0;
+    uint32_t largest_block = 0;
+  };
+
+  static const int heap_history_count = 24;
+  HeapSample heap_history[heap_history_count];
+  int heap_history_next = 0;
+  int heap_history_size = 0;
+  uint32_t largest_block_low_water = 0;
+
+  static const char* name(AllocSubsystem subsystem) {
+    static const char* const names[] = {
+      "usage_lists",
+      "usage_names",
+      "allowances",
+      "signatures",
+      "app_log",
+    };
+    return names[int(subsystem)];
+  }
+
+  void on_alloc(AllocSubsystem subsystem, size_t size) {
+    subsystems[int(subsystem)].on_alloc(size);
+  }
+
+  void on_free(AllocSubsystem subsystem, size_t size) {
+    subsystems[int(subsystem)].on_free(size);
+  }
+
+  // Walking the heap for the largest block is not free, so this is
+  // called from on_new_hour() and get_metrics() only.
+  HeapSample sample_heap(bool save) {
+    HeapSample sample;
+    sample.free = ESP.getFreeHeap();
+    sample.largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    if (largest_block_low_water == 0 || sample.largest_block < largest_block_low_water) {
+      largest_block_low_water = sample.largest_block;
+    }
+
+    if (save) {
+      heap_history[heap_history_next] = sample;
+      heap_history_next = (heap_history_next + 1) % heap_history_count;
+      if (heap_history_size < heap_history_count) {
+        ++heap_history_size;
+      }
+    }
+
+    return sample;
+  }
+
+  JsonObject& toJson(JsonBuffer& jb, JsonObject& jo) {
+    HeapSample now = sample_heap(false);
+
+    JsonObject& joHeap = jb.createObject();
+    joHeap["free"] = now.free;
+    joHeap["min_free"] = ESP.getMinFreeHeap();
+    joHeap["largest_block"] = now.largest_block;
+    joHeap["largest_block_min"] = largest_block_low_water;
+
+    // Oldest first: [[free, largest_block], ...]
+    JsonArray& jaHistory = jb.createArray();
+    int index = (heap_history_next - heap_history_size + heap_history_count) % heap_history_count;
+    for (int i = 0; i < heap_history_size; ++i) {
+      JsonArray& ja = jb.createArray();
+      ja.add(heap_history[index].free);
+      ja.add(heap_history[index].largest_block);
+      jaHistory.add(ja);
+      index = (index + 1) % heap_history_count;
+    }
+    joHeap["hourly"] = jaHistory;
+    jo["heap"] = joHeap;
+
+    // Compact array: [live allocs, live bytes, high water bytes]
+    JsonObject& joAlloc = jb.createObject();
+    for (int i = 0; i < int(AllocSubsystem::count); ++i) {
+      const AllocStats& stats = subsystems[i];
+      JsonArray& ja = jb.createArray();
+      ja.add(stats.allocs - stats.frees);
+      ja.add(stats.bytes);
+      ja.add(stats.high_water_bytes);
+      joAlloc[name(AllocSubsystem(i))] = ja;
+    }
+    jo["alloc"] = joAlloc;
+
+    return jo;
+  }
+};
+
+struct AppMetrics {
+  EntryPointStats entry_points[int(EntryPoint::count)];
+  AllocTracker alloc;
+
+  static const char* name(EntryPoint ep) {
+    static const char* const names[] = {
+      "create_wf_sensor",
+      "on_boot",
+      "process_properties",
+      "send_retained_properties",
+      "process_stat",
+      "reset",
+      "process_wf_on_value",
+      "add_allowance",
+      "delete_allowance",
+      "on_new_hour",
+      "on_new_day",
+      "get_closed",
+      "clear_closed",
+      "set_valve_status",
+      "toggle_valve",
+      "add_named_usage",
+      "delete_named_usage",
+      "set_report_period_secs",
+      "get_metrics",
+      "process_stat_property",
+      "on_tick",
+      "on_shutdown",
+    };
+    return names[int(ep)];
+  }
+
+  void record(EntryPoint ep, uint32_t cycles) {
+    entry_points[int(ep)].record(cycles / ESP.getCpuFreqMHz());
+  }
+
+  void clear() {
+    for (EntryPointStats& stats: entry_points) {
+      stats.clear();
+    }
+  }
+
+  JsonObject& toJson(JsonBuffer& jb, JsonObject& jo) {
+    alloc.toJson(jb, jo);
+
+    JsonObject& joEntryPoints = jb.createObject();
+    for (int i = 0; i < int(EntryPoint::count); ++i) {
+      const EntryPointStats& stats = entry_points[i];
+      if (stats.count == 0) {
+        continue;
+      }
+      // Compact array: [count, min_us, max_us, p99_us]
+      JsonArray& ja = jb.createArray();
+      ja.add(stats.count);
+      ja.add(stats.min_us);
+      ja.add(stats.max_us);
+      ja.add(stats.percentile_us(0.99f));
+      joEntryPoints[name(EntryPoint(i))] = ja;
+    }
+    jo["entry_points"] = joEntryPoints;
+
+    return jo;
+  }
+};
+
+extern APP_GLOBAL_STORAGE AppMetrics app_metrics;
+
+// Times the enclosing scope and records it against the entry point
+struct EntryPointTimer {
+  EntryPoint ep_;
+  uint32_t start_;
+
+  EntryPointTimer(EntryPoint ep):
+    ep_(ep),
+    start_(ESP.getCycleCount()) {
+  }
+
+  ~EntryPointTimer() {
+    app_metrics.record(ep_, ESP.getCycleCount() - start_);
+  }
+};
+
+#define APP_METRICS_ENTRY(ep) EntryPointTimer _entry_point_timer(EntryPoint::ep)
+
+inline void app_metrics_on_alloc(AllocSubsystem subsystem, size_t size) {
+  app_metrics.alloc.on_alloc(subsystem, size);
+}
+inline void app_metrics_on_free(AllocSubsystem subsystem, size_t size) {
+  app_metrics.alloc.on_free(subsystem, size);
+}
+
+#else
+#define APP_METRICS_ENTRY(ep)
+
+inline void app_metrics_on_alloc(AllocSubsystem, size_t) {}
+inline void app_metrics_on_free(AllocSubsystem, size_t) {}
+
+#endif
+
+// Standard allocator that attributes its allocations to a subsystem.
+// Spelled out in full (rather than relying on allocator_traits) 
+// because the toolchain's std::string still wants the old interface.
+template<class T, AllocSubsystem S>
+struct TrackedAllocator {
+  typedef T           value_type;
+  typedef T*          pointer;
+  typedef const T*    const_pointer;
+  typedef T&          reference;
+  typedef const T&    const_reference;
+  typedef size_t      size_type;
+  typedef ptrdiff_t   difference_type;
+
+  template<class U>
+  struct rebind { typedef TrackedAllocator<U, S> other; };
+
+  TrackedAllocator() {}
+  template<class U>
+  TrackedAllocator(const TrackedAllocator<U, S>&) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void* = nullptr) {
+    app_metrics_on_alloc(S, n * sizeof(T));
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(pointer p, size_type n) {
+    app_metrics_on_free(S, n * sizeof(T));
+    ::operator delete(p);
+  }
+
+  size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+
+  template<class U>
+  void destroy(U* p) { p->~U(); }
+};
+
+template<class T, class U, AllocSubsystem S>
+bool operator==(const TrackedAllocator<T, S>&, const TrackedAllocator<U, S>&) { return true; }
+template<class T, class U, AllocSubsystem S>
+bool operator!=(const TrackedAllocator<T, S>&, const TrackedAllocator<U, S>&) { return false; }
+
+template<AllocSubsystem S>
+using tracked_string = std::basic_string<char, std::char_traits<char>, TrackedAllocator<char, S>>;
+
+template<class T, AllocSubsystem S>
+using tracked_vector = std::vector<T, TrackedAllocator<T, S>>;
+
+// Class level operator new/delete attributing the class's heap
+// allocations (single and array) to a subsystem.
+#define APP_TRACKED_NEW(subsystem) \
+  static void* operator new(size_t size) { \
+    app_metrics_on_alloc(subsystem, size); \
+    return ::operator new(size); \
+  } \
+  static void operator delete(void* p, size_t size) { \
+    app_metrics_on_free(subsystem, size); \
+    ::operator delete(p); \
+  } \
+  static void* operator new[](size_t size) { \
+    app_metrics_on_alloc(subsystem, size); \
+    return ::operator new[](size); \
+  } \
+  static void operator delete[](void* p, size_t size) { \
+    app_metrics_on_free(subsystem, size); \
+    ::operator delete[](p); \
+  }
@@ -0,0 +1,87 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+// water_usage.h and usage_budget.h are included by dapp.h before this
+
+////////////////////////////////////////////////////////
+// Snapshots of dApp state saved to flash
+//
+// So a reboot (or the reboot after an OTA update) picks up
+// where it left off without waiting on the broker's
+// retained /stat. dApp saves them on a timer and at
+// shutdown and restores them in on_boot().
+//
+// AppSnapshot is the state that is not a property: the
+// current units of the usage lists, the over limit state,
+// the rule in force and the budget sums, and the
+// allowances, as fixed size plain data. The
+// properties are saved as their json (the light ones,
+// less valve_open, which must not move the valve) in a
+// PropertiesSnapshot. The retained /stat is still applied
+// when it arrives.
+//
+// Either is ignored if its version is not current, so
+// change the version whenever a layout changes.
+////////////////////////////////////////////////////////
+
+struct AppSnapshot {
+  static const uint32_t current_version = 2;
+
+  // A usage list's current unit
+  struct Unit {
+    time_t  start_time;
+    float   usage;
+
+    void save(const WaterUsageTimed& unit) {
+      start_time = unit.start_time;
+      usage = unit.usage;
+    }
+
+    void restore(WaterUsageTimed& unit) const {
+      unit.start_time = start_time;
+      unit.usage = usage;
+    }
+  };
+
+  struct Channel {
+    Unit    current_usage;
+    Unit    hourly_usage;
+    Unit    daily_usage;
+    Unit    session_usage;
+    float   usage_since_max_set;
+    float   usage_since_schedule;
+    int     schedule_rule;
+    int     secs_over_limit;
+    int     grace_for_surge;
+    int     hours_without_base;
+    bool    over_limit;
+    bool    usage_over;
+  };
+
+  struct Allowance {
+    char    name[32];
+    float   upm;
+    float   usage;
+    time_t  expire_time;
+    bool    create_named_session;
+  };
+
+  uint32_t  version;
+  time_t    saved_time;
+  bool      valve_is_open;
+  Channel   channels[APP_MAX_FLOW_CHANNELS];
+  int       allowance_count;
+  Allowance allowances[APP_SNAPSHOT_ALLOWANCES];
+  // Matched to the restored budgets by their window
+  int       budget_count;
+  UsageBudget budgets[APP_MAX_USAGE_BUDGETS];
+};
+
+struct PropertiesSnapshot {
+  static const uint32_t current_version = 1;
+
+  uint32_t  version;
+  char      json[APP_SNAPSHOT_PROPERTIES_SIZE];
+};
@@ -0,0 +1,103 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <math.h>
+#include <functional>
+
+// Streaming weighted mean, variance, min and max (Welford / West).
+// O(1) per sample and constant memory. Samples are weighted by the
+// seconds they cover since report periods vary.
+struct RunningStats {
+  float weight = 0;
+  float mean = 0;
+  float m2 = 0;
+  float min = 0;
+  float max = 0;
+
+  void add(float x, float w) {
+    if (w <= 0) {
+      return;
+    }
+    if (weight == 0) {
+      min = max = x;
+    } else {
+      min = x < min ? x : min;
+      max = x > max ? x : max;
+    }
+    weight += w;
+    float delta = x - mean;
+    mean += (w / weight) * delta;
+    m2 += w * delta * (x - mean);
+  }
+
+  bool empty() const { return weight == 0; }
+  float variance() const { return weight > 0 ? m2 / weight : 0; }
+  float stddev() const { return sqrtf(variance()); }
+
+  void clear() {
+    *this = RunningStats();
+  }
+};
+
+////////////////////////////////////////////////////////
+// BaselineMonitor: the no-flow flow of a channel
+//
+// Nobody should be using water during the night window
+// (see the "baseline" property) so the flow then is the
+// channel's baseline. Its statistics are collected per
+// night. When a night ends we suggest a water_flow_base
+// and test for a slow leak: flow that never got down to
+// water_flow_base all night, or a nightly mean that has
+// drifted above the running reference of previous nights.
+// A dripping toilet shows up here long before the bill.
+////////////////////////////////////////////////////////
+
+struct BaselineMonitor {
+  RunningStats night;
+  bool in_night = false;
+  // Average of previous nights' means, < 0 until there is one
+  float reference = -1;
+  bool slow_leak = false;
+
+  // How much a night counts in the reference
+  static constexpr float reference_weight = 0.2f;
+
+  void add(float upm, int secs) {
+    if (in_night) {
+      night.add(upm, secs);
+    }
+  }
+
+  // At or below this is no flow on a night like the last one
+  float suggested_base() const {
+    return night.mean + 3 * night.stddev();
+  }
+
+  // Called when the night window ends. Returns true if slow_leak changed.
+  bool close_night(float upm_base, float drift) {
+    bool was = slow_leak;
+
+    if (!night.empty()) {
+      slow_leak = night.min > upm_base ||
+        (reference >= 0 && night.mean > reference + drift);
+
+      // A leaking night is not folded into the reference, so the
+      // reference does not follow the leak up
+      if (reference < 0) {
+        reference = night.mean;
+      } else if (!slow_leak) {
+        reference += reference_weight * (night.mean - reference);
+      }
+    }
+
+    return slow_leak != was;
+  }
+
+  void convert_uom(std::function<float(float &)>f) {
+    if (reference >= 0) {
+      reference = f(reference);
+    }
+    // A partial night in two units is meaningless
+    night.clear();
+  }
+};
@@ -0,0 +1,48 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+////////////////////////////////////////////////////////
+// ContinuousFlowDetector: flow that never stops
+//
+// A slow leak never goes over limit, but it never lets
+// the flow get down to water_flow_base either. Per sample
+// we only note whether the flow reached base; the counting
+// is done on the hourly rollover. So memory is constant
+// and the resolution is an hour: only whole hours without
+// a single no-flow report are counted.
+////////////////////////////////////////////////////////
+
+struct ContinuousFlowDetector {
+  // Set by any report at or below base, cleared every hour. True to start
+  // with so the partial first hour after boot does not count.
+  bool reached_base = true;
+  // Whole hours since the flow was last at base, and the longest such run
+  int hours_without_base = 0;
+  int longest_hours_without_base = 0;
+  bool alarm = false;
+
+  void add(float upm, float upm_base) {
+    if (upm <= upm_base) {
+      reached_base = true;
+    }
+  }
+
+  // Called on the hourly rollover. Returns true if alarm changed.
+  bool next_hour(int alarm_hours) {
+    bool was = alarm;
+
+    if (reached_base) {
+      hours_without_base = 0;
+    } else {
+      ++hours_without_base;
+      if (hours_without_base > longest_hours_without_base) {
+        longest_hours_without_base = hours_without_base;
+      }
+    }
+    reached_base = false;
+
+    alarm = alarm_hours > 0 && hours_without_base >= alarm_hours;
+
+    return alarm != was;
+  }
+};
@@ -24,27 +24,28 @@ extern gpio::GPIOSwitch *valve_close;
 //#endif
 
 
+// Defined before dapp so the allocation accounting is ready for the
+// allocations dapp makes while it is constructed
+#ifdef APP_METRICS
+AppMetrics app_metrics;
+#endif
+
+AppClock app_clock;
+
 dApp dapp;
 
 #ifdef APP_LOG
 AppLog app_log;
 #endif
 
-// Mirrors dapp.upm_base for the benefit of WaterUsage
-float* g_upm_base;
-pulse_counter::pulse_counter_t* g_pulses_base;
-
 ///////////////////////////////////////////////////////////////////////////////////////////
 dApp::dApp() {
-
-    // Global cheat for WaterUsage objects
-    g_upm_base = &upm_base_;
-    g_pulses_base = &pulses_base_;
 }
 
 
 // Called at on_boot level 600 where sensors are setup but wifi (and mqtt) are not
 void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_secs, int wf_report_wf_on_interval_secs) {
+    APP_METRICS_ENTRY(on_boot);
 
     APP_LOG_ENTER("on_boot()");
 
@@ -52,7 +53,17 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
 
     app_ = app;
 
-    wf_->on_start_init(wf_report_wf_off_interval_secs, wf_report_wf_on_interval_secs);
+    for (int i = 0; i < channel_count_; ++i) {
+      channels_[i].wf->on_start_init(wf_report_wf_off_interval_secs, wf_report_wf_on_interval_secs);
+    }
+
+    // Pick up where we left off, without waiting for the broker
+    restore_snapshot();
+
+    // The writer draws whatever the model has; on_tick() decides when
+    ssd1306_i2c_i2cssd1306->set_writer([this](display::DisplayBuffer & it) -> void {
+        display_.draw(it, fontOpenSans);
+    });
 
     calc_max_plus_values();
 
@@ -76,12 +87,12 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
     mqttTopicClosedUsageState_ = prefix + mqttTopicClosedUsageState_;
     mqttTopicStat_ = prefix + mqttTopicStat_;
     mqttTopicProp_ = prefix + mqttTopicProp_;
-    mqttSensorWfOverlimitStatus_ = prefix + mqttSensorWfOverlimitStatus_;
-    mqttSensorWfCurrentUsageState_ = prefix + mqttSensorWfCurrentUsageState_;
-    mqttSensorWfHourlyUsageStatus_ = prefix + mqttSensorWfHourlyUsageStatus_;
-    mqttSensorWfDailyUsageStatus_ = prefix + mqttSensorWfDailyUsageStatus_;
-    mqttSensorWfSessionUsageState_ = prefix + mqttSensorWfSessionUsageState_;
     mqttSensorWfNamedUsageState_ = prefix + mqttSensorWfNamedUsageState_;
+    mqttSensorMetricsState_ = prefix + mqttSensorMetricsState_;
+
+    for (int i = 0; i < APP_MAX_FLOW_CHANNELS; ++i) {
+      channels_[i].makeMqttTopics(prefix, i);
+    }
 
   }
 
@@ -94,7 +105,7 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
     [Hourly usage totals can be saved in array in device.
     Use mqtt topic "<topic-prefix>/cmnd/get_closed_periods" to have
     waterwatch send array in mqtt json message topic
-    "/sensor/wf/closed_usage/state".
+    "/sensor/wf/closed_usage/state", in parts (see publish_closed()).
     Use mqtt message topic "<topic-prefix>/cmnd/clear_closed" to
     clear this array and session array.]
     "closed_periods_max": 48,
@@ -142,17 +153,24 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
     of irrigating which we call a session. The next three properties
     control this feature]
 
-    [How many sessions to save before overwriting oldest]
+    [How many sessions to save before overwriting oldest, at most 16]
     "closed_sessions_max": 14
 
     [Sessions shorter than min_secs will be thrown out]
     "min_session_secs": 420,
 
     [When one zone valve closes and another opens there
-    may be no water flow. How long to allow for this. (in
-    the future these subs zones will alse be saved)]
+    may be no water flow. How long to allow for this.]
     "end_session_secs": 180
 
+    [Sessions are split into zones, e.g., one per irrigation zone 
+    valve. A zone ends on a pause in the flow (shorter than 
+    end_session_secs) or when the flow steps this fraction away from 
+    the zone's mean flow for two reports in a row (0 for pauses only).
+    Closed sessions have "zones": [[start, seconds, usage], ...], 
+    times in seconds from the start of the session.]
+    "session_zone_step": 0.25
+
     [How often we report water flow in seconds. "wf_off" mode is
     when there is no water flow, wf_on mode is when there is water flow.
     A value of 0 means to report only on change of flow. 
@@ -166,6 +184,94 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
       "wf_on": 0   
     }
 
+    [The properties above that describe a flow (water_flow_max,
+    water_flow_base, test_period_secs, initial_surge_secs, the session
+    properties and report_period_secs) are for channel 0, the device's 
+    first (or only) flow meter. A device with more flow meters has a 
+    channel for each (see flow_channel.h). "channels" has an object per
+    channel, in channel order, with any of those properties plus a 
+    "name". Channel n > 0 publishes on "<topic-prefix>/sensor/wf<n>/...".
+    Specific allowances and named usage apply to channel 0. 
+    "closed_periods_max" applies to all channels.]
+    "channels": [
+      { "name": "main" },
+      { "name": "irrigation", "water_flow_max": 8.0, "min_session_secs": 600 }
+    ]
+
+    [Slow leak detection. Flow during the night window (local hours, 
+    "night_end" exclusive) is taken as each channel's no-flow baseline.
+    When the window ends its statistics and a suggested water_flow_base
+    are published on "<topic-prefix>/sensor/wf/baseline/state". 
+    "<topic-prefix>/sensor/wf/slow_leak/status" goes "on" when flow 
+    never got down to water_flow_base all night, or the night's mean 
+    flow is more than "drift" above the average of earlier nights.]
+    "baseline": {
+      "night_start": 1,
+      "night_end": 5,
+      "drift": 0.05
+    }
+
+    [Continuous flow (leak) alarm. When a channel's flow has not once
+    been down to water_flow_base for "hours" whole hours, 
+    "<topic-prefix>/sensor/wf/continuous_flow/status" goes "on" (0 
+    turns this off). With "close_valve" a wwh device also closes its
+    valve.]
+    "continuous_flow": {
+      "hours": 24,
+      "close_valve": false
+    }
+
+    [Flow level change detection. A change is a step in the flow of at
+    least "step" (a fraction of the flow), "min_step_pulses" and 
+    "noise" times the pulse count's expected deviation, sustained 
+    until "threshold" steps have built up (see flow_change_detector.h).
+    Each change is reported right away and published on
+    "<topic-prefix>/sensor/wf/flow_change/state" as 
+    { "before": 0.0, "after": 2.5, "timestamp": ... }.]
+    "flow_change": {
+      "step": 0.2,
+      "min_step_pulses": 2,
+      "noise": 2,
+      "threshold": 4
+    }
+
+    [Usage (volume) limits. Going over one is over limit just like 
+    going over water_flow_max: "sensor/wf/over_limit/status" goes "on" 
+    and a wwh device closes its valve.
+    "water_usage_max" is the most channel 0 may use from when it is set
+    (plus specific allowance usage), -1 for no limit. 
+    "usage_budgets" limits usage over a window, either daily local 
+    hours ("start" to "end", end exclusive) or the last "hours" hours 
+    (at most 24). "channel" defaults to 0.]
+    "water_usage_max": -1,
+    "usage_budgets": [
+      { "max": 5, "start": 23, "end": 6 },
+      { "max": 200, "hours": 24 }
+    ]
+
+    [Limits by time of day and weekday. While a rule is in force its 
+    "max_upm" and/or "max_usage" replace water_flow_max and 
+    water_usage_max ("max_usage" counts from the rule's start). "days"
+    is a mask, bit 0 Sunday to bit 6 Saturday (default 127, every day).
+    "start" and "end" are local minutes since midnight, end exclusive; 
+    a rule with end <= start runs past midnight. The first rule in 
+    force for a channel wins. "channel" defaults to 0. At most 8.]
+    "schedule": [
+      { "days": 127, "start": 1380, "end": 360, "max_upm": 0.5, "max_usage": 5 },
+      { "days": 62, "start": 540, "end": 1020, "max_upm": 1 }
+    ]
+
+    [Property changes are not published to /stat right away. The first
+    change starts this window and everything that changes within it
+    goes out in one /stat message. 0 publishes on every change.
+    "<topic-prefix>/cmnd/send_stat" always publishes immediately.]
+    "stat_coalesce_ms": 1000,
+
+    [The heavy properties ("signatures") can be large.
+    When true they are left out of /stat and each is published 
+    retained on "<topic-prefix>/stat/<name>", and only when it changes.]
+    "stat_diff": false
+
     Other items needed:
       cmmd/signature/add
       cmmd/signature/remove
@@ -179,9 +285,97 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
           [<upm>, <upm_allowance>, <duration_ms>, <duration_allowance_ms>],
           ...
         ]} 
+
+      Signatures are matched against channel 0's flow less the known 
+      loads (allowances with a "upm"). A match is published on 
+      "sensor/wf/usage/named/state" as a closed named usage with 
+      "signature": true.
   }
 */
+const PropertyDescriptor<dApp> dApp::properties_[dApp::prop_count] = {
+  #define P(name, type, validate, hook, out) \
+    { #name, PropType::type, &dApp::prop_get_##name, &dApp::prop_set_##name, validate, hook, PropOut::out },
+  DAPP_PROPERTIES(P)
+  #undef P
+};
+
+int dApp::find_property(const char* name) {
+  int index;
+
+  switch (prop_hash(name)) {
+    #define P(name, type, validate, hook, out) \
+      case prop_hash(#name): index = prop_##name; break;
+    DAPP_PROPERTIES(P)
+    #undef P
+    default:
+      return -1;
+  }
+
+  return strcmp(properties_[index].name, name) == 0 ? index : -1;
+}
+
+uint32_t dApp::heavy_props_mask() {
+  uint32_t mask = 0;
+  for (int index = 0; index < prop_count; ++index) {
+    if (properties_[index].out == PropOut::heavy) {
+      mask |= 1 << index;
+    }
+  }
+  return mask;
+}
+
+uint32_t dApp::apply_properties(const JsonObject& jo, uint32_t skip/*=0*/) {
+
+    // One pass over the message to find the properties we know...
+    static_assert(prop_count <= 32, "property mask is 32 bits");
+    uint32_t present = 0;
+    uint32_t applied = 0;
+    JsonVariant values[prop_count];
+
+    for (const JsonPair& kv : jo) {
+      int index = find_property(kv.key);
+      if (index < 0) {
+        APP_LOG_LOG("%s: unknown property ignored", kv.key);
+        continue;
+      }
+      present |= 1 << index;
+      values[index] = kv.value;
+    }
+
+    present &= ~skip;
+
+    // ...and then apply them in table order
+    for (int index = 0; present && index < prop_count; ++index) {
+      if (!(present & (1 << index))) {
+        continue;
+      }
+      present &= ~(1 << index);
+
+      const PropertyDescriptor<dApp>& prop = properties_[index];
+      const JsonVariant& value = values[index];
+
+      if (!prop_type_matches(prop.type, value) || 
+          (prop.validate && !(this->*prop.validate)(value))) {
+        APP_LOG_LOG("%s: invalid value ignored", prop.name); 
+        continue;
+      }
+
+      (this->*prop.set)(value);
+
+      if (prop.hook) {
+        (this->*prop.hook)();
+      }
+
+      applied |= 1 << index;
+    }
+
+    have_props_ |= applied;
+
+    return applied;
+}
+
   void _entry_point dApp::process_properties(const JsonObject& jo, bool fromRetainedProperties/*=false*/) {
+    APP_METRICS_ENTRY(process_properties);
     
     //APP_LOG_EMIT_ON(true);
 
@@ -189,258 +383,838 @@ void _entry_point dApp::on_boot(const char* app, int wf_report_wf_off_interval_s
 
     APP_LOG_LOG("\n\nBegin: process_properties(arg count=%i)", jo.size()); 
 
-    if ( jo.containsKey("timezone") && jo["timezone"].is<char*>()) {
-      std::string was = sntp_time->get_timezone();
-      sntp_time->set_timezone(jo["timezone"]);
-
-      // time_t now = sntp_time->timestamp_now();
-      // std::string str_time_now = ESPTime::from_epoch_local(now).strftime("%Y-%m-%d %H:%M");
+    uint32_t applied = apply_properties(jo);
 
-      // APP_LOG_LOG("timezone: specified %s, was %s now %s, time is %s, num=%f",  (const char*)jo["timezone"], 
-      //   was.c_str(), sntp_time->get_timezone().c_str(), str_time_now.c_str(), (float)now); 
-      APP_LOG_LOG("timezone: specified %s, was %s now %s",  (const char*)jo["timezone"], 
-        was.c_str(), sntp_time->get_timezone().c_str()); 
+    if (fromRetainedProperties) {
+      haveRetainedProperties_ = true;
+    } else {
+      // Send retained message (soon, see mark_properties_dirty())
+      // This serves two purposes:
+      //  1. If this is from set options cmnd the call gets feedback that
+      //    the option has been received.
+      //  2. Since the mqtt message is "retained" it will be resent to this 
+      //    device whenever it connects to mqtt, providing persistence of 
+      //    these values.
+      // Values that came from the retained message are already retained.
+      mark_properties_dirty(applied);
     }
 
-    if ( jo.containsKey("closed_periods_max") && jo["closed_periods_max"].is<int>() /*&& jo.size() == 1*/) {
-      int was = hourlyWaterUsage_.get_max_closed();
-      APP_LOG_LOG("closed_periods_max: specified %i, was %i now %i",  (int)jo["closed_periods_max"], was, hourlyWaterUsage_.get_max_closed()); 
-      hourlyWaterUsage_.set_max_closed(jo["closed_periods_max"]);
-      dailyWaterUsage_.set_max_closed(jo["closed_periods_max"]);
-    }
+    APP_LOG_EXIT("process_properties"); 
+    // APP_LOG_EMIT_ON(true);
+
+  }
 
+void dApp::prop_get_timezone(JsonBuffer& jb, JsonObject& jo) {
+  jo["timezone"] = sntp_time->get_timezone();
+}
 
-    if ( jo.containsKey("unit_of_measure") && jo["unit_of_measure"].is<char*>()) {
-      const char* was = xlate_mgr_.current->uom_text(); 
-      const char* uom = jo["unit_of_measure"];
+void dApp::prop_set_timezone(const JsonVariant& v) {
+  std::string was = sntp_time->get_timezone();
+  sntp_time->set_timezone(v.as<const char*>());
 
-     if (xlate_mgr_.set_current(uom)) {
-       convert_uom(was);
-     }
-     
-      APP_LOG_LOG("unit_of_measure: specified %s, was %s, now %s", uom, was, xlate_mgr_.current->uom_text()); 
-    }
+  // time_t now = sntp_time->timestamp_now();
+  // std::string str_time_now = ESPTime::from_epoch_local(now).strftime("%Y-%m-%d %H:%M");
 
-    if ( jo.containsKey("water_flow_max") && jo["water_flow_max"].is<float>()) {
-      float was = max_upm_;
-      max_upm_ = (float)jo["water_flow_max"];
-      calc_max_plus_values();
-      APP_LOG_LOG("max_upm: was %f, now %f", was, max_upm_); 
-    }
+  // APP_LOG_LOG("timezone: specified %s, was %s now %s, time is %s, num=%f",  (const char*)jo["timezone"], 
+  //   was.c_str(), sntp_time->get_timezone().c_str(), str_time_now.c_str(), (float)now); 
+  APP_LOG_LOG("timezone: specified %s, was %s now %s",  v.as<const char*>(), 
+    was.c_str(), sntp_time->get_timezone().c_str()); 
+}
 
-    if ( jo.containsKey("water_flow_base") && jo["water_flow_base"].is<float>()) {
-      float was = upm_base_;
-      upm_base_ = (float)jo["water_flow_base"];
-      pulses_base_ = xlate_mgr_.current->convert_pulses_to_uom(upm_base_);
-      APP_LOG_LOG("upm_base: was %f, now %f", was, upm_base_); 
-    }
+void dApp::prop_get_closed_periods_max(JsonBuffer& jb, JsonObject& jo) {
+  jo["closed_periods_max"] = channels_[0].hourly_usage.get_max_closed();
+}
 
-    if ( jo.containsKey("calibrate_factor") && jo["calibrate_factor"].is<float>()) {
-      float was = xlate_mgr_.get_calibrate_factor();
-      float specified = jo["calibrate_factor"];
-      // Zero would cause divide by zero error
-      if (specified != 0 && calibrate_factor_ != specified) {
-        // New calibrate factor -- need to update translation units and
-        // translate stored values
-        xlate_mgr_.set_calibrate_factor(specified);
-        convert_uom(nullptr, was);
-      }
-      APP_LOG_LOG("calibrate_factor: specified %f, was %f, now %f", specified, was, calibrate_factor_); 
-    }
+void dApp::prop_set_closed_periods_max(const JsonVariant& v) {
+  int was = channels_[0].hourly_usage.get_max_closed();
+  for (FlowChannel& ch : channels_) {
+    ch.hourly_usage.set_max_closed(v.as<int>());
+    ch.daily_usage.set_max_closed(v.as<int>());
+  }
+  APP_LOG_LOG("closed_periods_max: specified %i, was %i now %i",  v.as<int>(), was, 
+    channels_[0].hourly_usage.get_max_closed()); 
+}
 
-    if ( jo.containsKey("test_period_secs") && jo["test_period_secs"].is<int>()) {
-      int was = test_period_secs_;
-      test_period_secs_ = jo["test_period_secs"];
-      APP_LOG_LOG("test_period_secs: was %i now %i",  was, test_period_secs_); 
-    }
+void dApp::prop_get_unit_of_measure(JsonBuffer& jb, JsonObject& jo) {
+  jo["unit_of_measure"] = xlate_mgr_.current->uom_text();
+}
 
-    if ( jo.containsKey("initial_surge_secs") && jo["initial_surge_secs"].is<int>()) {
-      int was = allow_initial_surge_seconds_;
-      allow_initial_surge_seconds_ = jo["initial_surge_secs"];
-      APP_LOG_LOG("initial_surge_secs: was %i now %i",  was, allow_initial_surge_seconds_); 
-    }
+void dApp::prop_set_unit_of_measure(const JsonVariant& v) {
+  const char* was = xlate_mgr_.current->uom_text(); 
+  const char* uom = v.as<const char*>();
 
-    if ( jo.containsKey("closed_sessions_max") && jo["closed_sessions_max"].is<int>() /*&& jo.size() == 1*/) {
-      int was = sessionWaterUsage_.get_max_closed();
-      sessionWaterUsage_.set_max_closed(jo["closed_sessions_max"]);
-      APP_LOG_LOG("closed_sessions_max: specified %i, was %i now %i",  
-        (int)jo["closed_sessions_max"], was, sessionWaterUsage_.get_max_closed()); 
-    }
+  if (xlate_mgr_.set_current(uom)) {
+    convert_uom(was);
+  }
+ 
+  APP_LOG_LOG("unit_of_measure: specified %s, was %s, now %s", uom, was, xlate_mgr_.current->uom_text()); 
+}
 
-    if ( jo.containsKey("min_session_secs") && jo["min_session_secs"].is<int>()) {
-      int was = sessionWaterUsage_.get_min_session_secs();
-      sessionWaterUsage_.set_min_session_secs(jo["min_session_secs"]);
-      APP_LOG_LOG("min_session_secs: specified %i, was %i now %i",  
-        (int)jo["min_session_secs"], was, sessionWaterUsage_.get_min_session_secs()); 
-    }
+void dApp::prop_get_water_flow_max(JsonBuffer& jb, JsonObject& jo) {
+  jo["water_flow_max"] = channels_[0].max_upm;
+}
 
-    if ( jo.containsKey("end_session_secs") && jo["end_session_secs"].is<int>()) {
-      int was = sessionWaterUsage_.get_end_session_secs();
-      sessionWaterUsage_.set_end_session_secs(jo["end_session_secs"]);
-      APP_LOG_LOG("end_session_secs: specified %i, was %i now %i",  
-        (int)jo["end_session_secs"], was, sessionWaterUsage_.get_end_session_secs()); 
-    }
+void dApp::prop_set_water_flow_max(const JsonVariant& v) {
+  float was = channels_[0].max_upm;
+  channels_[0].max_upm = v.as<float>();
+  APP_LOG_LOG("max_upm: was %f, now %f", was, channels_[0].max_upm); 
+}
 
-    if (jo.containsKey("allowances") && jo["allowances"].is<JsonArray>()) {
-      int was = specific_allowances_.size();
-      specific_allowances_ = SpecificAllowances((const JsonArray&)jo["allowances"]);
-      calc_max_plus_values();
-      APP_LOG_LOG("allowances count: was %i now %i",  
-        was, (int)specific_allowances_.size() ); 
-    }
-
-    if (jo.containsKey("valve_open") && jo["valve_open"].is<bool>()) {
-      int was = valve_is_open_;
-      valve_is_open_ = jo["valve_open"];
-      // If we don't have haveRetainedProperties_ then the previous state of
-      // valve_is_open_ can't be assumed to be valid
-      if (was != valve_is_open_ || !haveRetainedProperties_) {
-        // Normally changing the valve status will call send_retained_properties()
-        // Since we will be sending it later in this function we special case
-        // it. The set_valve_status will reset this special case boolean. I'm
-        // not going to reset it here because I don't know when the set_valve_status
-        // will be called (is it syncronous?)  Is a danger that
-        // set_valve_status will not be called?
-        do_not_send_retained_on_next_valve_operation_ = false;
-        if (valve_is_open_) {
-          open_valve();
-        } else {
-          close_valve();
-        }
-      }
-      APP_LOG_LOG("valve_open:  was %i now %i", was, valve_is_open_); 
-    }
+void dApp::prop_get_water_flow_base(JsonBuffer& jb, JsonObject& jo) {
+  jo["water_flow_base"] = channels_[0].config.upm_base;
+}
 
-    // New style of parsing json using helper get..() functions
-    // The getObject variety is not much of an improvement
-    const JsonObject& joReport_period_secs = getObject(jo, "report_period_secs");
-    if (joReport_period_secs != JsonObject::invalid()) {
-      float was_wf_off = wf_->get_report_period_wf_off_mode_secs();
-      float was_wf_on = wf_->get_report_period_wf_on_mode_secs();
+void dApp::prop_set_water_flow_base(const JsonVariant& v) {
+  float was = channels_[0].config.upm_base;
+  channels_[0].set_upm_base(v.as<float>(), xlate_mgr_);
+  APP_LOG_LOG("upm_base: was %f, now %f", was, channels_[0].config.upm_base); 
+}
 
-      set_report_period_secs(joReport_period_secs);
+void dApp::prop_get_calibrate_factor(JsonBuffer& jb, JsonObject& jo) {
+  jo["calibrate_factor"] = calibrate_factor_;
+}
 
-      APP_LOG_LOG("report_period_secs:  wf_off was %f now %f, wf_on was %f now %f", 
-        was_wf_off, wf_->get_report_period_wf_off_mode_secs(),
-        was_wf_on, wf_->get_report_period_wf_on_mode_secs()
-      ); 
-    }
+void dApp::prop_set_calibrate_factor(const JsonVariant& v) {
+  float was = xlate_mgr_.get_calibrate_factor();
+  float specified = v.as<float>();
+  // Zero would cause divide by zero error (the validator has rejected it)
+  if (was != specified) {
+    // New calibrate factor -- need to update translation units and
+    // translate stored values
+    xlate_mgr_.set_calibrate_factor(specified);
+    calibrate_factor_ = specified;
+    convert_uom(nullptr, was);
+  }
+  APP_LOG_LOG("calibrate_factor: specified %f, was %f, now %f", specified, was, calibrate_factor_); 
+}
+
+void dApp::prop_get_test_period_secs(JsonBuffer& jb, JsonObject& jo) {
+  jo["test_period_secs"] = channels_[0].policy.test_period_secs;
+}
 
-    const JsonArray& jaSignatures = getArray(jo, "signatures");
-    if (jaSignatures != JsonArray::invalid()) {
+void dApp::prop_set_test_period_secs(const JsonVariant& v) {
+  int was = channels_[0].policy.test_period_secs;
+  channels_[0].policy.test_period_secs = v.as<int>();
+  APP_LOG_LOG("test_period_secs: was %i now %i",  was, channels_[0].policy.test_period_secs); 
+}
+
+void dApp::prop_get_initial_surge_secs(JsonBuffer& jb, JsonObject& jo) {
+  jo["initial_surge_secs"] = channels_[0].policy.allow_initial_surge_seconds;
+}
+
+void dApp::prop_set_initial_surge_secs(const JsonVariant& v) {
+  int was = channels_[0].policy.allow_initial_surge_seconds;
+  channels_[0].policy.allow_initial_surge_seconds = v.as<int>();
+  APP_LOG_LOG("initial_surge_secs: was %i now %i",  was, channels_[0].policy.allow_initial_surge_seconds); 
+}
+
+void dApp::prop_get_closed_sessions_max(JsonBuffer& jb, JsonObject& jo) {
+  jo["closed_sessions_max"] = channels_[0].session_usage.get_max_closed();
+}
 
-      wf_->set_signatures_from_json(jaSignatures);
+void dApp::prop_set_closed_sessions_max(const JsonVariant& v) {
+  int was = channels_[0].session_usage.get_max_closed();
+  channels_[0].session_usage.set_max_closed(v.as<int>());
+  APP_LOG_LOG("closed_sessions_max: specified %i, was %i now %i",  
+    v.as<int>(), was, channels_[0].session_usage.get_max_closed()); 
+}
+
+void dApp::prop_get_min_session_secs(JsonBuffer& jb, JsonObject& jo) {
+  jo["min_session_secs"] = channels_[0].session_usage.get_min_session_secs();
+}
+
+void dApp::prop_set_min_session_secs(const JsonVariant& v) {
+  int was = channels_[0].session_usage.get_min_session_secs();
+  channels_[0].session_usage.set_min_session_secs(v.as<int>());
+  APP_LOG_LOG("min_session_secs: specified %i, was %i now %i",  
+    v.as<int>(), was, channels_[0].session_usage.get_min_session_secs()); 
+}
+
+void dApp::prop_get_end_session_secs(JsonBuffer& jb, JsonObject& jo) {
+  jo["end_session_secs"] = channels_[0].session_usage.get_end_session_secs();
+}
+
+void dApp::prop_set_end_session_secs(const JsonVariant& v) {
+  int was = channels_[0].session_usage.get_end_session_secs();
+  channels_[0].session_usage.set_end_session_secs(v.as<int>());
+  APP_LOG_LOG("end_session_secs: specified %i, was %i now %i",  
+    v.as<int>(), was, channels_[0].session_usage.get_end_session_secs()); 
+}
+
+void dApp::prop_get_session_zone_step(JsonBuffer& jb, JsonObject& jo) {
+  jo["session_zone_step"] = channels_[0].session_usage.get_zone_step();
+}
+
+void dApp::prop_set_session_zone_step(const JsonVariant& v) {
+  float was = channels_[0].session_usage.get_zone_step();
+  channels_[0].session_usage.set_zone_step(v.as<float>());
+  APP_LOG_LOG("session_zone_step: was %f now %f", was, channels_[0].session_usage.get_zone_step()); 
+}
 
-      APP_LOG_LOG("signatures:"); 
+void dApp::prop_get_allowances(JsonBuffer& jb, JsonObject& jo) {
+  jo["allowances"] = specific_allowances_.toJson(jb);
+}
+
+void dApp::prop_set_allowances(const JsonVariant& v) {
+  int was = specific_allowances_.size();
+  specific_allowances_ = SpecificAllowances(v.as<JsonArray>());
+  APP_LOG_LOG("allowances count: was %i now %i",  
+    was, (int)specific_allowances_.size() ); 
+}
+
+void dApp::prop_get_valve_open(JsonBuffer& jb, JsonObject& jo) {
+  jo["valve_open"] = valve_is_open_;
+}
+
+void dApp::prop_set_valve_open(const JsonVariant& v) {
+  int was = valve_is_open_;
+  valve_is_open_ = v.as<bool>();
+  // If we don't have haveRetainedProperties_ then the previous state of
+  // valve_is_open_ can't be assumed to be valid
+  if (was != valve_is_open_ || !haveRetainedProperties_) {
+    // Normally changing the valve status will call send_retained_properties()
+    // Since we will be sending it later in this function we special case
+    // it. The set_valve_status will reset this special case boolean. I'm
+    // not going to reset it here because I don't know when the set_valve_status
+    // will be called (is it syncronous?)  Is a danger that
+    // set_valve_status will not be called?
+    do_not_send_retained_on_next_valve_operation_ = false;
+    if (valve_is_open_) {
+      open_valve();
+    } else {
+      close_valve();
     }
+  }
+  APP_LOG_LOG("valve_open:  was %i now %i", was, valve_is_open_); 
+}
 
-    if (fromRetainedProperties) {
-      haveRetainedProperties_ = true;
+void dApp::prop_get_report_period_secs(JsonBuffer& jb, JsonObject& jo) {
+  JsonObject& joReportPeriodSecs = jb.createObject();
+
+  joReportPeriodSecs["wf_off"] = channels_[0].wf->get_report_period_wf_off_mode_secs();
+  joReportPeriodSecs["wf_on"] = channels_[0].wf->get_report_period_wf_on_mode_secs();
+
+  jo["report_period_secs"] = joReportPeriodSecs;
+}
+
+void dApp::prop_set_report_period_secs(const JsonVariant& v) {
+  WaterflowSensor* wf = channels_[0].wf;
+  float was_wf_off = wf->get_report_period_wf_off_mode_secs();
+  float was_wf_on = wf->get_report_period_wf_on_mode_secs();
+
+  set_report_period_secs(v.as<JsonObject>());
+
+  APP_LOG_LOG("report_period_secs:  wf_off was %f now %f, wf_on was %f now %f", 
+    was_wf_off, wf->get_report_period_wf_off_mode_secs(),
+    was_wf_on, wf->get_report_period_wf_on_mode_secs()
+  ); 
+}
+
+void dApp::prop_get_channels(JsonBuffer& jb, JsonObject& jo) {
+  JsonArray& ja = jb.createArray();
+  for (int i = 0; i < channel_count_; ++i) {
+    ja.add(channels_[i].toJson(jb));
+  }
+  jo["channels"] = ja;
+}
+
+void dApp::prop_set_channels(const JsonVariant& v) {
+  const JsonArray& ja = v.as<JsonArray>();
+  for (int i = 0; i < ja.size() && i < channel_count_; ++i) {
+    if (ja[i].is<JsonObject>()) {
+      channels_[i].fromJson(ja[i].as<JsonObject>(), xlate_mgr_);
     }
+  }
+  // The sensors have the test period and initial surge too
+  calc_max_plus_values();
+  APP_LOG_LOG("channels: specified %i, have %i", (int)ja.size(), channel_count_); 
+}
 
-    // Immediatly send retained message
-    // This serves two purposes:
-    //  1. If this is from set options cmnd the call gets feedback that
-    //    the option has been received.
-    //  2. Since the mqtt message is "retained" it will be resent to this 
-    //    device whenever it connects to mqtt, providing persistence of 
-    //    these values.
+void dApp::prop_get_baseline(JsonBuffer& jb, JsonObject& jo) {
+  JsonObject& joBaseline = jb.createObject();
 
-    send_retained_properties();
+  joBaseline["night_start"] = baseline_night_start_;
+  joBaseline["night_end"] = baseline_night_end_;
+  joBaseline["drift"] = baseline_drift_;
 
-    APP_LOG_EXIT("process_properties"); 
-    // APP_LOG_EMIT_ON(true);
+  jo["baseline"] = joBaseline;
+}
 
+void dApp::prop_set_baseline(const JsonVariant& v) {
+  const JsonObject& jo = v.as<JsonObject>();
+
+  int night_start = getInt(jo, "night_start", baseline_night_start_);
+  int night_end = getInt(jo, "night_end", baseline_night_end_);
+  if (night_start >= 0 && night_start < 24 && night_end >= 0 && night_end < 24) {
+    baseline_night_start_ = night_start;
+    baseline_night_end_ = night_end;
   }
 
-JsonObject& dApp::toJson(JsonObject& jo, const char* prop_name/*=nullptr*/) {
+  float drift = getFloat(jo, "drift", baseline_drift_);
+  if (drift >= 0) {
+    baseline_drift_ = drift;
+  }
 
+  APP_LOG_LOG("baseline: night %i-%i, drift %f", 
+    baseline_night_start_, baseline_night_end_, baseline_drift_); 
+}
 
-    if (prop_name == nullptr) {
-      jo["fw_version"] = FW_VERSION;
-    }
+void dApp::prop_get_continuous_flow(JsonBuffer& jb, JsonObject& jo) {
+  JsonObject& joContinuousFlow = jb.createObject();
 
-    if (prop_name == nullptr || strcmp(prop_name, "timezone") == 0) {
-      jo["timezone"] = sntp_time->get_timezone();
-    }
-    if (prop_name == nullptr || strcmp(prop_name, "closed_periods_max") == 0) {
-      jo["closed_periods_max"] = hourlyWaterUsage_.get_max_closed();
+  joContinuousFlow["hours"] = continuous_flow_hours_;
+  joContinuousFlow["close_valve"] = continuous_flow_close_valve_;
+
+  jo["continuous_flow"] = joContinuousFlow;
+}
+
+void dApp::prop_set_continuous_flow(const JsonVariant& v) {
+  const JsonObject& jo = v.as<JsonObject>();
+
+  int hours = getInt(jo, "hours", continuous_flow_hours_);
+  if (hours >= 0) {
+    continuous_flow_hours_ = hours;
+  }
+  continuous_flow_close_valve_ = getBool(jo, "close_valve", continuous_flow_close_valve_);
+
+  APP_LOG_LOG("continuous_flow: hours %i, close_valve %i", 
+    continuous_flow_hours_, continuous_flow_close_valve_); 
+}
+
+void dApp::prop_get_flow_change(JsonBuffer& jb, JsonObject& jo) {
+  const WaterflowSensor::Settings& settings = channels_[0].wf->get_settings();
+
+  JsonObject& joFlowChange = jb.createObject();
+  joFlowChange["step"] = settings.step;
+  joFlowChange["min_step_pulses"] = settings.min_step_pulses;
+  joFlowChange["noise"] = settings.noise;
+  joFlowChange["threshold"] = settings.threshold;
+  jo["flow_change"] = joFlowChange;
+}
+
+// Applies to every channel
+void dApp::prop_set_flow_change(const JsonVariant& v) {
+  const JsonObject& jo = v.as<JsonObject>();
+
+  for (int i = 0; i < channel_count_; ++i) {
+    WaterflowSensor::Settings settings = channels_[i].wf->get_settings();
+    if (getFloat(jo, "step", -1) >= 0) {
+      settings.step = getFloat(jo, "step", 0);
     }
-    if (prop_name == nullptr || strcmp(prop_name, "unit_of_measure") == 0) {
-      jo["unit_of_measure"] = xlate_mgr_.current->uom_text();
+    if (getFloat(jo, "min_step_pulses", -1) >= 0) {
+      settings.min_step_pulses = getFloat(jo, "min_step_pulses", 0);
     }
-    if (prop_name == nullptr || strcmp(prop_name, "water_flow_max") == 0) {
-      jo["water_flow_max"] = max_upm_;
+    if (getFloat(jo, "noise", -1) >= 0) {
+      settings.noise = getFloat(jo, "noise", 0);
     }
-    if (prop_name == nullptr || strcmp(prop_name, "water_flow_base") == 0) {
-      jo["water_flow_base"] = upm_base_;
+    if (getFloat(jo, "threshold", -1) > 0) {
+      settings.threshold = getFloat(jo, "threshold", 0);
     }
-    if (prop_name == nullptr || strcmp(prop_name, "calibrate_factor") == 0) {
-      jo["calibrate_factor"] = calibrate_factor_;
+    channels_[i].wf->set_settings(settings);
+  }
+
+  const WaterflowSensor::Settings& settings = channels_[0].wf->get_settings();
+  APP_LOG_LOG("flow_change: step %f, min_step_pulses %f, noise %f, threshold %f", 
+    settings.step, settings.min_step_pulses, settings.noise, settings.threshold); 
+}
+
+void dApp::prop_get_water_usage_max(JsonBuffer& jb, JsonObject& jo) {
+  jo["water_usage_max"] = channels_[0].max_usage;
+}
+
+void dApp::prop_set_water_usage_max(const JsonVariant& v) {
+  float was = channels_[0].max_usage;
+  channels_[0].max_usage = v.as<float>() < 0 ? -1 : v.as<float>();
+  // Usage accumulates from when the max is set, not from when the 
+  // retained value is applied again after a restart
+  if (channels_[0].max_usage != was) {
+    channels_[0].usage_since_max_set() = 0;
+  }
+  APP_LOG_LOG("water_usage_max: was %f, now %f", was, channels_[0].max_usage); 
+}
+
+void dApp::prop_get_usage_budgets(JsonBuffer& jb, JsonObject& jo) {
+  JsonArray& ja = jb.createArray();
+  for (int i = 0; i < budget_count_; ++i) {
+    ja.add(budgets_[i].toJson(jb));
+  }
+  jo["usage_budgets"] = ja;
+}
+
+void dApp::prop_set_usage_budgets(const JsonVariant& v) {
+  const JsonArray& ja = v.as<JsonArray>();
+  int hour = app_clock.is_valid() ? app_clock.local().hour : -1;
+
+  // A budget over an unchanged window keeps its sums, which also makes
+  // the retained value applied at boot leave the restored budgets be
+  UsageBudget was[APP_MAX_USAGE_BUDGETS];
+  bool was_taken[APP_MAX_USAGE_BUDGETS] = {false};
+  int was_count = budget_count_;
+  for (int i = 0; i < was_count; ++i) {
+    was[i] = budgets_[i];
+  }
+
+  budget_count_ = 0;
+  for (int i = 0; i < ja.size() && budget_count_ < APP_MAX_USAGE_BUDGETS; ++i) {
+    UsageBudget& budget = budgets_[budget_count_];
+    if (ja[i].is<JsonObject>() && budget.fromJson(ja[i].as<JsonObject>())) {
+      int j = 0;
+      while (j < was_count && (was_taken[j] || !was[j].same_window(budget))) {
+        ++j;
+      }
+      if (j < was_count) {
+        was_taken[j] = true;
+        budget.continue_from(was[j]);
+      } else {
+        budget.start(hour);
+      }
+      ++budget_count_;
     }
-    if (prop_name == nullptr || strcmp(prop_name, "test_period_secs") == 0) {
-      jo["test_period_secs"] = test_period_secs_;
+  }
+  APP_LOG_LOG("usage_budgets: specified %i, have %i", (int)ja.size(), budget_count_); 
+}
+
+void dApp::prop_get_schedule(JsonBuffer& jb, JsonObject& jo) {
+  JsonArray& ja = jb.createArray();
+  for (int i = 0; i < schedule_.count; ++i) {
+    ja.add(schedule_.rules[i].toJson(jb));
+  }
+  jo["schedule"] = ja;
+}
+
+void dApp::prop_set_schedule(const JsonVariant& v) {
+  const JsonArray& ja = v.as<JsonArray>();
+
+  Schedule schedule;
+  for (int i = 0; i < ja.size() && schedule.count < APP_MAX_SCHEDULE_RULES; ++i) {
+    if (ja[i].is<JsonObject>() && schedule.rules[schedule.count].fromJson(ja[i].as<JsonObject>())) {
+      ++schedule.count;
     }
-    if (prop_name == nullptr || strcmp(prop_name, "initial_surge_secs") == 0) {
-      jo["initial_surge_secs"] = allow_initial_surge_seconds_;
+  }
+
+  // The same rules, as when the retained value is applied again, leave
+  // the rule in force and its usage be
+  if (schedule == schedule_) {
+    APP_LOG_LOG("schedule: unchanged, have %i", schedule_.count); 
+    return;
+  }
+  schedule_ = schedule;
+
+  // Back to the unscheduled limits until the next sample applies the new rules
+  for (FlowChannel& ch : channels_) {
+    ch.set_schedule_rule(-1, nullptr);
+  }
+  schedule_due_ms_ = millis();
+
+  APP_LOG_LOG("schedule: specified %i, have %i", (int)ja.size(), schedule_.count); 
+}
+
+void dApp::prop_get_signatures(JsonBuffer& jb, JsonObject& jo) {
+  jo["signatures"] = channels_[0].wf->get_signatures_as_json(jb);
+}
+
+void dApp::prop_set_signatures(const JsonVariant& v) {
+  channels_[0].wf->set_signatures_from_json(v.as<JsonArray>());
+
+  APP_LOG_LOG("signatures:"); 
+}
+
+void dApp::prop_get_stat_coalesce_ms(JsonBuffer& jb, JsonObject& jo) {
+  jo["stat_coalesce_ms"] = stat_coalesce_ms_;
+}
+
+void dApp::prop_set_stat_coalesce_ms(const JsonVariant& v) {
+  int was = stat_coalesce_ms_;
+  stat_coalesce_ms_ = v.as<int>();
+  APP_LOG_LOG("stat_coalesce_ms: was %i now %i", was, stat_coalesce_ms_); 
+}
+
+void dApp::prop_get_stat_diff(JsonBuffer& jb, JsonObject& jo) {
+  jo["stat_diff"] = stat_diff_;
+}
+
+void dApp::prop_set_stat_diff(const JsonVariant& v) {
+  bool was = stat_diff_;
+  stat_diff_ = v.as<bool>();
+
+  // The heavy properties move between /stat and their own topics. Not
+  // when restoring from /stat though: the retained topics already match.
+  if (was != stat_diff_ && haveRetainedProperties_) {
+    dirty_props_ |= heavy_props_mask();
+    if (!stat_diff_) {
+      clear_heavy_stat_topics();
     }
-    if (prop_name == nullptr || strcmp(prop_name, "closed_sessions_max") == 0) {
-      jo["closed_sessions_max"] = sessionWaterUsage_.get_max_closed();
+  }
+  APP_LOG_LOG("stat_diff: was %i now %i", was, stat_diff_); 
+}
+
+// Adds all published properties to jo (less the heavy ones if heavy is 
+// false), or only prop_name if it is given
+JsonObject& dApp::toJson(JsonBuffer& jb, JsonObject& jo, const char* prop_name/*=nullptr*/,
+  bool heavy/*=true*/) {
+
+    if (prop_name == nullptr) {
+      jo["fw_version"] = FW_VERSION;
+
+      for (const PropertyDescriptor<dApp>& prop : properties_) {
+        if (prop.out == PropOut::stat || (heavy && prop.out == PropOut::heavy)) {
+          (this->*prop.get)(jb, jo);
+        }
+      }
+    } else {
+      int index = find_property(prop_name);
+      if (index >= 0) {
+        (this->*properties_[index].get)(jb, jo);
+      }
     }
-    if (prop_name == nullptr || strcmp(prop_name, "end_session_secs") == 0) {
-      jo["end_session_secs"] = sessionWaterUsage_.get_end_session_secs();
+
+    return jo;
+}
+
+// Publishes everything now, skipping the coalescing window
+void _entry_point dApp::send_retained_properties() {
+    APP_METRICS_ENTRY(send_retained_properties);
+    APP_LOG_ENTER("send_retained_properties()");
+
+    dirty_props_ = (uint32_t(1) << prop_count) - 1;
+    publish_dirty_properties();
+
+    APP_LOG_EXIT("send_retained_properties");
+}
+
+// The first change starts the coalescing window; later changes within
+// the window ride along with it.
+void dApp::mark_properties_dirty(uint32_t mask) {
+  if (mask == 0) {
+    return;
+  }
+
+  dirty_props_ |= mask;
+
+  if (stat_coalesce_ms_ == 0) {
+    publish_dirty_properties();
+  } else if (!stat_publish_pending_) {
+    stat_publish_pending_ = true;
+    stat_publish_due_ms_ = millis() + stat_coalesce_ms_;
+  }
+}
+
+void dApp::publish_dirty_properties() {
+  uint32_t dirty = dirty_props_;
+  uint32_t heavy = heavy_props_mask();
+
+  dirty_props_ = 0;
+  stat_publish_pending_ = false;
+
+  if (!stat_diff_) {
+    publish_json(mqttTopicStat_, [=](JsonBuffer& jb, JsonObject& root) {
+      toJson(jb, root);
+    }, 1, true);
+    return;
+  }
+
+  // /stat holds the light properties, so only send it if one of them
+  // changed...
+  if (dirty & ~heavy) {
+    publish_json(mqttTopicStat_, [=](JsonBuffer& jb, JsonObject& root) {
+      toJson(jb, root, nullptr, false);
+    }, 1, true);
+  }
+
+  // ...and each changed heavy property goes on its own topic, unless
+  // its json is the same as what is already there
+  for (int index = 0; index < prop_count; ++index) {
+    if (dirty & heavy & (1 << index)) {
+      const PropertyDescriptor<dApp>& prop = properties_[index];
+      publish_json(mqttTopicStat_ + "/" + prop.name, [=](JsonBuffer& jb, JsonObject& root) {
+        (this->*prop.get)(jb, root);
+      }, 1, true, &stat_hash_[index]);
     }
-    if (prop_name == nullptr || strcmp(prop_name, "min_session_secs") == 0) {
-      jo["min_session_secs"] = sessionWaterUsage_.get_min_session_secs();
+  }
+}
+
+// An empty retained message removes the retained message
+void dApp::clear_heavy_stat_topics() {
+  for (int index = 0; index < prop_count; ++index) {
+    const PropertyDescriptor<dApp>& prop = properties_[index];
+    if (prop.out == PropOut::heavy) {
+      mqtt_client->publish(mqttTopicStat_ + "/" + prop.name, "", 0, 1, true);
+      stat_hash_[index] = 0;
     }
-    if (prop_name == nullptr || strcmp(prop_name, "min_session_secs") == 0) {
-      jo["min_session_secs"] = sessionWaterUsage_.get_min_session_secs();
+  }
+}
+
+// Called every 250ms from the yaml interval component
+void _entry_point dApp::on_tick() {
+  APP_METRICS_ENTRY(on_tick);
+  TickBudgetTimer budget_timer(tick_budget_);
+
+  if (!on_boot_called) {
+    return;
+  }
+
+  app_clock.snapshot();
+  if (!app_clock.is_valid() || uint32_t(millis() - clock_synced_ms_) >= clock_sync_ms_) {
+    // timestamp_now() is the epoch, no local time conversion
+    if (app_clock.sync(sntp_time->timestamp_now())) {
+      clock_synced_ms_ = millis();
+      int hour = app_clock.local().hour;
+      for (int i = 0; i < budget_count_; ++i) {
+        budgets_[i].set_hour(hour);
+      }
+      close_stale_units();
+      replay_early_samples();
     }
+  }
+
+  if (stat_publish_pending_ && int32_t(millis() - stat_publish_due_ms_) >= 0) {
+    publish_dirty_properties();
+  }
+
+  if (uint32_t(millis() - snapshot_saved_ms_) >= snapshot_period_ms_) {
+    save_snapshot();
+  }
+
+#ifdef APP_EDGE_CAPTURE
+  publish_edge_captures();
+#endif
 
-    if (prop_name == nullptr || strcmp(prop_name, "valve_open") == 0) {
-        jo["valve_open"] = valve_is_open_;
+  if (tick_budget_.allows(TickBudget::no_display)) {
+    update_display();
+  }
+}
+
+// Called from the yaml on_shutdown, which includes the reboot after an
+// OTA update
+void _entry_point dApp::on_shutdown() {
+  APP_METRICS_ENTRY(on_shutdown);
+
+  if (on_boot_called) {
+    save_snapshot();
+  }
+}
+
+void dApp::save_snapshot() {
+  // Static, they are too big for the loop task's stack
+  static AppSnapshot snapshot;
+  static PropertiesSnapshot properties;
+
+  app_clock.snapshot();
+
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.version = AppSnapshot::current_version;
+  snapshot.saved_time = app_clock.now();
+  snapshot.valve_is_open = valve_is_open_;
+
+  for (int i = 0; i < channel_count_; ++i) {
+    FlowChannel& ch = channels_[i];
+    AppSnapshot::Channel& saved = snapshot.channels[i];
+    ch.settle_usage();
+    saved.current_usage.save(ch.current_usage);
+    saved.hourly_usage.save(ch.hourly_usage.getCurrent());
+    saved.daily_usage.save(ch.daily_usage.getCurrent());
+    saved.session_usage.save(ch.session_usage.getCurrent());
+    saved.usage_since_max_set = ch.usage_since_max_set();
+    saved.usage_since_schedule = ch.usage_since_schedule();
+    saved.schedule_rule = ch.schedule_rule;
+    saved.secs_over_limit = ch.policy.secs_over_limit;
+    saved.grace_for_surge = ch.policy.grace_for_surge;
+    saved.hours_without_base = ch.continuous_flow.hours_without_base;
+    saved.over_limit = ch.policy.over_limit;
+    saved.usage_over = ch.usage_over;
+  }
+
+  for (const SpecificAllowance& allowance : specific_allowances_) {
+    if (snapshot.allowance_count == APP_SNAPSHOT_ALLOWANCES) {
+      break;
     }
+    AppSnapshot::Allowance& saved = snapshot.allowances[snapshot.allowance_count++];
+    strncpy(saved.name, allowance.name.c_str(), sizeof(saved.name) - 1);
+    saved.upm = allowance.upm;
+    saved.usage = allowance.usage;
+    saved.expire_time = allowance.expire_time;
+    saved.create_named_session = allowance.create_named_session;
+  }
 
-    if (prop_name == nullptr || strcmp(prop_name, "report_period_secs") == 0) {
+  snapshot.budget_count = budget_count_;
+  for (int i = 0; i < budget_count_; ++i) {
+    snapshot.budgets[i] = budgets_[i];
+  }
+
+  bool saved = snapshot_pref_.save(&snapshot);
 
-        JsonObject& joReportPeriodSecs = global_json_buffer.createObject();
+  properties.version = PropertiesSnapshot::current_version;
+  bool saved_properties = json_publisher_.print([=](JsonBuffer& jb, JsonObject& root) {
+      toJson(jb, root, nullptr, false);
+      root.remove("valve_open");
+    }, properties.json, sizeof(properties.json)) 
+    && properties_pref_.save(&properties);
 
-        joReportPeriodSecs["wf_off"] = wf_->get_report_period_wf_off_mode_secs();
-        joReportPeriodSecs["wf_on"] = wf_->get_report_period_wf_on_mode_secs();
+  snapshot_saved_ms_ = millis();
 
-        jo["report_period_secs"] = joReportPeriodSecs;
+  APP_LOG_LOG("save_snapshot: state %i, properties %i", saved, saved_properties);
+}
+
+// Called from on_boot(), after the channels are set up
+void dApp::restore_snapshot() {
+  static AppSnapshot snapshot;
+  static PropertiesSnapshot properties;
+
+  snapshot_pref_ = global_preferences.make_preference<AppSnapshot>(prop_hash("dapp_snapshot"));
+  properties_pref_ = global_preferences.make_preference<PropertiesSnapshot>(prop_hash("dapp_properties"));
+
+  // Properties first: unit_of_measure says what units the state is in
+  bool restored_properties = properties_pref_.load(&properties) 
+    && properties.version == PropertiesSnapshot::current_version;
+  if (restored_properties) {
+    properties.json[sizeof(properties.json) - 1] = '\0';
+    restored_properties = json_publisher_.parse(properties.json, [=](JsonObject& jo) {
+      apply_properties(jo);
+    });
+  }
+
+  bool restored = snapshot_pref_.load(&snapshot) 
+    && snapshot.version == AppSnapshot::current_version;
+  if (restored) {
+    valve_is_open_ = snapshot.valve_is_open;
+    restored_time_ = snapshot.saved_time;
+
+    for (int i = 0; i < channel_count_; ++i) {
+      FlowChannel& ch = channels_[i];
+      const AppSnapshot::Channel& saved = snapshot.channels[i];
+      saved.current_usage.restore(ch.current_usage);
+      saved.hourly_usage.restore(ch.hourly_usage.getCurrent());
+      saved.daily_usage.restore(ch.daily_usage.getCurrent());
+      saved.session_usage.restore(ch.session_usage.getCurrent());
+      ch.load_usage();
+      ch.usage_since_max_set() = saved.usage_since_max_set;
+      // The schedule came with the properties; a rule that is no longer
+      // in force when the clock is set is left on the next sample
+      if (saved.schedule_rule >= 0 && saved.schedule_rule < schedule_.count
+        && schedule_.rules[saved.schedule_rule].channel == i) {
+        ch.set_schedule_rule(saved.schedule_rule, &schedule_.rules[saved.schedule_rule]);
+        ch.usage_since_schedule() = saved.usage_since_schedule;
+      }
+      ch.policy.secs_over_limit = saved.secs_over_limit;
+      ch.policy.grace_for_surge = saved.grace_for_surge;
+      ch.continuous_flow.hours_without_base = saved.hours_without_base;
+      ch.policy.over_limit = saved.over_limit;
+      ch.usage_over = saved.usage_over;
+      // The state now, the limits again with on_boot()'s calc_max_plus_values()
+      ch.set_sensor_limits(xlate_mgr_, app_ == "wwh", true);
     }
 
-    if (prop_name == nullptr || strcmp(prop_name, "signatures") == 0) {
-        jo["signatures"] = wf_->get_signatures_as_json();
+    specific_allowances_.clear();
+    for (int i = 0; i < snapshot.allowance_count && i < APP_SNAPSHOT_ALLOWANCES; ++i) {
+      const AppSnapshot::Allowance& saved = snapshot.allowances[i];
+      specific_allowances_.push_back(SpecificAllowance(saved.name, saved.upm, saved.usage,
+        saved.expire_time, saved.create_named_session));
     }
 
+    // The budgets came with the properties
+    bool taken[APP_MAX_USAGE_BUDGETS] = {false};
+    for (int i = 0; i < budget_count_; ++i) {
+      for (int j = 0; j < snapshot.budget_count && j < APP_MAX_USAGE_BUDGETS; ++j) {
+        if (!taken[j] && budgets_[i].same_window(snapshot.budgets[j])) {
+          taken[j] = true;
+          budgets_[i].continue_from(snapshot.budgets[j]);
+          break;
+        }
+      }
+    }
+  }
 
-    return jo;
+  APP_LOG_LOG("restore_snapshot: state %i (saved at %li), properties %i", 
+    restored, restored ? (long)snapshot.saved_time : 0L, restored_properties);
 }
 
-void _entry_point dApp::send_retained_properties() {
-    APP_LOG_ENTER("send_retained_properties()");
+// Whether epoch t is in local's day, and hour if hour
+static bool in_same_period(time_t t, const time::ESPTime& local, bool hour) {
+  time::ESPTime then = time::ESPTime::from_epoch_local(t);
+  return then.year == local.year && then.day_of_year == local.day_of_year
+    && (!hour || then.hour == local.hour);
+}
 
-    // Send retained message
-    mqtt_client->publish_json(mqttTopicStat_, [=](JsonObject &root) {
-      toJson(root);
-    }, 1, true);
+// The restored units are as they were when the device went off, which
+// may have been hours or days ago. Once the clock is set, before the 
+// early samples go into them, units of an earlier hour or day are 
+// closed at the time they were saved, the last time they are known to
+// have been open, and a session is ended if the device was off for 
+// end_session_secs or more. The hours of continuous flow do not count
+// across a gap. usage_since_max_set is kept: it counts from when the 
+// max was set, however long ago. The budgets roll over the hours the
+// device was off, which were hours without usage.
+void dApp::close_stale_units() {
+  if (restored_time_ == 0) {
+    return;
+  }
+  time_t saved = restored_time_;
+  restored_time_ = 0;
+
+  time_t now = app_clock.now();
+  time::ESPTime local = app_clock.local();
+
+  int hours_off = int(now / 3600 - saved / 3600);
+  for (int i = 0; i < budget_count_ && hours_off > 0; ++i) {
+    UsageBudget& budget = budgets_[i];
+    if (hours_off >= UsageBudget::max_hours) {
+      // Every hour of any window is past
+      budget.start(local.hour);
+      continue;
+    }
+    for (int h = hours_off - 1; h >= 0; --h) {
+      budget.next_hour(h == 0 ? local.hour : time::ESPTime::from_epoch_local(now - h * 3600).hour);
+    }
+  }
 
-    APP_LOG_EXIT("send_retained_properties");
+  for (int i = 0; i < channel_count_; ++i) {
+    FlowChannel& ch = channels_[i];
+
+    WaterUsageTimed& hour = ch.hourly_usage.getCurrent();
+    if (hour.isStarted() && !in_same_period(hour.start_time, local, true)) {
+      ch.next_hour(std::max(saved, hour.start_time));
+      publish_usage(ch.topic_hourly_usage, ch.hourly_usage.getLastClosed());
+      ch.continuous_flow.hours_without_base = 0;
+    }
+
+    WaterUsageTimed& day = ch.daily_usage.getCurrent();
+    if (day.isStarted() && !in_same_period(day.start_time, local, false)) {
+      ch.next_day(std::max(saved, day.start_time));
+      publish_usage(ch.topic_daily_usage, ch.daily_usage.getLastClosed());
+    }
+
+    const WaterUsageSession& session = ch.session_usage.getCurrent();
+    if (session.isStarted() && now - saved >= ch.session_usage.get_end_session_secs()
+      && ch.session_usage.endSession(std::max(saved, session.start_time))) {
+      publish_usage(ch.topic_session_usage, ch.session_usage.getLastClosed());
+    }
+
+    ch.usage_over = ch.max_usage_plus >= 0 && ch.usage_toward_max() > ch.max_usage_plus;
+    for (int j = 0; j < budget_count_; ++j) {
+      if (budgets_[j].channel == i && budgets_[j].over) {
+        ch.usage_over = true;
+      }
+    }
+
+    snapshot_usage(i);
+  }
+  publish_usage_snapshot();
+
+  APP_LOG_LOG("close_stale_units: saved at %li, %li secs ago", (long)saved, (long)(now - saved));
 }
 
 void dApp::send_property(const char* prop_name) {
   APP_LOG_LOG("send_property");
 
   // Send non-retained message
-  mqtt_client->publish_json(mqttTopicProp_, [=](JsonObject &root) {
-    toJson(root, prop_name);
+  publish_json(mqttTopicProp_, [=](JsonBuffer& jb, JsonObject& root) {
+    toJson(jb, root, prop_name);
   }, 1, false);
 
 }
 
 void _entry_point dApp::process_stat(const JsonObject& x) {
+  APP_METRICS_ENTRY(process_stat);
   APP_LOG_ENTER("process_stat()");
 
   APP_LOG_LOG(haveRetainedProperties_ ? "ignored" : "processed");
@@ -452,8 +1226,34 @@ void _entry_point dApp::process_stat(const JsonObject& x) {
   APP_LOG_EXIT("process_stat");
 }
 
+// Retained /stat/<name> message for a heavy property (see stat_diff). 
+// These arrive in any order relative to /stat, so a property is only 
+// taken from here if nothing has set it since boot.
+void _entry_point dApp::process_stat_property(const JsonObject& x) {
+  APP_METRICS_ENTRY(process_stat_property);
+  APP_LOG_ENTER("process_stat_property()");
+
+  uint32_t applied = apply_properties(x, have_props_ | ~heavy_props_mask());
+
+  // The topic now holds what the property would publish, so applying it
+  // does not send it back
+  for (int index = 0; index < prop_count; ++index) {
+    if (applied & (1 << index)) {
+      const PropertyDescriptor<dApp>& prop = properties_[index];
+      stat_hash_[index] = json_publisher_.hash([=](JsonBuffer& jb, JsonObject& root) {
+        (this->*prop.get)(jb, root);
+      });
+    }
+  }
+
+  APP_LOG_LOG(applied ? "processed" : "ignored");
+
+  APP_LOG_EXIT("process_stat_property");
+}
+
 
 void _entry_point dApp::reset() {
+  APP_METRICS_ENTRY(reset);
   APP_LOG_ENTER("reset()");
   APP_LOG_EXIT("reset");
 }
@@ -467,7 +1267,9 @@ void _entry_point dApp::reset() {
   // interval period then factors it for that value over a minute. So if "report_interval" ==
   // 5s, and the sensor gets 1000 pulses over the 5s period then esphome returns 1000 * 20, or
   // 200000. 
-void _entry_point dApp::process_wf_on_value(float upm) {
+void _entry_point dApp::process_wf_on_value(float upm, int channel/*=0*/) {
+    APP_METRICS_ENTRY(process_wf_on_value);
+    TickBudgetTimer budget_timer(tick_budget_);
 
     #ifdef APP_LOG
     if (mqtt_client && mqtt_client->is_connected()) {
@@ -475,156 +1277,305 @@ void _entry_point dApp::process_wf_on_value(float upm) {
     }
     #endif
 
-    APP_LOG_ENTER("process_wf_on_value(upm=%f)", upm);
+    APP_LOG_ENTER("process_wf_on_value(upm=%f, channel=%i)", upm, channel);
 
-    if (!on_boot_called) {
-      APP_LOG_LOG("!on_boot_called");
+    if (!on_boot_called || channel < 0 || channel >= channel_count_) {
+      APP_LOG_LOG("!on_boot_called or no channel");
       APP_LOG_EXIT("process_wf_on_value");
       return;
     }
 
+    FlowChannel& ch = channels_[channel];
+
     APP_LOG_LOG("initialized=%i, time_is_valid=%i, gotStat=%i, valve_close=%i, valve_open=%i", 
-      on_boot_called, time_is_valid_, haveRetainedProperties_
+      on_boot_called, app_clock.is_valid(), haveRetainedProperties_
       , valve_close->state, valve_open->state);
 
-    // Make sure we have a valid time from time server
-    // time_is_valid_: -1: not tested yet, 0: tested not valid, 1: tested is valid
-    if (time_is_valid_ != 1) {
-      // Not yet tested or tested not valid 
-      APP_LOG_LOG("Testing if time is valid");
-      auto time = sntp_time->now();
-      if ( !time.is_valid()) {
-        APP_LOG_LOG("NOT time.is_valid()");
-        time_is_valid_ = 0;
-      } else {
-        APP_LOG_LOG("time.is_valid()");
-        time_is_valid_ = 1;
-      }
+    // The whole sample is handled at this time
+    app_clock.snapshot();
+
+    // Sometimes I see infinitesimal usage amounts (eg, 7e-41), so I ignore and
+    if (upm < 0.00000001 ) upm = 0.0;
+
+    int report_period_secs = ch.wf->get_last_report_period_secs();
+
+    if (channel == 0) {
+      display_.set_upm(upm);
     }
 
-    // Until time is valid we don't process anything
-    // TODO: notify user if time not valid
-    if (time_is_valid_ == 1) {
-      
-      // Sometimes I see infinitesimal usage amounts (eg, 7e-41), so I ignore and
-      if (upm < 0.00000001 ) upm = 0.0;
+    float before_upm, after_upm;
+    bool flow_changed = ch.wf->take_flow_change(before_upm, after_upm);
 
+    if (!app_clock.is_valid()) {
+      // The accounting is kept until on_tick() sets the clock from the
+      // time server, the limits do not wait
+      early_samples_.add(app_clock.uptime_ms() / 1000, channel, upm, report_period_secs);
+      check_limits(ch, channel, upm, report_period_secs);
+    } else {
+      replay_early_samples();
+
+      // A change before the clock was set has no time to publish with
+      if (flow_changed) {
+        publish_json(ch.topic_flow_change, [&](JsonBuffer& jb, JsonObject& root) { 
+          root["before"] = before_upm;
+          root["after"] = after_upm;
+          root["timestamp"] = app_clock.now();
+          });
+      }
 
-      int report_period_secs = wf_->get_last_report_period_secs();
-    
-      refresh_display(upm);
+      check_limits(ch, channel, upm, report_period_secs);
+      process_sample(ch, channel, upm, report_period_secs);
+    }
 
-      // We have flow and we have a surge grace period
-      if (upm > upm_base_ && grace_for_surge_ > 0) {
-        // Yes, we don't care of we are over limit or not.
-        // we are in a surge grace period
-        // Decrement grace surge period
-        grace_for_surge_ -= report_period_secs;
-        
-      } else if (max_upm_plus_ >= 0.0 && upm > max_upm_plus_) {
+    APP_LOG_EXIT("process_wf_on_value");
 
-          // We have flow and are over limit
+}
 
-        secs_over_limit_ += report_period_secs;
+// The over limit policy, max usage and budgets for a sample of channel's
+// flow, as it arrives, whether or not the clock is set. Samples from 
+// before the clock was set are not checked again when their accounting
+// is replayed.
+void dApp::check_limits(FlowChannel& ch, int channel, float upm, int report_period_secs) {
+    // One comparison per sample, the rules are only looked at on a 
+    // transition. They are by local time, so wait for the clock.
+    if (app_clock.is_valid() && int32_t(millis() - schedule_due_ms_) >= 0) {
+      apply_schedule();
+    }
 
-        if (secs_over_limit_ >= test_period_secs_) {
-          over_limit_ = true;
-          mqtt_client->publish(mqttSensorWfOverlimitStatus_, "on", 2, 2);
+    bool was_over = ch.policy.over_limit || ch.usage_over;
 
-          // If we are a wwh device then close master valve immediately
-          if (app_ == "wwh") {
-            close_valve();
-          }
+    // The flow is checked against max_upm_plus where the pulses are read,
+    // which has closed a wwh device's valve already (see 
+    // WaterflowSensor::process_pulses())
+    bool valve_closed = false;
+    OverLimitPolicy::Verdict verdict = ch.wf->take_verdict(ch.policy, valve_closed);
 
-          APP_LOG_LOG("over limit: max_upm=%f, max_upm_plus=%f,  wf=%f", 
-            max_upm_, max_upm_plus_, upm);
-        }
-      } else {
+    float usage = upm * report_period_secs / 60.0; 
+    bool usage_was_over = ch.usage_over;
+    ch.usage_over = add_budget_usage(ch, channel, usage);
 
-        // We are not over limit
-      
-        secs_over_limit_ = 0;
-
-        // were we over limit before?
-        if (over_limit_) {
-          over_limit_ = false;
-          mqtt_client->publish(mqttSensorWfOverlimitStatus_, "off", 3, 2);
-          APP_LOG_LOG("back under limit: max_upm=%f, max_upm_plus=%f, upm=%f", 
-            max_upm_, max_upm_plus_, upm);
-        }
+    // Over limit on flow or on usage
+    if (verdict == OverLimitPolicy::Verdict::over_limit || (ch.usage_over && !usage_was_over)) {
+      mqtt_client->publish(ch.topic_over_limit, "on", 2, 2);
 
-          if (upm <= upm_base_) {
-            grace_for_surge_ = allow_initial_surge_seconds_;
-        }
+      // If we are a wwh device then close master valve immediately, or
+      // set the switches to match the pins if the sensor closed it
+      if (app_ == "wwh") {
+        close_valve();
       }
 
-      // upm is for a minute, but we are updating every "report_period_secs", so we need
-      // to factor usage 
-      float usage = upm * report_period_secs / 60.0; 
-      hourlyWaterUsage_.addUsage(usage);
-      dailyWaterUsage_.addUsage(usage);
-      currentWaterUsage.addUsage(usage);
-      
-      // We only add to session usage if we do not have a named usage in process
-      if (namedWaterUsage_.count() == 0 && sessionWaterUsage_.addUsage(usage)) {
-        mqtt_client->publish_json(mqttSensorWfSessionUsageState_, [=](JsonObject &root) { 
-          sessionWaterUsage_.getLastClosed().toJson(&root);
-          });
+      APP_LOG_LOG("over limit: channel=%i, max_upm=%f, max_upm_plus=%f,  wf=%f, usage_over=%i, "
+        "valve_closed=%i", channel, ch.max_upm, ch.max_upm_plus, upm, ch.usage_over, valve_closed);
 
-      }
+    } else if (was_over && !ch.policy.over_limit && !ch.usage_over) {
+      mqtt_client->publish(ch.topic_over_limit, "off", 3, 2);
+      APP_LOG_LOG("back under limit: channel=%i, max_upm=%f, max_upm_plus=%f, upm=%f", 
+        channel, ch.max_upm, ch.max_upm_plus, upm);
+    }
+}
 
-      //if (app_ == "wwh") {
-        namedWaterUsage_.addUsage(usage);
-      //}
+// The accounting of a sample of channel's flow, at the time of 
+// app_clock's snapshot
+void dApp::process_sample(FlowChannel& ch, int channel, float upm, int report_period_secs) {
+    // upm is for a minute, but we are updating every "report_period_secs", so we need
+    // to factor usage 
+    float usage = upm * report_period_secs / 60.0; 
+    ch.add_usage(usage);
+    ch.baseline.add(upm, report_period_secs);
+    ch.continuous_flow.add(upm, ch.config.upm_base);
+    
+    ch.session_usage.set_segment_zones(tick_budget_.allows(TickBudget::no_zones));
 
-      secs_since_last_publish_ += report_period_secs;
-      if (secs_since_last_publish_ >=  publish_usage_secs_) {
-        // Publish usage 
-        mqtt_client->publish_json(mqttSensorWfCurrentUsageState_, [=](JsonObject &root) { 
-          currentWaterUsage.toJson(&root);
-          currentWaterUsage.init();
-          });
+    // We only add to session usage if we do not have a named usage in process
+    // (named usage is on channel 0)
+    if ((channel != 0 || namedWaterUsage_.count() == 0) && ch.session_usage.addUsage(usage, upm)) {
+      publish_usage(ch.topic_session_usage, ch.session_usage.getLastClosed());
+    }
 
-        secs_since_last_publish_ = 0;
-      }
-    } // if (time_is_valid_ == 1)
+    //if (app_ == "wwh") {
+    if (channel == 0) {
+      disaggregate(upm, report_period_secs);
+    }
+    //}
+
+    ch.secs_since_last_publish += report_period_secs;
+    if (ch.secs_since_last_publish >=  publish_usage_secs_) {
+      // Publish usage 
+      ch.settle_usage();
+      publish_json(ch.topic_current_usage, [&](JsonBuffer& jb, JsonObject& root) { 
+        ch.current_usage.toJson(jb, &root);
+        ch.next_current();
+        });
 
-    APP_LOG_EXIT("process_wf_on_value");
+      ch.secs_since_last_publish = 0;
+    }
 
+    usage_snapshot_.channels[channel].upm = upm;
+    snapshot_usage(channel);
+    publish_usage_snapshot();
+}
+
+// Copies the channel's counters to the writer's snapshot
+void dApp::snapshot_usage(int channel) {
+    FlowChannel& ch = channels_[channel];
+    UsageSnapshot::Channel& snap = usage_snapshot_.channels[channel];
+
+    snap.current_usage = ch.active[UsageAccumulators::current];
+    snap.hourly_usage = ch.active[UsageAccumulators::hourly];
+    snap.daily_usage = ch.active[UsageAccumulators::daily];
+
+    const WaterUsageSession* session = ch.session_usage.getCurrentStarted();
+    snap.session_active = session != nullptr;
+    snap.session_start_time = session ? session->start_time : 0;
+    snap.session_usage = session ? session->getUsage() : 0;
+    snap.session_zones = session ? session->zone_count : 0;
+    snap.over_limit = ch.policy.over_limit || ch.usage_over;
+
+    snap.hourly_closed = ch.hourly_usage.countClosed;
+    snap.daily_closed = ch.daily_usage.countClosed;
+    snap.sessions_closed = ch.session_usage.countClosed;
+    UsageSnapshot::set_closed(snap.last_hour, ch.hourly_usage.getLastClosed());
+    UsageSnapshot::set_closed(snap.last_day, ch.daily_usage.getLastClosed());
+    UsageSnapshot::set_closed(snap.last_session, ch.session_usage.getLastClosed());
+}
+
+void dApp::publish_usage_snapshot() {
+    usage_snapshot_.time = app_clock.now();
+    usage_snapshot_.channel_count = channel_count_;
+    usage_snapshot_.valve_open = valve_is_open_;
+    usage_seqlock_.write(usage_snapshot_);
+}
+
+// Samples taken before the clock was set, each at its own time (see 
+// early_samples.h). The accounting of all of them is done as soon as the
+// clock is set; their limits were checked when they arrived.
+void dApp::replay_early_samples() {
+    if (early_samples_.empty()) {
+      return;
+    }
+
+    APP_LOG_LOG("replaying %i early samples, %i dropped", early_samples_.count, early_samples_.dropped);
+
+    for (int i = 0; i < early_samples_.count; ++i) {
+      const EarlySample& sample = early_samples_.samples[i];
+      app_clock.replay_at(uint64_t(sample.end_secs) * 1000);
+      process_sample(channels_[sample.channel], sample.channel, sample.upm, sample.secs);
+    }
+    early_samples_.clear();
+
+    app_clock.snapshot();
 }
 
 void _entry_point dApp::on_new_hour() {
+    APP_METRICS_ENTRY(on_new_hour);
 
     APP_LOG_ENTER("on_new_hour()");
 
-    hourlyWaterUsage_.next();
+    app_clock.snapshot();
+    // From the time server, which triggers this on the hour. app_clock
+    // may be a fraction of a second behind it.
+    int hour = sntp_time->now().hour;
+    bool in_night = in_baseline_night(hour);
 
-    mqtt_client->publish_json(mqttSensorWfHourlyUsageStatus_, [=](JsonObject &root) { 
-      hourlyWaterUsage_.getLastClosed().toJson(&root);
-      });
+    for (int i = 0; i < budget_count_; ++i) {
+      budgets_[i].next_hour(hour);
+    }
+
+    for (int i = 0; i < channel_count_; ++i) {
+      FlowChannel& ch = channels_[i];
+      ch.next_hour();
+      publish_usage(ch.topic_hourly_usage, ch.hourly_usage.getLastClosed());
+      snapshot_usage(i);
+
+      if (ch.baseline.in_night && !in_night) {
+        close_baseline_night(ch);
+      }
+      ch.baseline.in_night = in_night;
+
+      if (ch.continuous_flow.next_hour(continuous_flow_hours_)) {
+        if (ch.continuous_flow.alarm) {
+          mqtt_client->publish(ch.topic_continuous_flow, "on", 2, 2);
+          if (continuous_flow_close_valve_ && app_ == "wwh") {
+            close_valve();
+          }
+        } else {
+          mqtt_client->publish(ch.topic_continuous_flow, "off", 3, 2);
+        }
+        APP_LOG_LOG("continuous flow: channel=%i, alarm=%i, hours=%i", 
+          i, ch.continuous_flow.alarm, ch.continuous_flow.hours_without_base);
+      }
+    }
+
+    #ifdef APP_METRICS
+    app_metrics.alloc.sample_heap(true);
+    #endif
 
     while (namedWaterUsage_.purgeFirstExpired());
 
     calc_max_plus_values();
 
+    publish_usage_snapshot();
+
     APP_LOG_EXIT("on_new_hour");
 }
 
+// The night window has ended: publish what we saw and test for a slow leak
+void dApp::close_baseline_night(FlowChannel& ch) {
+  BaselineMonitor& baseline = ch.baseline;
+
+  if (baseline.night.empty()) {
+    return;
+  }
+
+  bool changed = baseline.close_night(ch.config.upm_base, baseline_drift_);
+
+  publish_json(ch.topic_baseline, [&](JsonBuffer& jb, JsonObject& root) { 
+    root["secs"] = baseline.night.weight;
+    root["mean"] = baseline.night.mean;
+    root["stddev"] = baseline.night.stddev();
+    root["min"] = baseline.night.min;
+    root["max"] = baseline.night.max;
+    root["reference"] = baseline.reference;
+    root["water_flow_base"] = ch.config.upm_base;
+    root["suggested_base"] = baseline.suggested_base();
+    root["uom"] = xlate_mgr_.current->uom_text();
+    });
+
+  if (changed) {
+    if (baseline.slow_leak) {
+      mqtt_client->publish(ch.topic_slow_leak, "on", 2, 2);
+    } else {
+      mqtt_client->publish(ch.topic_slow_leak, "off", 3, 2);
+    }
+  }
+
+  APP_LOG_LOG("baseline night closed: mean=%f, min=%f, reference=%f, slow_leak=%i", 
+    baseline.night.mean, baseline.night.min, baseline.reference, baseline.slow_leak);
+
+  baseline.night.clear();
+}
+
 void _entry_point dApp::on_new_day() {
+  APP_METRICS_ENTRY(on_new_day);
 
   APP_LOG_ENTER("on_new_day()");
 
-    dailyWaterUsage_.next();
+  app_clock.snapshot();
 
-    mqtt_client->publish_json(mqttSensorWfDailyUsageStatus_, [=](JsonObject &root) { 
-      dailyWaterUsage_.getLastClosed().toJson(&root);
-      });
+    for (int i = 0; i < channel_count_; ++i) {
+      FlowChannel& ch = channels_[i];
+      ch.next_day();
+      publish_usage(ch.topic_daily_usage, ch.daily_usage.getLastClosed());
+      snapshot_usage(i);
+    }
+    publish_usage_snapshot();
 
   APP_LOG_EXIT("on_new_day");
 }
 
 
 void _entry_point dApp::add_allowance(const JsonObject& jo) {
+    APP_METRICS_ENTRY(add_allowance);
     // {  name: "washing machine",
     //    upm: 1.1,
     //    usage: -1,
@@ -641,7 +1592,7 @@ void _entry_point dApp::add_allowance(const JsonObject& jo) {
   
     if (!name.empty()) {
 
-      time_t expire_time = sntp_time->now().timestamp + (expire_secs * 1000);
+      time_t expire_time = app_clock.now() + expire_secs;
       specific_allowances_.add_item(name, upm, usage, expire_time, create_named_session);
 
       if (create_named_session) {
@@ -662,6 +1613,7 @@ void _entry_point dApp::add_allowance(const JsonObject& jo) {
 }
 
 void _entry_point dApp::delete_allowance(const JsonObject& jo) {
+  APP_METRICS_ENTRY(delete_allowance);
   // {  name: "washing machine" }
 
   APP_LOG_ENTER("delete_allowance()");
@@ -700,6 +1652,7 @@ void _entry_point dApp::delete_allowance(const JsonObject& jo) {
 
 
 void _entry_point dApp::add_named_usage(const JsonObject& jo) {
+    APP_METRICS_ENTRY(add_named_usage);
     APP_LOG_ENTER("add_named_usage()");
 
     std::string name(getString(jo, "name", ""));
@@ -708,9 +1661,9 @@ void _entry_point dApp::add_named_usage(const JsonObject& jo) {
     
     if (!name.empty()) {
       // No sessions during named
-      sessionWaterUsage_.clearCurrent();
+      channels_[0].session_usage.clearCurrent();
       namedWaterUsage_.add_usage_unit(name, 
-        sntp_time->now().timestamp + (expire_secs * 1000));
+        app_clock.now() + expire_secs);
       
       APP_LOG_LOG("add named usage { name: %s }", name.c_str());
       } else {
@@ -721,6 +1674,7 @@ void _entry_point dApp::add_named_usage(const JsonObject& jo) {
 }
 
 void _entry_point dApp::delete_named_usage(const JsonObject& jo) {
+  APP_METRICS_ENTRY(delete_named_usage);
   APP_LOG_ENTER("delete_named_usage()");
 
   delete_named_usage(getString(jo, "name", ""), getBool(jo, "cancel", false));
@@ -732,8 +1686,8 @@ void dApp::delete_named_usage(const std::string name, bool cancel) {
 
   if (!name.empty()) {
     if (namedWaterUsage_.delete_usage_unit(name) && !cancel) {
-      mqtt_client->publish_json(mqttSensorWfNamedUsageState_, [=](JsonObject &root) { 
-        namedWaterUsage_.getLastClosed().toJson(&root);
+      publish_json(mqttSensorWfNamedUsageState_, [=](JsonBuffer& jb, JsonObject& root) { 
+        namedWaterUsage_.getLastClosed().toJson(jb, &root);
         });
     }
     
@@ -745,22 +1699,23 @@ void dApp::delete_named_usage(const std::string name, bool cancel) {
 }
 
 void _entry_point dApp::set_report_period_secs(const JsonObject& jo) {
+    APP_METRICS_ENTRY(set_report_period_secs);
     APP_LOG_ENTER("set_report_period_secs()");
 
     int wf_off(getFloat(jo, "wf_off", -1));
     int wf_on(getFloat(jo, "wf_on", -1));
 
     if (wf_off >= 0) {
-      wf_->set_report_period_wf_off_mode_secs(wf_off);
+      channels_[0].wf->set_report_period_wf_off_mode_secs(wf_off);
     } 
     
     if (wf_on >= 0) {
-      wf_->set_report_period_wf_on_mode_secs(wf_on);
+      channels_[0].wf->set_report_period_wf_on_mode_secs(wf_on);
     }
 
     APP_LOG_LOG("set_report_period_secs { wf_off: %i, wf_on: %i }", wf_off, wf_on);
 
-    send_retained_properties();
+    mark_properties_dirty(1 << prop_report_period_secs);
 
     APP_LOG_EXIT("set_report_period_secs");
 
@@ -768,42 +1723,91 @@ void _entry_point dApp::set_report_period_secs(const JsonObject& jo) {
 
 
 
+// The closed lists of every channel can be far larger than one message
+// (up to 168 units a list, 3 lists a channel), so they go out as parts, 
+// each one page of one list:
+//
+//   {"part": 0, "parts": 5, "channel": 0, "name": "main",
+//    "hourly": {"current": {...}, "closed": [...]}}
+//
+// A page has at most APP_CLOSED_PAGE_UNITS closed units 
+// (APP_CLOSED_PAGE_SESSIONS sessions), most recent first, and the 
+// current unit is on a list's first page. Parts are numbered from 0 and
+// published in order: channel by channel, "hourly", "daily" then 
+// "sessions", and with named, {"part": n, "parts": n + 1, "named": {...}}
+// last.
+void dApp::publish_closed(bool named) {
+  int parts = named ? 1 : 0;
+  for (int i = 0; i < channel_count_; ++i) {
+    FlowChannel& ch = channels_[i];
+    ch.settle_usage();
+    parts += closed_pages(ch.hourly_usage.get_closed_count(), APP_CLOSED_PAGE_UNITS)
+      + closed_pages(ch.daily_usage.get_closed_count(), APP_CLOSED_PAGE_UNITS)
+      + closed_pages(ch.session_usage.get_closed_count(), APP_CLOSED_PAGE_SESSIONS);
+  }
+
+  int part = 0;
+  for (int i = 0; i < channel_count_; ++i) {
+    FlowChannel& ch = channels_[i];
+    publish_closed_list(i, "hourly", ch.hourly_usage, APP_CLOSED_PAGE_UNITS, part, parts);
+    publish_closed_list(i, "daily", ch.daily_usage, APP_CLOSED_PAGE_UNITS, part, parts);
+    publish_closed_list(i, "sessions", ch.session_usage, APP_CLOSED_PAGE_SESSIONS, part, parts);
+  }
+
+  if (named) {
+    publish_json(mqttTopicClosedUsageState_, [=](JsonBuffer& jb, JsonObject& root) { 
+      root["part"] = part;
+      root["parts"] = parts;
+      root["named"] = namedWaterUsage_.toJson(jb);
+    });
+  }
+}
+
 void _entry_point dApp::get_closed() {
+    APP_METRICS_ENTRY(get_closed);
     APP_LOG_ENTER("get_closed()");
 
-    mqtt_client->publish_json(mqttTopicClosedUsageState_, [=](JsonObject &root) { 
-      root["hourly"] = hourlyWaterUsage_.toJson();
-      root["daily"] = dailyWaterUsage_.toJson();
-      root["sessions"] = sessionWaterUsage_.toJson();
-      if (app_ == "wwh") {
-        root["named"] = namedWaterUsage_.toJson();
-      }
-      });
+    publish_closed(app_ == "wwh");
 
     APP_LOG_EXIT("get_closed");
 }
 
   void _entry_point dApp::clear_closed() {
+    APP_METRICS_ENTRY(clear_closed);
     APP_LOG_ENTER("clear_closed()");
 
-    hourlyWaterUsage_.clearClosed();
-      dailyWaterUsage_.clearClosed();
-      sessionWaterUsage_.clearClosed();
+    for (FlowChannel& ch : channels_) {
+      ch.hourly_usage.clearClosed();
+      ch.daily_usage.clearClosed();
+      ch.session_usage.clearClosed();
+    }
       namedWaterUsage_.clearClosed();
 
-      mqtt_client->publish_json(mqttTopicClosedUsageState_, [=](JsonObject &root) { 
-        root["hourly"] = hourlyWaterUsage_.toJson();
-        root["daily"] = dailyWaterUsage_.toJson();
-        root["sessions"] = sessionWaterUsage_.toJson();
-        //if (app_ == "wwh") {
-          root["named"] = namedWaterUsage_.toJson();
-        //}
-        });
+      publish_closed(true);
 
     APP_LOG_EXIT("clear_closed");
 
   }
 
+// Publishes per entry point latency (count, min, max, p99 in microseconds)
+// and heap state. Entry points that have not been called are omitted.
+void _entry_point dApp::get_metrics() {
+    APP_METRICS_ENTRY(get_metrics);
+    APP_LOG_ENTER("get_metrics()");
+
+    #ifdef APP_METRICS
+    publish_json(mqttSensorMetricsState_, [=](JsonBuffer& jb, JsonObject& root) { 
+      root["fw_version"] = FW_VERSION;
+      root["uptime_secs"] = millis() / 1000;
+      app_metrics.toJson(jb, root);
+      root["budget"] = tick_budget_.toJson(jb);
+      root["json"] = json_publisher_.toJson(jb);
+      });
+    #endif
+
+    APP_LOG_EXIT("get_metrics");
+}
+
   // We receive sensor native pulses per period and return units per period (gals or liters)
   // In esphome that period is always a minute, but the math is the same no matter the
   // period length. 
@@ -813,6 +1817,7 @@ void _entry_point dApp::get_closed() {
 
   // WWH functions
 void _entry_point dApp::set_valve_status(bool open) {
+  APP_METRICS_ENTRY(set_valve_status);
   APP_LOG_ENTER("set_valve_status()"/*, to_string(open).c_str()*/);
 
   valve_is_open_ = open;
@@ -822,7 +1827,7 @@ void _entry_point dApp::set_valve_status(bool open) {
     if (do_not_send_retained_on_next_valve_operation_) {
       do_not_send_retained_on_next_valve_operation_ = false;
     } else {
-      send_retained_properties();
+      mark_properties_dirty(1 << prop_valve_open);
     }
   }
   APP_LOG_EXIT("set_valve_status");
@@ -845,6 +1850,7 @@ void dApp::close_valve() {
 }
 
 void _entry_point dApp::toggle_valve() {
+  APP_METRICS_ENTRY(toggle_valve);
   APP_LOG_ENTER("toggle_valve()");
 
   // #ifdef valve_close
@@ -857,19 +1863,122 @@ void _entry_point dApp::toggle_valve() {
   APP_LOG_EXIT("toggle_valve");
 }
 
-void dApp::refresh_display(float pulses) {
-  APP_LOG_LOG("refresh_display()");
+// Splits channel 0's flow into its known loads and the rest (see 
+// known_loads.h) and matches the signatures against the rest. A matched
+// signature is over by the time it matches, so rather than being
+// subtracted as a load it is recorded as a closed named usage.
+void dApp::disaggregate(float upm, int secs) {
+  float rest_upm = KnownLoads::split(upm, secs, specific_allowances_, namedWaterUsage_);
 
-  ssd1306_i2c_i2cssd1306->set_writer([=](display::DisplayBuffer & it) -> void {
-        it.printf(0, 8, fontOpenSans, "WF: %.2f", pulses);
-        if (over_limit_) {
-          it.print(0, 30, fontOpenSans, "OVER LIMIT!");
-        } else if (max_upm_plus_ < 0) {
-          it.printf(0, 40, fontOpenSans, "No Max!");
-        } else {
-          it.printf(0, 40, fontOpenSans, "Max: %.2f", max_upm_plus_);
-        }
-    });
+  if (!tick_budget_.allows(TickBudget::no_signatures)) {
+    return;
+  }
+
+  channels_[0].wf->match_signatures(rest_upm, secs, [&](Signature& signature) {
+    // Over limit is OverLimitPolicy's job
+    if (signature.is(Signature::built_in)) {
+      return;
+    }
+
+    time_t now = app_clock.now();
+    if (namedWaterUsage_.add_closed_unit(signature.get_name(), now - signature.matched_secs, 
+      signature.matched_secs, signature.matched_usage)) {
+      publish_json(mqttSensorWfNamedUsageState_, [&](JsonBuffer& jb, JsonObject& root) { 
+        namedWaterUsage_.getLastClosed().toJson(jb, &root);
+        root["signature"] = true;
+        });
+    }
+    APP_LOG_LOG("signature matched: %s, usage=%f, secs=%i", 
+      signature.get_name().c_str(), signature.matched_usage, signature.matched_secs);
+  });
+}
+
+// Puts the schedule rules in force now into effect and sets when to 
+// look again: the next start or end of a rule, but at least hourly so a
+// clock or timezone change is picked up.
+void dApp::apply_schedule() {
+  auto time = app_clock.local();
+  int now = Schedule::minute_of_week(time.day_of_week, time.hour, time.minute);
+
+  bool changed = false;
+  for (int i = 0; i < channel_count_; ++i) {
+    int index = schedule_.active_rule(i, now);
+    if (channels_[i].set_schedule_rule(index, index < 0 ? nullptr : &schedule_.rules[index])) {
+      APP_LOG_LOG("schedule: channel=%i, rule=%i", i, index);
+      changed = true;
+    }
+  }
+  if (changed) {
+    calc_max_plus_values();
+  }
+
+  int minutes = schedule_.minutes_to_next_transition(now, 60);
+  schedule_due_ms_ = millis() + (minutes * 60 - time.second) * 1000;
+}
+
+bool dApp::add_budget_usage(FlowChannel& ch, int channel, float usage) {
+  bool over = false;
+
+  ch.add_limit_usage(usage);
+  if (ch.max_usage_plus >= 0) {
+    over = ch.usage_toward_max() > ch.max_usage_plus;
+  }
+
+  for (int i = 0; i < budget_count_; ++i) {
+    if (budgets_[i].channel == channel && budgets_[i].add(usage)) {
+      over = true;
+    }
+  }
+
+  return over;
+}
+
+#ifdef APP_EDGE_CAPTURE
+// Publishes and rearms the finished edge captures (see edge_capture.h)
+void dApp::publish_edge_captures() {
+  // Static, it is too big for the loop task's stack
+  static char payload[EdgeCapture::payload_size];
+
+  for (int i = 0; i < channel_count_; ++i) {
+    EdgeCapture& capture = channels_[i].wf->get_edge_capture();
+    if (capture.is_ready()) {
+      size_t len = capture.encode(i, app_clock.now(), payload, sizeof(payload));
+      if (len) {
+        mqtt_client->publish(channels_[i].topic_edges, payload, len, 0, false);
+      }
+      capture.rearm();
+      APP_LOG_LOG("edge capture: channel=%i, bytes=%i", i, int(len));
+    }
+  }
+}
+#endif
+
+// Brings the display model up to date and redraws the display if
+// anything on its screen changed. Never called per sample.
+void dApp::update_display() {
+  // As a reader on another task would see them
+  static UsageSnapshot usage;
+  read_usage(usage);
+  const UsageSnapshot::Channel& snap = usage.channels[0];
+
+  display_.set_max_upm_plus(channels_[0].max_upm_plus);
+  display_.set_over_limit(snap.over_limit);
+  display_.set_usage(snap.hourly_usage, snap.daily_usage);
+  display_.set_session(snap.session_active, snap.session_usage, snap.session_zones);
+
+  bool slow_leak = false;
+  bool continuous_flow = false;
+  for (int i = 0; i < channel_count_; ++i) {
+    slow_leak = slow_leak || channels_[i].baseline.slow_leak;
+    continuous_flow = continuous_flow || channels_[i].continuous_flow.alarm;
+  }
+  display_.set_alarms(slow_leak, continuous_flow);
+  display_.set_valve_open(valve_is_open_);
+
+  if (display_.tick(millis())) {
+    APP_LOG_LOG("update_display()");
+    ssd1306_i2c_i2cssd1306->update();
+  }
 }
 
 void dApp::SetStatusLEDBasedOnValveStatus() const {     
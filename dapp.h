@@ -27,6 +27,59 @@ extern ssd1306_i2c::I2CSSD1306 *ssd1306_i2c_i2cssd1306;
 
 // water usage include here because it needs the defs above
 #include "water_usage.h"
+#include "flow_channel.h"
+#include "usage_budget.h"
+#include "specific_allowance.h"
+#include "known_loads.h"
+#include "schedule.h"
+#include "json_arena.h"
+#include "app_clock.h"
+#include "early_samples.h"
+#include "app_snapshot.h"
+#include "display_model.h"
+#include "seqlock.h"
+#include "usage_snapshot.h"
+#include "tick_budget.h"
+#include "property_table.h"
+
+// The properties of a dApp (see the Properties comment in dapp.cpp).
+// Properties are applied in this order, so a property that others 
+// depend on (unit_of_measure) must come before them.
+// Adding a property: add a line here and write its prop_get_<name>()
+// and prop_set_<name>() members.
+// out says where the property is published (see PropOut). Heavy 
+// properties are the large ones. With stat_diff on they are left out of 
+// /stat and each is published retained on /stat/<name>, only when it 
+// changes. allowances are only set: they are kept in the flash snapshot, 
+// not retained on the broker.
+//
+//  name                    type      validator                   side effect hook              out
+#define DAPP_PROPERTIES(P) \
+  P(timezone,               String,   nullptr,                    nullptr,                      stat) \
+  P(closed_periods_max,     Int,      nullptr,                    nullptr,                      stat) \
+  P(unit_of_measure,        String,   nullptr,                    nullptr,                      stat) \
+  P(water_flow_max,         Float,    nullptr,                    &dApp::calc_max_plus_values,  stat) \
+  P(water_flow_base,        Float,    &dApp::valid_not_negative,  nullptr,                      stat) \
+  P(calibrate_factor,       Float,    &dApp::valid_not_zero,      nullptr,                      stat) \
+  P(test_period_secs,       Int,      &dApp::valid_not_negative,  &dApp::calc_max_plus_values,  stat) \
+  P(initial_surge_secs,     Int,      &dApp::valid_not_negative,  &dApp::calc_max_plus_values,  stat) \
+  P(closed_sessions_max,    Int,      nullptr,                    nullptr,                      stat) \
+  P(min_session_secs,       Int,      &dApp::valid_not_negative,  nullptr,                      stat) \
+  P(end_session_secs,       Int,      &dApp::valid_not_negative,  nullptr,                      stat) \
+  P(session_zone_step,      Float,    &dApp::valid_not_negative,  nullptr,                      stat) \
+  P(allowances,             Array,    nullptr,                    &dApp::calc_max_plus_values,  none) \
+  P(valve_open,             Bool,     nullptr,                    nullptr,                      stat) \
+  P(report_period_secs,     Object,   nullptr,                    nullptr,                      stat) \
+  P(channels,               Array,    nullptr,                    &dApp::calc_max_plus_values,  stat) \
+  P(baseline,               Object,   nullptr,                    nullptr,                      stat) \
+  P(continuous_flow,        Object,   nullptr,                    nullptr,                      stat) \
+  P(flow_change,            Object,   nullptr,                    nullptr,                      stat) \
+  P(water_usage_max,        Float,    nullptr,                    &dApp::calc_max_plus_values,  stat) \
+  P(usage_budgets,          Array,    nullptr,                    nullptr,                      stat) \
+  P(schedule,               Array,    nullptr,                    &dApp::calc_max_plus_values,  stat) \
+  P(signatures,             Array,    nullptr,                    nullptr,                      heavy) \
+  P(stat_coalesce_ms,       Int,      &dApp::valid_not_negative,  nullptr,                      stat) \
+  P(stat_diff,              Bool,     nullptr,                    nullptr,                      stat)
 
 
 
@@ -65,19 +118,22 @@ class dApp {
   // list of the data that needs translating:
 
   //    specific_allowances_
-  //    currentWaterUsage
-  //    WaterUsage* lists:
-  //      hourlyWaterUsage_;
-  //      dailyWaterUsage_;
-  //      sessionWaterUsage_;
-  //      namedWaterUsage_;
-  //    Anything with "upm" in its name:
-  //      max_upm_
-  //      max_upm_plus_
-  //      upm_base_
-  //    A few things with "usage" in its name:
-  //      max_usage_ 
-  //      max_usage_plus_ 
+  //    namedWaterUsage_;
+  //    and in each FlowChannel:
+  //      current_usage
+  //      WaterUsage* lists:
+  //        hourly_usage;
+  //        daily_usage;
+  //        session_usage;
+  //      Anything with "upm" in its name:
+  //        max_upm
+  //        max_upm_plus
+  //        config.upm_base
+  //      A few things with "usage" in its name:
+  //        max_usage 
+  //        max_usage_plus 
+  //        scheduled_max_upm, scheduled_max_usage
+  //    budgets_ and the rules in schedule_
 
   //void convert_uom(TranslationUnit* xlate_from, TranslationUnit* xlate_to) {
   void convert_uom(const char* from, float old_calibrate_factor=0) {
@@ -87,32 +143,26 @@ class dApp {
     specific_allowances_.convert_uom( [=](float &val) {
       return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
     });
-    currentWaterUsage.convert_uom( [=](float &val) {
-      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
-    });
-    specific_allowances_.convert_uom( [=](float &val) {
-      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
-    });
-    hourlyWaterUsage_.convert_uom( [=](float &val) {
-      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
-    });
-    dailyWaterUsage_.convert_uom( [=](float &val) {
-      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
-    });
-    sessionWaterUsage_.convert_uom( [=](float &val) {
-      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
-    });
     namedWaterUsage_.convert_uom( [=](float &val) {
       return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
     });
 
-    max_upm_ = xlate_mgr_.convert(convert_code, max_upm_, old_calibrate_factor);
-    upm_base_ = xlate_mgr_.convert(convert_code, upm_base_, old_calibrate_factor);
-    if (max_usage_ != -1) {
-      max_usage_ = xlate_mgr_.convert(convert_code, max_usage_, old_calibrate_factor);
+    for (FlowChannel& ch : channels_) {
+      ch.convert_uom( [=](float &val) {
+        return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
+      });
+    }
+    baseline_drift_ = xlate_mgr_.convert(convert_code, baseline_drift_, old_calibrate_factor);
+    for (UsageBudget& budget : budgets_) {
+      budget.convert_uom( [=](float &val) {
+        return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
+      });
     }
+    schedule_.convert_uom( [=](float &val) {
+      return xlate_mgr_.convert(convert_code, val, old_calibrate_factor);
+    });
 
-    // calc max_upm_plus_ and max_usage_plus_
+    // calc max_upm_plus and max_usage_plus
     calc_max_plus_values();
 
     // Update water flow sensor
@@ -120,11 +170,12 @@ class dApp {
 
   }
 
-  // -1: not tested yet, 0: tested not valid, 1: tested is valid
-  int time_is_valid_ = -1;
+  // SNTP is checked every tick until app_clock is set and then this 
+  // often to keep it in step (see on_tick())
+  static const uint32_t clock_sync_ms_ = 60000;
+  uint32_t clock_synced_ms_ = 0;
   // User can calibrate the device pulses to user units
   float calibrate_factor_ = 1.0;
-  bool over_limit_ = false;
 
   // When do we alarm?
   // There are a number of factors. All of these are sent to us from our 
@@ -152,184 +203,61 @@ class dApp {
   //      revoke in this amount of time. The can be multiple specific allowances
   //      at any time
 
-  struct SpecificAllowance {
-      std::string name;
-      float       upm = 0;
-      float       usage = 0;
-      time_t      expire_time = 0; 
-      bool        create_named_session = false;
-
-      SpecificAllowance(
-        const std::string&  _name,
-        float               _upm,
-        float               _usage,
-        time_t              _expire_time,
-        bool                _create_named_session):
-          name(_name),
-          upm(_upm),
-          usage(_usage),
-          expire_time(_expire_time),
-          create_named_session(_create_named_session) {
-          }
-
-      SpecificAllowance(const JsonObject& jo):
-        name(getString(jo, "name", "")),
-        upm(getFloat(jo, "upm", 0)),
-        usage(getFloat(jo, "usage", 0)),
-        expire_time(getInt(jo, "expire_time", 0)),
-        create_named_session(getBool(jo, "cns", false))
-      { }
-
-      void convert_uom(std::function<float(float &)>f) {
-          upm = f(upm);
-          usage = f(usage);
-      }
-  
-      JsonObject& toJson() const {
-          JsonObject& jo = global_json_buffer.createObject();
-
-          jo["name"] = name;
-          jo["upm"] = upm;
-          jo["usage"] = usage;
-          jo["expire_time"] = expire_time;
-          jo["cns"] = create_named_session;
-
-          return jo;
-      }
-
-  
-  };
-
-  struct SpecificAllowances: public std::vector<SpecificAllowance> {
-
-    SpecificAllowances() {}
-
-    SpecificAllowances(const JsonArray& ja) {
-      for (int i = 0; i < ja.size(); ++i) {
-        if (ja[i].is<JsonObject>()) {
-          push_back(SpecificAllowance((const JsonObject&)ja[i]));
-        }
-      }
-    }
-
-    void convert_uom(std::function<float(float &)>f) {
-        for (auto it = begin(); it != end(); ++it) {
-            it->convert_uom(f);
-        }
-    }
-
-    void add_item(const std::string& name, float upm, float usage, 
-      time_t expire_time, bool create_named_session) {
-      this->delete_item(name);
-      push_back(SpecificAllowance(name, upm, usage, expire_time, create_named_session));
-    }
-
-    void delete_item(const std::string& name) {
-      auto now = sntp_time->now().timestamp;
-      auto it = begin();
-      while ( it != end()) {
-        if (it->name == name || it->expire_time >= now) {
-          // delete
-          it = erase(it);
-        } else {
-          ++it;
-        }
-      }
-    }
-
-    SpecificAllowance* get(const std::string& name) {
-      for (auto it = begin(); it != end(); ++it) {
-        if (it->name == name) {
-          return &*it;
-        }
-      }
-      return nullptr;
-    }
-
-    // Note that we delete allowances without notifying caller
-    // This should be OK because these are allowance that have not been
-    // properly explicitly deleted. Auto created named sessions will be
-    // timed deleted elsewhere.
-    void get_totals(float& upm_allowance, float& usage_allowance) {
-      auto now = sntp_time->now().timestamp;
-      auto it = begin();
-      while ( it != end()) {
-        if (it->expire_time >= now) {
-          // delete
-          it = erase(it);
-        } else {
-          upm_allowance += it->upm;
-          usage_allowance += it->usage;
-          ++it;
-        }
-      }
-    }
-
-    JsonArray& toJson() const {
-      JsonArray& ja = global_json_buffer.createArray();
-      for (auto it = begin(); it != end(); ++it) {
-        ja.add(it->toJson());
-      }
-      return ja;
-    }
-
-
-  };
-
-
+  // See specific_allowance.h
   SpecificAllowances specific_allowances_;
 
+  // Specific allowances apply to channel 0
   void calc_max_plus_values() {
       float upm_allowance = 0;
       float usage_allowance = 0;
       specific_allowances_.get_totals(upm_allowance, usage_allowance);
 
-      max_upm_plus_ = max_upm_ < 0 ? max_upm_ : max_upm_ + upm_allowance;
-
-      if (max_usage_ > 0) {
-        max_usage_plus_ =  max_usage_ + usage_allowance;
+      channels_[0].calc_max_plus_values(upm_allowance, usage_allowance);
+      for (int i = 1; i < APP_MAX_FLOW_CHANNELS; ++i) {
+        channels_[i].calc_max_plus_values(0, 0);
+      }
+      for (int i = 0; i < channel_count_; ++i) {
+        channels_[i].set_sensor_limits(xlate_mgr_, app_ == "wwh");
       }
-
   }
 
-  // Negative for no upper limit
-  float max_upm_ = -1.0;
-  // Max allowed water flow + extant specific allowances;
-  float max_upm_plus_ = 0.0;
-  float max_usage_ = -1;
-  float max_usage_plus_ = -1;
-
-
-  // The water flow when no water should be flowing. You would think
-  // this would always be 0, but I'm making an allowance in case the
-  // user has a unfixable leak of some kind. 
-  float upm_base_ = 0.0;
-  pulse_counter::pulse_counter_t pulses_base_ = 0.0;
+  // How often do we publish usage?
+  int publish_usage_secs_ = 60;
 
+  // Night window (local hours, end exclusive) in which flow is taken
+  // as the baseline, and how far a night's mean may drift above the
+  // reference before it is a slow leak (see baseline_monitor.h)
+  int baseline_night_start_ = 1;
+  int baseline_night_end_ = 5;
+  float baseline_drift_ = 0.05;
+
+  bool in_baseline_night(int hour) const {
+    return baseline_night_start_ <= baseline_night_end_
+      ? hour >= baseline_night_start_ && hour < baseline_night_end_
+      : hour >= baseline_night_start_ || hour < baseline_night_end_;
+  }
 
-  // Test period seconds. We have to overlimit during a test period. A single
-  // spike is not sufficient to alarm.
-  // Should be a multiple of wf_report_interval_secs_. If not it will end up being rounded up
-  // to a multiple of wf_report_interval_secs_ anyway.
-  static const int test_period_secs_default_ = 15;
+  void close_baseline_night(FlowChannel& ch);
 
-  int test_period_secs_ = test_period_secs_default_;
+  // Usage (volume) limits, see usage_budget.h
+  UsageBudget budgets_[APP_MAX_USAGE_BUDGETS];
+  int budget_count_ = 0;
 
-  // Allow an initial surge when flow starts.
-  // The pipes in an irrigation system are often empty when a
-  // valve is first turned on. This allow time for the water
-  // flow surge until the pipes are filled.
-  int allow_initial_surge_seconds_ = 30;
-  int grace_for_surge_ = allow_initial_surge_seconds_;
+  // Adds usage to the channel's max_usage and budgets. Returns true if 
+  // the channel is over any of them.
+  bool add_budget_usage(FlowChannel& ch, int channel, float usage);
 
-  // Water is/is not flowing
-  //bool g_wf_off = true;
+  // Limits by time of day and weekday, see schedule.h. The rules are
+  // applied again when millis() reaches schedule_due_ms_.
+  Schedule schedule_;
+  uint32_t schedule_due_ms_ = 0;
 
-  int secs_over_limit_ = 0;
+  void apply_schedule();
 
-  // How often do we publish usage?
-  int publish_usage_secs_ = 60;
-  int secs_since_last_publish_ = 0;
+  // Alarm when a channel's flow has not been down to base for this many 
+  // hours (0 is off), and whether a wwh device then closes its valve
+  int continuous_flow_hours_ = 24;
+  bool continuous_flow_close_valve_ = false;
 
   // We prefix out mqtt messages with this prefix. The value originates in the 
   // yaml layer and is passed to us in on_boot. 
@@ -339,12 +267,8 @@ class dApp {
   std::string mqttTopicClosedUsageState_ = "/sensor/wf/closed_usage/state";
   std::string mqttTopicStat_ = "/stat";
   std::string mqttTopicProp_ = "/prop";
-  std::string mqttSensorWfOverlimitStatus_ = "/sensor/wf/over_limit/status";
-  std::string mqttSensorWfCurrentUsageState_ = "/sensor/wf/usage/current/state";
-  std::string mqttSensorWfHourlyUsageStatus_ = "/sensor/wf/usage/hourly/state";
-  std::string mqttSensorWfDailyUsageStatus_ = "/sensor/wf/usage/daily/state";
-  std::string mqttSensorWfSessionUsageState_ = "/sensor/wf/usage/session/state";
   std::string mqttSensorWfNamedUsageState_ = "/sensor/wf/usage/named/state";
+  std::string mqttSensorMetricsState_ = "/sensor/metrics/state";
 
   TranslationManager xlate_mgr_;
 
@@ -356,42 +280,185 @@ class dApp {
   // How often do we publish usage values to waterflow per minute publishing
   // We currently publish water flow every 15sec
 
-  WaterUsageTimed           currentWaterUsage;
-  WaterUsagePeriodList      hourlyWaterUsage_;
-  WaterUsagePeriodList      dailyWaterUsage_;
-  WaterUsageSessionList     sessionWaterUsage_;
   WaterUsageNamedList       namedWaterUsage_;
 
-  WaterflowSensor* wf_;
+  // Warm restart snapshots, see app_snapshot.h. Saved this often and
+  // at shutdown.
+  static const uint32_t snapshot_period_ms_ = 10 * 60 * 1000;
+  uint32_t snapshot_saved_ms_ = 0;
+  ESPPreferenceObject snapshot_pref_;
+  ESPPreferenceObject properties_pref_;
+
+  void save_snapshot();
+  void restore_snapshot();
+
+  // When the restored snapshot was saved, until the clock is set and 
+  // close_stale_units() has checked the units restored with it
+  time_t restored_time_ = 0;
+  void close_stale_units();
+
+  // Handles a flow sample of a channel, see process_wf_on_value(). 
+  // check_limits() as it arrives, process_sample(), the accounting, 
+  // once it has a time.
+  void check_limits(FlowChannel& ch, int channel, float upm, int report_period_secs);
+  void process_sample(FlowChannel& ch, int channel, float upm, int report_period_secs);
+
+  // The usage counters for readers on other tasks (see read_usage()).
+  // usage_snapshot_ is the writer's copy, published whole after each 
+  // change.
+  UsageSnapshot usage_snapshot_;
+  Seqlock<UsageSnapshot> usage_seqlock_;
+  void snapshot_usage(int channel);
+  void publish_usage_snapshot();
+
+#ifdef APP_EDGE_CAPTURE
+  void publish_edge_captures();
+#endif
+
+  // Sheds optional work when samples or ticks run long
+  TickBudget tick_budget_;
+
+  // What the display shows, redrawn from on_tick() (see display_model.h)
+  DisplayModel display_;
+  void update_display();
+
+  // Samples from before the time server set the clock
+  EarlySamples early_samples_;
+  void replay_early_samples();
+
+  // Attributes channel 0's flow to known loads, named usages and 
+  // signatures
+  void disaggregate(float upm, int secs);
+
+  // The flow meters, see flow_channel.h. Channel 0 always exists (it 
+  // is the channel create_wf_sensor() makes by default).
+  FlowChannel channels_[APP_MAX_FLOW_CHANNELS];
+  int channel_count_ = 0;
+
+  // Publishes a channel's usage unit on topic
+  template<class T>
+  void publish_usage(const std::string& topic, const T& wut) {
+    publish_json(topic, [&](JsonBuffer& jb, JsonObject& root) { 
+      wut.toJson(jb, &root);
+      });
+  }
+
+  // Every json message we publish is built and serialized in here 
+  JsonPublisher json_publisher_;
+
+  // Retained state publishing. Changes mark properties dirty and the
+  // /stat document goes out once, stat_coalesce_ms_ after the first 
+  // change, however many changes arrive in between (see on_tick()).
+  uint32_t dirty_props_ = 0;
+  bool stat_publish_pending_ = false;
+  uint32_t stat_publish_due_ms_ = 0;
+  int stat_coalesce_ms_ = 1000;
+  // Publish heavy properties on their own /stat/<name> topics
+  bool stat_diff_ = false;
+  // Properties that have a value from /stat, /stat/<name> or a command
+  // since boot. Used so a late retained /stat/<name> does not overwrite
+  // a newer value.
+  uint32_t have_props_ = 0;
+
+  // Property table, see DAPP_PROPERTIES above
+  enum PropIndex {
+    #define P(name, type, validate, hook, out) prop_##name,
+    DAPP_PROPERTIES(P)
+    #undef P
+    prop_count
+  };
+
+  static const PropertyDescriptor<dApp> properties_[prop_count];
+
+  // Hash of each heavy property's json as last published on (or taken
+  // from) its /stat/<name> topic, so an unchanged value is not sent
+  // again. 0 if unknown.
+  uint32_t stat_hash_[prop_count] = {0};
+
+  // Returns the PropIndex of name or -1 if there is no such property 
+  static int find_property(const char* name);
+
+  static uint32_t heavy_props_mask();
+
+  // Applies the known properties in jo, skipping those in skip. Returns
+  // the mask of properties applied.
+  uint32_t apply_properties(const JsonObject& jo, uint32_t skip=0);
+
+  void mark_properties_dirty(uint32_t mask);
+  void publish_dirty_properties();
+  void clear_heavy_stat_topics();
+
+  #define P(name, type, validate, hook, out) \
+    void prop_get_##name(JsonBuffer& jb, JsonObject& jo); \
+    void prop_set_##name(const JsonVariant& v);
+  DAPP_PROPERTIES(P)
+  #undef P
+
+  bool valid_not_zero(const JsonVariant& v) { return v.as<float>() != 0; }
+  bool valid_not_negative(const JsonVariant& v) { return v.as<float>() >= 0; }
+
+  void publish_json(const std::string& topic, const JsonPublisher::json_build_t& f, 
+    uint8_t qos=0, bool retain=false, uint32_t* last_hash=nullptr) {
+    json_publisher_.publish(topic, f, qos, retain, last_hash);
+  }
 
 public:
   dApp();
 
-  WaterflowSensor* _entry_point create_wf_sensor(int pin) {
+  // The usage counters of all channels as of the last sample. Safe to
+  // call from any task or core; never blocks the sample path.
+  void read_usage(UsageSnapshot& snapshot) const {
+    usage_seqlock_.read(snapshot);
+  }
+
+  // Channels are numbered from 0 in the order they are created and 
+  // can't be skipped
+  WaterflowSensor* _entry_point create_wf_sensor(int pin, int channel=0) {
+    APP_METRICS_ENTRY(create_wf_sensor);
     APP_LOG_ENTER("create_wf_sensor()");
 
-    wf_ = new WaterflowSensor(pin, xlate_mgr_);
+    WaterflowSensor* wf;
+
+    if (channel == channel_count_ && channel < APP_MAX_FLOW_CHANNELS) {
+      wf = new WaterflowSensor(pin, channel, xlate_mgr_);
+      channels_[channel].wf = wf;
+      ++channel_count_;
+    } else {
+      ESP_LOGE("main", "create_wf_sensor: channel %i is out of order or above %i, its flow is ignored",
+        channel, APP_MAX_FLOW_CHANNELS - 1);
+      wf = new WaterflowSensor(pin, channel, xlate_mgr_);
+    }
 
     APP_LOG_EXIT("create_wf_sensor");
 
-    return wf_;
+    return wf;
 
 }
 
   void _entry_point on_boot(const char* app, int wf_report_wf_off_interval_secs, int wf_report_fast_interval_secs);
 
+  // The valve's pins, as core_wwh.yaml's switches have them, for the 
+  // sensors to close the valve where the pulses are read (see
+  // WaterflowSensor::close_valve())
+  void set_valve_pins(int open, int close) {
+    WaterflowSensor::set_valve_pins(new GPIOPin(open, OUTPUT, true), new GPIOPin(close, OUTPUT, true));
+  }
+
   // Experimenting with new (for me) c++ 11 getter/setter syntax
   // usage is: tu.calibrate_factor()
   //            tu.calibrate_factor() = 12.3
   auto calibrate_factor()       -> float&       { return calibrate_factor_; }
   auto calibrate_factor() const -> const float& { return calibrate_factor_; }
   void makeMqttTopics(const std::string& prefix);
-  JsonObject& toJson(JsonObject& jo, const char* prop_name=nullptr);
+  JsonObject& toJson(JsonBuffer& jb, JsonObject& jo, const char* prop_name=nullptr, bool heavy=true);
   void _entry_point send_retained_properties();
   void send_property(const char* prop_name);
   void _entry_point process_stat(const JsonObject& x);
+  void _entry_point process_stat_property(const JsonObject& x);
+  void _entry_point on_tick();
+  void _entry_point on_shutdown();
   void _entry_point reset();
-  void _entry_point process_wf_on_value(float upm);
+  void _entry_point process_wf_on_value(float upm, int channel=0);
   void _entry_point process_properties(const JsonObject& jo, bool fromRetainedProperties=false);
   void _entry_point add_allowance(const JsonObject& jo);
   void _entry_point delete_allowance(const JsonObject& jo);
@@ -399,8 +466,32 @@ public:
   void _entry_point on_new_day();
   void SetStatusLED(float r, float g, float b) const;
   void SetStatusLEDBasedOnValveStatus() const;
+  void publish_closed(bool named);
+
+  static int closed_pages(int count, int page_units) {
+    return count <= 0 ? 1 : (count + page_units - 1) / page_units;
+  }
+
+  // One page per message, see publish_closed()
+  template<class L>
+  void publish_closed_list(int channel, const char* list_name, L& list, int page_units,
+    int& part, int parts) {
+
+    int count = list.get_closed_count();
+    for (int first = 0; first == 0 || first < count; first += page_units) {
+      publish_json(mqttTopicClosedUsageState_, [&](JsonBuffer& jb, JsonObject& root) {
+        root["part"] = part;
+        root["parts"] = parts;
+        root["channel"] = channel;
+        root["name"] = channels_[channel].name;
+        root[list_name] = list.toJson(jb, first, page_units);
+      });
+      ++part;
+    }
+  }
   void _entry_point get_closed();
   void _entry_point clear_closed();
+  void _entry_point get_metrics();
   //float _entry_point process_pulse_counter(float pulses) ;
   // WWH functions
   void _entry_point set_valve_status(bool open);
@@ -411,7 +502,6 @@ public:
   void _entry_point delete_named_usage(const JsonObject& jo);
   void delete_named_usage(const std::string name, bool cancel);
   void _entry_point set_report_period_secs(const JsonObject& jo);
-  void refresh_display(float pulses);
 
 };
 
@@ -0,0 +1,184 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include <math.h>
+
+////////////////////////////////////////////////////////
+// DisplayModel: what the SSD1306 shows
+//
+// The sample path and on_tick() only set fields here.
+// A field that changes at the precision it is shown with
+// sets its dirty bit. The display's writer is installed
+// once and draws the current screen from the model, and
+// the display is redrawn (and the frame sent over I2C)
+// only when a field shown on the current screen is dirty,
+// at most once per min_redraw_ms.
+//
+// The screens rotate every screen_ms: flow, hourly and
+// daily usage, the active session and alarm status.
+// While an alarm is on only flow and status rotate, and
+// a new alarm switches straight to status.
+////////////////////////////////////////////////////////
+
+struct DisplayModel {
+  enum Screen { screen_flow, screen_usage, screen_session, screen_status, screen_count };
+
+  enum Field {
+    field_upm         = 1 << 0,
+    field_max         = 1 << 1,
+    field_over_limit  = 1 << 2,
+    field_hourly      = 1 << 3,
+    field_daily       = 1 << 4,
+    field_session     = 1 << 5,
+    field_alarms      = 1 << 6,
+    field_valve       = 1 << 7,
+    field_all         = (1 << 8) - 1
+  };
+
+  uint32_t min_redraw_ms = 1000;
+  uint32_t screen_ms = 5000;
+
+  float upm = 0;
+  // Negative for no max
+  float max_upm_plus = -1;
+  bool  over_limit = false;
+  float hourly_usage = 0;
+  float daily_usage = 0;
+  bool  session_active = false;
+  float session_usage = 0;
+  int   session_zones = 0;
+  bool  slow_leak = false;
+  bool  continuous_flow = false;
+  bool  valve_open = true;
+
+  uint32_t dirty = field_all;
+  Screen   screen = screen_flow;
+  uint32_t screen_shown_ms = 0;
+  uint32_t drawn_ms = 0;
+
+  // Shown with 2 decimals
+  void set_upm(float v) { set(upm, v, 0.01, field_upm); }
+  void set_max_upm_plus(float v) { set(max_upm_plus, v, 0.01, field_max); }
+  void set_over_limit(bool v) { set(over_limit, v, field_over_limit); }
+  // Shown with 1 decimal
+  void set_usage(float hourly, float daily) {
+    set(hourly_usage, hourly, 0.1, field_hourly);
+    set(daily_usage, daily, 0.1, field_daily);
+  }
+  void set_session(bool active, float usage, int zones) {
+    set(session_active, active, field_session);
+    set(session_usage, usage, 0.1, field_session);
+    if (zones != session_zones) {
+      session_zones = zones;
+      dirty |= field_session;
+    }
+  }
+  void set_alarms(bool leak, bool continuous) {
+    set(slow_leak, leak, field_alarms);
+    set(continuous_flow, continuous, field_alarms);
+  }
+  void set_valve_open(bool v) { set(valve_open, v, field_valve); }
+
+  bool alarm() const { return over_limit || slow_leak || continuous_flow; }
+
+  // The fields a screen shows
+  static uint32_t fields(Screen s) {
+    switch (s) {
+      case screen_flow:    return field_upm | field_max | field_over_limit;
+      case screen_usage:   return field_hourly | field_daily;
+      case screen_session: return field_session;
+      default:             return field_over_limit | field_alarms | field_valve;
+    }
+  }
+
+  // Rotates the screens. Returns true if the display should be redrawn.
+  bool tick(uint32_t now_ms) {
+    if (uint32_t(now_ms - screen_shown_ms) >= screen_ms) {
+      show(next_screen(), now_ms);
+    }
+
+    if ((dirty & fields(screen)) && uint32_t(now_ms - drawn_ms) >= min_redraw_ms) {
+      drawn_ms = now_ms;
+      return true;
+    }
+
+    return false;
+  }
+
+  // The display's writer
+  void draw(display::DisplayBuffer& it, display::Font* font) {
+    switch (screen) {
+      case screen_flow:
+        it.printf(0, 8, font, "WF: %.2f", upm);
+        if (over_limit) {
+          it.print(0, 30, font, "OVER LIMIT!");
+        } else if (max_upm_plus < 0) {
+          it.print(0, 40, font, "No Max!");
+        } else {
+          it.printf(0, 40, font, "Max: %.2f", max_upm_plus);
+        }
+        break;
+      case screen_usage:
+        it.printf(0, 8, font, "Hr: %.1f", hourly_usage);
+        it.printf(0, 40, font, "Day: %.1f", daily_usage);
+        break;
+      case screen_session:
+        if (session_active) {
+          it.printf(0, 8, font, "Ses: %.1f", session_usage);
+          it.printf(0, 40, font, "Zones: %i", session_zones);
+        } else {
+          it.print(0, 8, font, "No session");
+        }
+        break;
+      default:
+        if (over_limit) {
+          it.print(0, 8, font, "OVER LIMIT!");
+        } else if (slow_leak) {
+          it.print(0, 8, font, "SLOW LEAK!");
+        } else if (continuous_flow) {
+          it.print(0, 8, font, "CONT. FLOW!");
+        } else {
+          it.print(0, 8, font, "Status OK");
+        }
+        it.print(0, 40, font, valve_open ? "Valve open" : "Valve shut");
+        break;
+    }
+
+    dirty &= ~fields(screen);
+  }
+
+  private:
+  void set(float& field, float v, float precision, uint32_t bit) {
+    // Kept at the value last shown until it changes enough to show
+    if (lroundf(field / precision) != lroundf(v / precision)) {
+      field = v;
+      dirty |= bit;
+    }
+  }
+
+  void set(bool& field, bool v, uint32_t bit) {
+    if (field != v) {
+      bool was_alarm = alarm();
+      field = v;
+      dirty |= bit;
+      if (!was_alarm && alarm()) {
+        show(screen_status, millis());
+      }
+    }
+  }
+
+  Screen next_screen() const {
+    if (alarm()) {
+      return screen == screen_flow ? screen_status : screen_flow;
+    }
+    return Screen((screen + 1) % screen_count);
+  }
+
+  void show(Screen s, uint32_t now_ms) {
+    screen = s;
+    screen_shown_ms = now_ms;
+    // Everything on it is drawn fresh
+    dirty |= fields(s);
+  }
+};
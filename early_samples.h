@@ -0,0 +1,86 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+#include <algorithm>
+#include <math.h>
+
+////////////////////////////////////////////////////////
+// EarlySamples: flow reported before the clock is set
+//
+// Until the time server sets app_clock a sample cannot be
+// given a time, but the water it measured was still used.
+// Samples are kept here against uptime and replayed at
+// their own (back dated) times once the clock is set (see
+// dApp::replay_early_samples()). Only their accounting
+// waits: the limits were checked as they arrived.
+//
+// The buffer is bounded. A sample at the same flow as the
+// channel's last one is merged into it, so steady flow or
+// no flow takes one entry however long it lasts. When the
+// buffer is full a sample is merged into its channel's last
+// entry whatever the flow, so usage is never lost, only
+// detail.
+////////////////////////////////////////////////////////
+
+struct EarlySample {
+  // Uptime at the end of the sample
+  uint32_t end_secs;
+  uint32_t secs;
+  float    upm;
+  int      channel;
+};
+
+struct EarlySamples {
+  // Flows within this fraction of each other are the same flow
+  static constexpr float same_flow = 0.02;
+
+  // Oldest first
+  EarlySample samples[APP_EARLY_SAMPLES];
+  int count = 0;
+  // Samples that could not be kept (a full buffer with none of the channel)
+  int dropped = 0;
+
+  bool empty() const { return count == 0; }
+
+  void clear() {
+    count = 0;
+    dropped = 0;
+  }
+
+  void add(uint32_t end_secs, int channel, float upm, int secs) {
+    bool full = count == APP_EARLY_SAMPLES;
+    // While there is room only the channel's most recent entry is a
+    // candidate, it is one of the last few (one per channel)
+    int look_back = full ? count : std::min(count, APP_MAX_FLOW_CHANNELS);
+
+    for (int i = count - 1; i >= count - look_back; --i) {
+      EarlySample& last = samples[i];
+      if (last.channel != channel) {
+        continue;
+      }
+      if (full || fabs(last.upm - upm) <= same_flow * std::max(last.upm, upm)) {
+        uint32_t total_secs = last.secs + secs;
+        if (total_secs) {
+          last.upm = (last.upm * last.secs + upm * secs) / total_secs;
+        }
+        last.secs = total_secs;
+        last.end_secs = end_secs;
+        return;
+      }
+      break;
+    }
+
+    if (full) {
+      ++dropped;
+      return;
+    }
+
+    EarlySample& sample = samples[count++];
+    sample.end_secs = end_secs;
+    sample.secs = secs;
+    sample.upm = upm;
+    sample.channel = channel;
+  }
+};
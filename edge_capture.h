@@ -0,0 +1,163 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+
+////////////////////////////////////////////////////////
+// EdgeCapture: raw pulse edge times around a sudden
+// flow rate jump
+//
+// A valve slamming shut shows in the pulse stream as
+// a transient the per second PCNT counts smooth away.
+// A GPIO interrupt on the sensor pin, alongside the
+// PCNT unit, writes each rising edge's micros() into a
+// preallocated ring, so the last APP_CAPTURE_EDGES
+// edges are always there. When the sensor sees the rate
+// jump (trigger()) recording goes on for
+// APP_CAPTURE_SECS more and then stops, leaving the
+// edges from APP_CAPTURE_SECS before the jump to
+// APP_CAPTURE_SECS after it for the loop task to
+// publish (encode()) and rearm().
+//
+// Nothing is allocated, and the interrupt is the only
+// per pulse cost; the PCNT counts, and so the
+// accounting, do not depend on it.
+//
+// encode() writes the edges as json, the times as the
+// difference from the previous edge in µs, LEB128
+// varints in base64. Edge to edge times of a steady
+// flow take 2 or 3 bytes each.
+////////////////////////////////////////////////////////
+
+#ifdef APP_EDGE_CAPTURE
+
+struct EdgeCapture {
+  static const uint32_t size = APP_CAPTURE_EDGES;
+  static const uint32_t window_us = APP_CAPTURE_SECS * 1000000UL;
+  // Largest encode() payload: 5 varint bytes per edge in base64,
+  // plus the rest of the json
+  static const size_t payload_size = (size * 5 + 2) / 3 * 4 + 160;
+
+  enum State : uint8_t { recording, triggered, ready };
+
+  uint32_t          edges[size];
+  // Edges recorded since rearm(), the next one goes in head % size
+  volatile uint32_t head = 0;
+  volatile State    state = recording;
+  uint32_t          trigger_us = 0;
+
+  static void ICACHE_RAM_ATTR gpio_intr(EdgeCapture* capture) {
+    if (capture->state != ready) {
+      capture->edges[capture->head % size] = micros();
+      capture->head = capture->head + 1;
+    }
+  }
+
+  // The sensor saw a rate jump. Ignored while a capture is under way
+  // or waiting to be published.
+  void trigger() {
+    if (state == recording) {
+      trigger_us = micros();
+      state = triggered;
+    }
+  }
+
+  // From each sensor update
+  void update() {
+    if (state == triggered && uint32_t(micros() - trigger_us) >= window_us) {
+      state = ready;
+    }
+  }
+
+  bool is_ready() const { return state == ready; }
+
+  void rearm() {
+    head = 0;
+    state = recording;
+  }
+
+  // Writes the capture to buf, which should be payload_size. now is the
+  // epoch, to date the jump. Returns the length.
+  size_t encode(int channel, time_t now, char* buf, size_t buf_size) const {
+    uint32_t end = head;
+    uint32_t first = end > size ? end - size : 0;
+    // Edges from before the window
+    while (first < end && int32_t(trigger_us - edges[first % size]) > int32_t(window_us)) {
+      ++first;
+    }
+
+    uint32_t start_us = first < end ? edges[first % size] : trigger_us;
+    time_t trigger_time = now - time_t(uint32_t(micros() - trigger_us) / 1000000);
+
+    int len = snprintf(buf, buf_size,
+      "{\"channel\":%i,\"time\":%li,\"count\":%u,\"first_us\":%i,\"deltas\":\"",
+      channel, long(trigger_time), end - first, int(int32_t(start_us - trigger_us)));
+    if (len < 0 || size_t(len) >= buf_size) {
+      return 0;
+    }
+
+    Base64 out(buf + len, buf + buf_size - 3);
+    uint32_t last = start_us;
+    for (uint32_t i = first; i < end && !out.full; ++i) {
+      uint32_t edge = edges[i % size];
+      uint32_t delta = edge - last;
+      last = edge;
+      do {
+        uint8_t byte = delta & 0x7f;
+        delta >>= 7;
+        out.add(delta ? byte | 0x80 : byte);
+      } while (delta);
+    }
+    out.flush();
+
+    char* p = out.p;
+    *p++ = '"';
+    *p++ = '}';
+    *p = '\0';
+    return p - buf;
+  }
+
+  private:
+  struct Base64 {
+    char* p;
+    char* limit;
+    uint32_t bits = 0;
+    int count = 0;
+    bool full = false;
+
+    Base64(char* begin, char* end): p(begin), limit(end) {}
+
+    void add(uint8_t byte) {
+      bits = (bits << 8) | byte;
+      if (++count == 3) {
+        put(4);
+      }
+    }
+
+    void flush() {
+      if (count) {
+        int chars = count + 1;
+        bits <<= 8 * (3 - count);
+        count = 3;
+        put(chars);
+      }
+    }
+
+    void put(int chars) {
+      static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      if (p + 4 > limit) {
+        full = true;
+      } else {
+        for (int i = 0; i < 4; ++i) {
+          *p++ = i < chars ? digits[(bits >> (18 - 6 * i)) & 0x3f] : '=';
+        }
+      }
+      bits = 0;
+      count = 0;
+    }
+  };
+};
+
+#endif
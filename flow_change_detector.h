@@ -0,0 +1,107 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+
+////////////////////////////////////////////////////////
+// FlowChangeDetector: flow level change points
+//
+// A two sided CUSUM over the pulses of each sensor
+// sample. The level is the mean since the last change.
+// Every sample adds its distance above (below) the level,
+// less half the smallest step worth detecting, to the up
+// (down) sum, which never goes below 0. A sum reaching
+// threshold steps is a change. Where the sum last left 0
+// is the estimated change point, so the mean of the
+// samples since then is the new level.
+//
+// Noise around a steady level keeps the sums near 0, so
+// unlike a fixed delta between two samples a single
+// noisy sample is not a change, while a small step that
+// persists is. Constant time and memory per sample.
+//
+// Rates here are pulses per sample.
+////////////////////////////////////////////////////////
+
+struct FlowChangeDetector {
+  // The smallest change worth detecting: this fraction of the level,
+  // but at least min_step_pulses and, as pulse counts are noisier the
+  // lower they are, at least noise times their expected deviation 
+  // (the square root of the level)
+  float step = 0.2;
+  float min_step_pulses = 2;
+  float noise = 2;
+  // A change once a sum reaches this many steps
+  float threshold = 4;
+
+  // The level adapts over at most this many samples
+  static const int max_level_samples = 64;
+
+  struct Side {
+    float sum = 0;
+    // Samples since sum last left 0 and their total
+    float total = 0;
+    int samples = 0;
+
+    void add(float s, float x) {
+      if (sum + s <= 0) {
+        reset();
+      } else {
+        sum += s;
+        total += x;
+        ++samples;
+      }
+    }
+
+    void reset() {
+      sum = 0;
+      total = 0;
+      samples = 0;
+    }
+  };
+
+  float level = 0;
+  int level_samples = 0;
+  Side up;
+  Side down;
+
+  // Levels either side of the last change
+  float before = 0;
+  float after = 0;
+
+  // Returns true if x starts a new level
+  bool add(float x) {
+    if (level_samples == 0) {
+      level = x;
+      level_samples = 1;
+      return false;
+    }
+
+    float scale = std::max(std::max(step * level, min_step_pulses), noise * sqrtf(level));
+    float drift = scale / 2;
+
+    up.add(x - level - drift, x);
+    down.add(level - x - drift, x);
+
+    Side* changed = up.sum > threshold * scale ? &up
+      : (down.sum > threshold * scale ? &down : nullptr);
+
+    if (changed) {
+      before = level;
+      after = changed->total / changed->samples;
+      level = after;
+      level_samples = changed->samples;
+      up.reset();
+      down.reset();
+      return true;
+    }
+
+    if (level_samples < max_level_samples) {
+      ++level_samples;
+    }
+    level += (x - level) / level_samples;
+
+    return false;
+  }
+};
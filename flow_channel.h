@@ -0,0 +1,323 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+#include "flow_config.h"
+#include "over_limit_policy.h"
+#include "baseline_monitor.h"
+#include "continuous_flow_detector.h"
+#include "schedule.h"
+#include "usage_accumulators.h"
+#include "helper.h"
+#include "water_flow_sensor.h"
+#include "translation_unit.h"
+// water_usage.h is included by dapp.h before this (it needs the defs there)
+
+////////////////////////////////////////////////////////
+// FlowChannel: one water flow meter
+//
+// A device can meter up to APP_MAX_FLOW_CHANNELS flows,
+// e.g., the house main plus irrigation branches, one per
+// PCNT unit. Each channel has its own sensor, usage lists,
+// limits and sessions. dApp keeps the channels in one
+// fixed array so all of their state is laid out together.
+//
+// Channel 0 is the device's original flow. It keeps the
+// original /sensor/wf/... topics and is the channel the
+// top level properties (water_flow_max, etc.) configure.
+// Channel n > 0 publishes on /sensor/wf<n>/... and is
+// configured with the "channels" property.
+//
+// Named usage and specific allowances belong to the
+// device and apply to channel 0.
+////////////////////////////////////////////////////////
+
+struct FlowChannel {
+  // Empty until the channel's sensor is created
+  WaterflowSensor*        wf = nullptr;
+  std::string             name;
+
+  // The water flow when no water should be flowing. You would think
+  // this would always be 0, but I'm making an allowance in case the
+  // user has a unfixable leak of some kind. 
+  // Declared before the members it is handed to.
+  FlowConfig config;
+
+  FlowChannel(): session_usage(config) {}
+
+  WaterUsageTimed         current_usage;
+  WaterUsagePeriodList    hourly_usage;
+  WaterUsagePeriodList    daily_usage;
+  WaterUsageSessionList   session_usage;
+
+  // The open sums of current_usage, hourly_usage and daily_usage and the
+  // usage toward the limits, added to per sample (see add_usage())
+  UsageAccumulators       active;
+  bool                    usage_started = false;
+
+  // Negative for no upper limit
+  float max_upm = -1.0;
+  // Max allowed water flow + extant specific allowances;
+  float max_upm_plus = 0.0;
+  float max_usage = -1;
+  float max_usage_plus = -1;
+  // Over max_usage or one of the channel's usage budgets
+  bool usage_over = false;
+
+  // The schedule rule in force (-1 for none) and the limits it sets in 
+  // place of max_upm and max_usage. NAN when the rule leaves one alone.
+  int schedule_rule = -1;
+  float scheduled_max_upm = NAN;
+  float scheduled_max_usage = NAN;
+
+  float limit_upm() const { return isnan(scheduled_max_upm) ? max_upm : scheduled_max_upm; }
+  float limit_usage() const { return isnan(scheduled_max_usage) ? max_usage : scheduled_max_usage; }
+
+  // Test period, initial surge and over limit state. The sensor has the
+  // policy that decides (see set_sensor_limits()); this one has the
+  // settings and the state as of the last report.
+  OverLimitPolicy policy;
+
+  // Night time flow statistics and the slow leak alert
+  BaselineMonitor baseline;
+
+  // Flow that has not been down to base for continuous_flow_hours_
+  ContinuousFlowDetector continuous_flow;
+
+  int secs_since_last_publish = 0;
+
+  // MQTT topics
+  std::string topic_over_limit;
+  std::string topic_current_usage;
+  std::string topic_hourly_usage;
+  std::string topic_daily_usage;
+  std::string topic_session_usage;
+  std::string topic_baseline;
+  std::string topic_slow_leak;
+  std::string topic_continuous_flow;
+  std::string topic_flow_change;
+  std::string topic_edges;
+
+  bool in_use() const { return wf != nullptr; }
+
+  // Usage since max_usage was set, checked against max_usage_plus
+  float& usage_since_max_set() { return active[UsageAccumulators::since_max_set]; }
+  // Usage since the schedule rule started, checked against scheduled_max_usage
+  float& usage_since_schedule() { return active[UsageAccumulators::since_schedule]; }
+
+  // The sample path: one pass over the accounting sums (the limit sums
+  // are added to by add_limit_usage())
+  void add_usage(float usage) {
+    if (!usage_started) {
+      // Once, so the units start at the first sample as before
+      start_usage();
+    }
+    active.add(usage);
+  }
+
+  void add_limit_usage(float usage) {
+    active.add_limits(usage);
+  }
+
+  void start_usage() {
+    if (!current_usage.isStarted()) {
+      current_usage.start();
+    }
+    hourly_usage.getCurrentIndex();
+    daily_usage.getCurrentIndex();
+    usage_started = true;
+  }
+
+  // Sets the open units from the sums, before they are read or saved
+  void settle_usage() {
+    if (!usage_started) {
+      // Nothing added yet, and the units start at the first sample
+      return;
+    }
+    current_usage.usage = active[UsageAccumulators::current];
+    hourly_usage.getCurrent().usage = active[UsageAccumulators::hourly];
+    daily_usage.getCurrent().usage = active[UsageAccumulators::daily];
+  }
+
+  // Sets the sums from the open units, after they are restored
+  void load_usage() {
+    active[UsageAccumulators::current] = current_usage.getUsage();
+    active[UsageAccumulators::hourly] = hourly_usage.getUsage();
+    active[UsageAccumulators::daily] = daily_usage.getUsage();
+  }
+
+  // The rollovers, closing the open unit (at endtime, if not now) and
+  // starting the next
+  void next_hour(time_t endtime=0) {
+    settle_usage();
+    hourly_usage.next(endtime);
+    active[UsageAccumulators::hourly] = 0;
+  }
+
+  void next_day(time_t endtime=0) {
+    settle_usage();
+    daily_usage.next(endtime);
+    active[UsageAccumulators::daily] = 0;
+  }
+
+  void next_current() {
+    current_usage.init();
+    active[UsageAccumulators::current] = 0;
+  }
+
+  void makeMqttTopics(const std::string& prefix, int index) {
+    // Channel 0 keeps the single channel topics
+    std::string sensor = prefix + (index == 0 ? "/sensor/wf" : "/sensor/wf" + to_string(index));
+
+    topic_over_limit = sensor + "/over_limit/status";
+    topic_current_usage = sensor + "/usage/current/state";
+    topic_hourly_usage = sensor + "/usage/hourly/state";
+    topic_daily_usage = sensor + "/usage/daily/state";
+    topic_session_usage = sensor + "/usage/session/state";
+    topic_baseline = sensor + "/baseline/state";
+    topic_slow_leak = sensor + "/slow_leak/status";
+    topic_continuous_flow = sensor + "/continuous_flow/status";
+    topic_flow_change = sensor + "/flow_change/state";
+    topic_edges = sensor + "/edges/state";
+  }
+
+  void set_upm_base(float upm, TranslationManager& xlate_mgr) {
+    config.upm_base = upm;
+    // Compared with the pulses of each sensor update, which is every 
+    // second, where the pulses are read (see WaterflowSensor::Settings)
+    if (wf != nullptr) {
+      wf->set_pulses_base(xlate_mgr.current->convert_uom_to_pulses(config.upm_base) / 60);
+    }
+  }
+
+  // Hands the over limit policy's settings and max_upm_plus to the
+  // sensor, which decides where the pulses are read and, if close_valve,
+  // closes the valve (see WaterflowSensor::process_pulses()). With state
+  // the policy's state too, e.g., restored from a snapshot.
+  void set_sensor_limits(TranslationManager& xlate_mgr, bool close_valve, bool state=false) {
+    if (wf == nullptr) {
+      return;
+    }
+    float max_pulses_plus = max_upm_plus < 0 ? -1
+      : xlate_mgr.current->convert_uom_to_pulses(max_upm_plus) / 60;
+    wf->set_over_limit(policy, max_pulses_plus, close_valve, state);
+  }
+
+  // Sets the limits of rule (nullptr for none). Returns true if they changed.
+  bool set_schedule_rule(int index, const ScheduleRule* rule) {
+    if (index == schedule_rule) {
+      return false;
+    }
+    schedule_rule = index;
+    scheduled_max_upm = rule ? rule->max_upm : NAN;
+    scheduled_max_usage = rule ? rule->max_usage : NAN;
+    usage_since_schedule() = 0;
+    return true;
+  }
+
+  void calc_max_plus_values(float upm_allowance, float usage_allowance) {
+    float upm = limit_upm();
+    float usage = limit_usage();
+
+    max_upm_plus = upm < 0 ? upm : upm + upm_allowance;
+
+    if (usage > 0) {
+      max_usage_plus = usage + usage_allowance;
+    } else {
+      max_usage_plus = usage;
+    }
+  }
+
+  // The usage max_usage_plus is checked against
+  float& usage_toward_max() {
+    return isnan(scheduled_max_usage) ? usage_since_max_set() : usage_since_schedule();
+  }
+
+  void convert_uom(std::function<float(float &)>f) {
+    settle_usage();
+    current_usage.convert_uom(f);
+    hourly_usage.convert_uom(f);
+    daily_usage.convert_uom(f);
+    session_usage.convert_uom(f);
+
+    max_upm = f(max_upm);
+    config.upm_base = f(config.upm_base);
+    if (max_usage != -1) {
+      max_usage = f(max_usage);
+    }
+    if (!isnan(scheduled_max_upm) && scheduled_max_upm >= 0) {
+      scheduled_max_upm = f(scheduled_max_upm);
+    }
+    if (!isnan(scheduled_max_usage) && scheduled_max_usage >= 0) {
+      scheduled_max_usage = f(scheduled_max_usage);
+    }
+    active.convert_uom(f);
+
+    baseline.convert_uom(f);
+  }
+
+  // The per channel settings. Names match the top level properties.
+  JsonObject& toJson(JsonBuffer& jb) const {
+    JsonObject& jo = jb.createObject();
+
+    jo["name"] = name;
+    jo["water_flow_max"] = max_upm;
+    jo["water_flow_base"] = config.upm_base;
+    jo["test_period_secs"] = policy.test_period_secs;
+    jo["initial_surge_secs"] = policy.allow_initial_surge_seconds;
+    jo["closed_sessions_max"] = session_usage.get_max_closed();
+    jo["min_session_secs"] = session_usage.get_min_session_secs();
+    jo["end_session_secs"] = session_usage.get_end_session_secs();
+    jo["session_zone_step"] = session_usage.get_zone_step();
+
+    JsonObject& joReportPeriodSecs = jb.createObject();
+    joReportPeriodSecs["wf_off"] = wf->get_report_period_wf_off_mode_secs();
+    joReportPeriodSecs["wf_on"] = wf->get_report_period_wf_on_mode_secs();
+    jo["report_period_secs"] = joReportPeriodSecs;
+
+    return jo;
+  }
+
+  // Only the settings present in jo are changed
+  void fromJson(const JsonObject& jo, TranslationManager& xlate_mgr) {
+    if (jo.containsKey("name")) {
+      name = getString(jo, "name", "");
+    }
+    if (jo.containsKey("water_flow_max")) {
+      max_upm = getFloat(jo, "water_flow_max", max_upm);
+    }
+    if (jo.containsKey("water_flow_base") && getFloat(jo, "water_flow_base", 0) >= 0) {
+      set_upm_base(getFloat(jo, "water_flow_base", 0), xlate_mgr);
+    }
+    if (getInt(jo, "test_period_secs", -1) >= 0) {
+      policy.test_period_secs = getInt(jo, "test_period_secs", 0);
+    }
+    if (getInt(jo, "initial_surge_secs", -1) >= 0) {
+      policy.allow_initial_surge_seconds = getInt(jo, "initial_surge_secs", 0);
+    }
+    if (jo.containsKey("closed_sessions_max")) {
+      session_usage.set_max_closed(getInt(jo, "closed_sessions_max", 0));
+    }
+    if (getInt(jo, "min_session_secs", -1) >= 0) {
+      session_usage.set_min_session_secs(getInt(jo, "min_session_secs", 0));
+    }
+    if (getInt(jo, "end_session_secs", -1) >= 0) {
+      session_usage.set_end_session_secs(getInt(jo, "end_session_secs", 0));
+    }
+    if (getFloat(jo, "session_zone_step", -1) >= 0) {
+      session_usage.set_zone_step(getFloat(jo, "session_zone_step", 0));
+    }
+    if (jo.containsKey("report_period_secs")) {
+      const JsonObject& joReportPeriodSecs = getObject(jo, "report_period_secs");
+      int wf_off(getFloat(joReportPeriodSecs, "wf_off", -1));
+      int wf_on(getFloat(joReportPeriodSecs, "wf_on", -1));
+      if (wf_off >= 0) {
+        wf->set_report_period_wf_off_mode_secs(wf_off);
+      }
+      if (wf_on >= 0) {
+        wf->set_report_period_wf_on_mode_secs(wf_on);
+      }
+    }
+  }
+};
@@ -0,0 +1,16 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+
+// The settings of a flow channel that the usage lists read on every 
+// sample. Each FlowChannel owns one and hands it by reference to its 
+// WaterUsageSessionList, so nothing reaches back into dapp for them.
+// The sensor's pulses_base is one of its own Settings instead, as it is
+// read where the pulses are, which may be the acquisition task.
+struct FlowConfig {
+  // The water flow when presumably there is no water flow (see 
+  // "water_flow_base"). If the plumbing system is working correctly 
+  // this should be zero.
+  float upm_base = 0.0;
+};
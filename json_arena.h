@@ -0,0 +1,169 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+
+using namespace esphome;
+
+// Upper bounds for building and serializing any one mqtt json message.
+// The largest messages are the get_closed() pages, which are sized to
+// fit (see APP_CLOSED_PAGE_UNITS). Larger messages are not sent; an 
+// {"error": ...} message is published in their place and the overflow
+// is counted in the metrics.
+#define APP_JSON_ARENA_SIZE     20480
+#define APP_JSON_PAYLOAD_SIZE   16384
+
+////////////////////////////////////////////////////////
+// JsonArena: a fixed size json buffer
+//
+// A bump allocator over a static block. Nothing is freed
+// until clear(), which JsonPublisher calls after every
+// message, so building a message never touches the heap
+// and never grows memory no matter how often it is done.
+////////////////////////////////////////////////////////
+
+class JsonArena: public ArduinoJson::Internals::JsonBufferBase<JsonArena> {
+  alignas(8) uint8_t buffer_[APP_JSON_ARENA_SIZE];
+  size_t size_ = 0;
+  bool overflowed_ = false;
+
+  public:
+  void* alloc(size_t bytes) override {
+    bytes = round_size_up(bytes);
+    if (size_ + bytes > sizeof(buffer_)) {
+      overflowed_ = true;
+      return nullptr;
+    }
+    void* p = &buffer_[size_];
+    size_ += bytes;
+    return p;
+  }
+
+  void clear() {
+    size_ = 0;
+    overflowed_ = false;
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return sizeof(buffer_); }
+  bool overflowed() const { return overflowed_; }
+};
+
+////////////////////////////////////////////////////////
+// JsonPublisher: builds a message in the arena, prints
+// it into a fixed payload buffer and publishes it. The
+// arena is reset after each publish.
+////////////////////////////////////////////////////////
+
+class JsonPublisher {
+  JsonArena arena_;
+  char payload_[APP_JSON_PAYLOAD_SIZE];
+
+  size_t arena_high_water_ = 0;
+  size_t payload_high_water_ = 0;
+  uint32_t overflows_ = 0;
+
+  // 32 bit FNV-1a of a payload
+  static uint32_t hash(const char* s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+      h = (h ^ uint8_t(s[i])) * 16777619u;
+    }
+    return h;
+  }
+
+  public:
+  typedef std::function<void(JsonBuffer&, JsonObject&)> json_build_t;
+
+  // With last_hash, the message is not sent if it is the same as the
+  // last one sent with it, and last_hash is updated when it is sent.
+  bool publish(const std::string& topic, const json_build_t& f, uint8_t qos=0, bool retain=false,
+    uint32_t* last_hash=nullptr) {
+
+    arena_.clear();
+    JsonObject& root = arena_.createObject();
+    f(arena_, root);
+
+    if (arena_.size() > arena_high_water_) {
+      arena_high_water_ = arena_.size();
+    }
+
+    size_t len = arena_.overflowed() ? 0 : root.measureLength();
+    bool ok = !arena_.overflowed() && len < sizeof(payload_);
+
+    if (ok) {
+      root.printTo(payload_, sizeof(payload_));
+      if (len > payload_high_water_) {
+        payload_high_water_ = len;
+      }
+    } else {
+      ++overflows_;
+      ESP_LOGE("main", "json message for %s too large (arena %u, payload %u)",
+        topic.c_str(), unsigned(arena_.size()), unsigned(len));
+      len = snprintf(payload_, sizeof(payload_),
+        "{\"error\":\"json_overflow\",\"arena\":%u,\"payload\":%u}", unsigned(arena_.size()), unsigned(len));
+    }
+
+    if (last_hash) {
+      uint32_t h = hash(payload_, len);
+      if (ok && h == *last_hash) {
+        arena_.clear();
+        return true;
+      }
+      *last_hash = ok ? h : 0;
+    }
+
+    mqtt_client->publish(topic, payload_, len, qos, retain);
+
+    arena_.clear();
+
+    return ok;
+  }
+
+  // Builds a json object as publish() does, but prints it into buf.
+  // Returns false if it does not fit.
+  bool print(const json_build_t& f, char* buf, size_t size) {
+    arena_.clear();
+    JsonObject& root = arena_.createObject();
+    f(arena_, root);
+
+    bool ok = !arena_.overflowed() && root.measureLength() < size;
+    if (ok) {
+      root.printTo(buf, size);
+    }
+
+    arena_.clear();
+    return ok;
+  }
+
+  // The hash publish() would keep for the message f builds, 0 if it
+  // does not fit
+  uint32_t hash(const json_build_t& f) {
+    return print(f, payload_, sizeof(payload_)) ? hash(payload_, strlen(payload_)) : 0;
+  }
+
+  // Parses json (in place, it is modified) in the arena and hands the 
+  // object to f. Returns false if it does not parse.
+  bool parse(char* json, const std::function<void(JsonObject&)>& f) {
+    arena_.clear();
+    JsonObject& root = arena_.parseObject(json);
+
+    bool ok = root.success();
+    if (ok) {
+      f(root);
+    }
+
+    arena_.clear();
+    return ok;
+  }
+
+  JsonObject& toJson(JsonBuffer& jb) const {
+    JsonObject& jo = jb.createObject();
+    jo["arena_size"] = arena_.capacity();
+    jo["arena_high_water"] = arena_high_water_;
+    jo["payload_size"] = sizeof(payload_);
+    jo["payload_high_water"] = payload_high_water_;
+    jo["overflows"] = overflows_;
+    return jo;
+  }
+};
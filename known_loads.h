@@ -0,0 +1,43 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "water_usage.h"
+#include "specific_allowance.h"
+
+////////////////////////////////////////////////////////
+// KnownLoads: channel 0's flow split into its known
+// loads and the rest
+//
+// The known loads are the allowances with a upm. Each
+// one's share of the usage goes to the active named
+// usage of the same name (e.g., the one "cns" creates),
+// the other named usages get the rest. Signatures are
+// matched against the rest only, so a toilet flush is
+// seen during irrigation (see dApp::disaggregate()).
+////////////////////////////////////////////////////////
+
+struct KnownLoads {
+  // Attributes upm for secs to the named usages. Returns the upm of
+  // the rest.
+  static float split(float upm, int secs, const SpecificAllowances& allowances,
+    WaterUsageNamedList& named) {
+    float known_upm = 0;
+    for (const SpecificAllowance& allowance : allowances) {
+      if (allowance.upm > 0) {
+        known_upm += allowance.upm;
+      }
+    }
+
+    // The known loads cannot be more than the flow
+    float scale = known_upm > upm ? upm / known_upm : 1;
+    for (const SpecificAllowance& allowance : allowances) {
+      if (allowance.upm > 0) {
+        named.addLoadUsage(allowance.name, allowance.upm * scale * secs / 60.0);
+      }
+    }
+
+    float rest_upm = upm - known_upm * scale;
+    named.addUsage(rest_upm * secs / 60.0);
+    return rest_upm;
+  }
+};
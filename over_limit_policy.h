@@ -0,0 +1,90 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+////////////////////////////////////////////////////////
+// OverLimitPolicy: when is a flow over limit?
+//
+// The decision for one channel, taken out of
+// dApp::process_wf_on_value(). It uses no mqtt, time,
+// sensor or esphome state: step() takes one reported flow
+// and says what to do. So the same code that runs on the
+// device can be replayed against recorded flow traces to
+// tune test_period_secs and initial_surge_secs.
+//
+// On the device it steps on every sensor update, in
+// pulses, where the pulses are read (see
+// WaterflowSensor::process_pulses()), and dApp gets its
+// state with each report.
+////////////////////////////////////////////////////////
+
+struct OverLimitPolicy {
+
+  enum class Verdict {
+    // Nothing to report
+    ok,
+    // Over limit for at least test_period_secs (returned for every 
+    // report while it lasts)
+    over_limit,
+    // Was over limit, is not now (returned once)
+    back_under_limit
+  };
+
+  // Test period seconds. We have to overlimit during a test period. A single
+  // spike is not sufficient to alarm.
+  // Should be a multiple of wf_report_interval_secs_. If not it will end up being rounded up
+  // to a multiple of wf_report_interval_secs_ anyway.
+  static const int test_period_secs_default = 15;
+  int test_period_secs = test_period_secs_default;
+
+  // Allow an initial surge when flow starts.
+  // The pipes in an irrigation system are often empty when a
+  // valve is first turned on. This allow time for the water
+  // flow surge until the pipes are filled.
+  int allow_initial_surge_seconds = 30;
+  int grace_for_surge = allow_initial_surge_seconds;
+
+  int secs_over_limit = 0;
+  bool over_limit = false;
+
+  // upm was the flow over the last secs. max_upm_plus < 0 means no limit.
+  Verdict step(float upm, float upm_base, float max_upm_plus, int secs) {
+
+    // We have flow and we have a surge grace period
+    if (upm > upm_base && grace_for_surge > 0) {
+      // Yes, we don't care of we are over limit or not.
+      // we are in a surge grace period
+      // Decrement grace surge period
+      grace_for_surge -= secs;
+      return Verdict::ok;
+    }
+    
+    if (max_upm_plus >= 0.0 && upm > max_upm_plus) {
+
+      // We have flow and are over limit
+
+      secs_over_limit += secs;
+
+      if (secs_over_limit >= test_period_secs) {
+        over_limit = true;
+        return Verdict::over_limit;
+      }
+      return Verdict::ok;
+    }
+
+    // We are not over limit
+  
+    secs_over_limit = 0;
+
+    if (upm <= upm_base) {
+      grace_for_surge = allow_initial_surge_seconds;
+    }
+
+    // were we over limit before?
+    if (over_limit) {
+      over_limit = false;
+      return Verdict::back_under_limit;
+    }
+
+    return Verdict::ok;
+  }
+};
@@ -0,0 +1,73 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+
+////////////////////////////////////////////////////////
+// Property descriptor tables
+//
+// A property is described once: its name, json type,
+// getter, setter, optional validator, optional side
+// effect hook and where it is published (PropOut).
+// Processing a properties message and
+// serializing properties are then both driven by the
+// table instead of a chain of strcmp/containsKey tests.
+//
+// Names are looked up by switching on prop_hash(name).
+// Every name's hash is a case label, so two names that
+// hash alike fail to compile: the switch is a perfect
+// hash checked at compile time. The name is compared
+// once after the switch to reject unknown names that
+// happen to share a hash with a known one.
+////////////////////////////////////////////////////////
+
+// 32 bit FNV-1a. Written as a single return so it is a C++11 constexpr.
+constexpr uint32_t prop_hash(const char* s, uint32_t h = 2166136261u) {
+  return *s ? prop_hash(s + 1, (h ^ uint8_t(*s)) * 16777619u) : h;
+}
+
+enum class PropType : uint8_t {
+  String,
+  Int,
+  Float,
+  Bool,
+  Object,
+  Array
+};
+
+inline bool prop_type_matches(PropType type, const JsonVariant& v) {
+  switch (type) {
+    case PropType::String:  return v.is<char*>();
+    case PropType::Int:     return v.is<int>();
+    case PropType::Float:   return v.is<float>();
+    case PropType::Bool:    return v.is<bool>();
+    case PropType::Object:  return v.is<JsonObject>();
+    case PropType::Array:   return v.is<JsonArray>();
+  }
+  return false;
+}
+
+// Where a property is published
+enum class PropOut : uint8_t {
+  // In /stat
+  stat,
+  // Large enough to be worth publishing on its own (see dApp::stat_diff_)
+  heavy,
+  // Only set, never in /stat or the properties snapshot
+  none
+};
+
+template<class T>
+struct PropertyDescriptor {
+  const char* name;
+  PropType    type;
+  // Adds the property to jo
+  void (T::*get)(JsonBuffer& jb, JsonObject& jo);
+  // Applies a value that has passed the type check and validator
+  void (T::*set)(const JsonVariant& v);
+  // Optional. Returns false to reject the value.
+  bool (T::*validate)(const JsonVariant& v);
+  // Optional. Called after set.
+  void (T::*hook)();
+  PropOut     out;
+};
@@ -133,6 +133,26 @@ pulse_counter_t PulseCounterStorage::read_raw_value() {
   this->last_value = counter;
   return ret;
 }
+void PulseCounterStorage::read_raw_values(PulseCounterStorage *const *storages, pulse_counter_t *values, int n) {
+  static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  portENTER_CRITICAL(&mux);
+  for (int i = 0; i < n; i++)
+    pcnt_get_counter_value(storages[i]->pcnt_unit, &values[i]);
+  portEXIT_CRITICAL(&mux);
+
+  for (int i = 0; i < n; i++) {
+    pulse_counter_t counter = values[i];
+    values[i] = counter - storages[i]->last_value;
+    storages[i]->last_value = counter;
+  }
+}
+#endif
+
+#ifdef ARDUINO_ARCH_ESP8266
+void PulseCounterStorage::read_raw_values(PulseCounterStorage *const *storages, pulse_counter_t *values, int n) {
+  for (int i = 0; i < n; i++)
+    values[i] = storages[i]->read_raw_value();
+}
 #endif
 
 void PulseCounterSensor::setup() {
@@ -27,6 +27,10 @@ using pulse_counter_t = int32_t;
 struct PulseCounterStorage {
   bool pulse_counter_setup(GPIOPin *pin);
   pulse_counter_t read_raw_value();
+  // read_raw_value() for n storages at once. On the ESP32 the PCNT units
+  // are read back to back in a critical section so they are all sampled
+  // at (nearly) the same instant.
+  static void read_raw_values(PulseCounterStorage *const *storages, pulse_counter_t *values, int n);
 
   static void gpio_intr(PulseCounterStorage *arg);
 
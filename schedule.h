@@ -0,0 +1,171 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+#include "helper.h"
+#include <math.h>
+
+#define APP_MAX_SCHEDULE_RULES 8
+
+////////////////////////////////////////////////////////
+// Schedule: limits by time of day and weekday
+//
+// A rule replaces a channel's water_flow_max and/or
+// water_usage_max on the weekdays in its mask from its
+// start minute to its end minute (local time, end
+// exclusive, wrapping past midnight if end <= start).
+// The first matching rule wins. Because the rules are on
+// the device, limits keep changing with the household's
+// mode even when the controller or broker is down.
+//
+// Rules are evaluated only at transitions. The schedule
+// tells dApp how long until the next start or end of any
+// rule, and dApp compares one deadline per sample.
+////////////////////////////////////////////////////////
+
+struct ScheduleRule {
+  static const int minutes_per_day = 24 * 60;
+
+  // Bit 0 is Sunday ... bit 6 is Saturday
+  uint8_t  weekdays = 0;
+  uint8_t  channel = 0;
+  uint16_t start_minute = 0;
+  uint16_t end_minute = 0;
+  // NAN leaves the channel's own value in place
+  float    max_upm = NAN;
+  float    max_usage = NAN;
+
+  int duration() const {
+    int minutes = (int(end_minute) - int(start_minute) + minutes_per_day) % minutes_per_day;
+    return minutes == 0 ? minutes_per_day : minutes;
+  }
+
+  JsonObject& toJson(JsonBuffer& jb) const {
+    JsonObject& jo = jb.createObject();
+    jo["days"] = weekdays;
+    jo["start"] = start_minute;
+    jo["end"] = end_minute;
+    if (channel) {
+      jo["channel"] = channel;
+    }
+    if (!isnan(max_upm)) {
+      jo["max_upm"] = max_upm;
+    }
+    if (!isnan(max_usage)) {
+      jo["max_usage"] = max_usage;
+    }
+    return jo;
+  }
+
+  bool operator==(const ScheduleRule& rule) const {
+    return weekdays == rule.weekdays && channel == rule.channel 
+      && start_minute == rule.start_minute && end_minute == rule.end_minute
+      && same_limit(max_upm, rule.max_upm) && same_limit(max_usage, rule.max_usage);
+  }
+
+  // NAN (not set) is the same as NAN
+  static bool same_limit(float a, float b) {
+    return a == b || (isnan(a) && isnan(b));
+  }
+
+  // Returns false if jo does not describe a rule
+  bool fromJson(const JsonObject& jo) {
+    int days = getInt(jo, "days", 0x7f);
+    int start = getInt(jo, "start", -1);
+    int end = getInt(jo, "end", -1);
+    int ch = getInt(jo, "channel", 0);
+
+    if (days <= 0 || days > 0x7f || start < 0 || start >= minutes_per_day ||
+        end < 0 || end >= minutes_per_day || ch < 0 || ch >= APP_MAX_FLOW_CHANNELS) {
+      return false;
+    }
+
+    weekdays = days;
+    start_minute = start;
+    end_minute = end;
+    channel = ch;
+    max_upm = jo.containsKey("max_upm") ? getFloat(jo, "max_upm", -1) : NAN;
+    max_usage = jo.containsKey("max_usage") ? getFloat(jo, "max_usage", -1) : NAN;
+
+    return true;
+  }
+};
+
+struct Schedule {
+  static const int minutes_per_week = 7 * ScheduleRule::minutes_per_day;
+
+  ScheduleRule rules[APP_MAX_SCHEDULE_RULES];
+  int count = 0;
+
+  bool operator==(const Schedule& schedule) const {
+    if (count != schedule.count) {
+      return false;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (!(rules[i] == schedule.rules[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // day_of_week is 1 (Sunday) to 7 as in ESPTime
+  static int minute_of_week(int day_of_week, int hour, int minute) {
+    return (day_of_week - 1) * ScheduleRule::minutes_per_day + hour * 60 + minute;
+  }
+
+  // Index of the rule in force for channel at minute of week now, or -1
+  int active_rule(int channel, int now) const {
+    for (int i = 0; i < count; ++i) {
+      const ScheduleRule& rule = rules[i];
+      if (rule.channel != channel) {
+        continue;
+      }
+      for (int day = 0; day < 7; ++day) {
+        if (!(rule.weekdays & (1 << day))) {
+          continue;
+        }
+        int start = day * ScheduleRule::minutes_per_day + rule.start_minute;
+        int since_start = (now - start + minutes_per_week) % minutes_per_week;
+        if (since_start < rule.duration()) {
+          return i;
+        }
+      }
+    }
+    return -1;
+  }
+
+  // Minutes from now to the next start or end of any rule, at most limit
+  int minutes_to_next_transition(int now, int limit) const {
+    int next = limit;
+    for (int i = 0; i < count; ++i) {
+      const ScheduleRule& rule = rules[i];
+      for (int day = 0; day < 7; ++day) {
+        if (!(rule.weekdays & (1 << day))) {
+          continue;
+        }
+        int start = day * ScheduleRule::minutes_per_day + rule.start_minute;
+        int transitions[2] = { start, start + rule.duration() };
+        for (int transition : transitions) {
+          int minutes = (transition - now + minutes_per_week) % minutes_per_week;
+          if (minutes > 0 && minutes < next) {
+            next = minutes;
+          }
+        }
+      }
+    }
+    return next;
+  }
+
+  void convert_uom(std::function<float(float &)>f) {
+    for (int i = 0; i < count; ++i) {
+      if (!isnan(rules[i].max_upm) && rules[i].max_upm >= 0) {
+        rules[i].max_upm = f(rules[i].max_upm);
+      }
+      if (!isnan(rules[i].max_usage) && rules[i].max_usage >= 0) {
+        rules[i].max_usage = f(rules[i].max_usage);
+      }
+    }
+  }
+};
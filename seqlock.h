@@ -0,0 +1,87 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <atomic>
+#include <string.h>
+#include <type_traits>
+#include <stdint.h>
+#ifndef ARDUINO
+#include <thread>
+#endif
+
+////////////////////////////////////////////////////////
+// Seqlock: one writer publishes a T that any number
+// of readers copy without blocking the writer
+//
+// The sequence is odd while a write is in progress. A
+// reader copies the data between two loads of the
+// sequence and keeps the copy only if both loads are
+// the same even number, otherwise it tries again. The
+// writer never waits, which keeps the sample path's
+// cost to one copy of T.
+//
+// A reader preempted by the writer on its own core just
+// retries. A reader that preempts the writer would spin,
+// so after a few tries it gives up its time slice and
+// lets the writer finish.
+//
+// T is copied with memcpy, so must be trivially
+// copyable.
+////////////////////////////////////////////////////////
+
+template<class T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock data is copied with memcpy");
+
+  static const int spins_before_wait = 8;
+
+  std::atomic<uint32_t> seq_{0};
+  T data_;
+
+  static void wait() {
+#ifdef ARDUINO
+    delay(1);
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  public:
+
+  Seqlock() {
+    memset(&data_, 0, sizeof(data_));
+  }
+
+  // The one writer
+  void write(const T& value) {
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&data_, &value, sizeof(T));
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Returns false if a write was in progress
+  bool try_read(T& value) const {
+    uint32_t before = seq_.load(std::memory_order_acquire);
+    if (before & 1) {
+      return false;
+    }
+    memcpy(&value, &data_, sizeof(T));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq_.load(std::memory_order_relaxed) == before;
+  }
+
+  void read(T& value) const {
+    for (int tries = 1; !try_read(value); ++tries) {
+      if (tries % spins_before_wait == 0) {
+        wait();
+      }
+    }
+  }
+
+  // Writes so far, for readers to tell if anything changed
+  uint32_t version() const {
+    return seq_.load(std::memory_order_acquire) / 2;
+  }
+};
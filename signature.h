@@ -2,6 +2,7 @@
 
 #include "esphome.h"
 #include "helper.h"
+#include "app_defs.h"
 #include <limits>
 
 using namespace json;
@@ -51,13 +52,15 @@ class Signature {
         float duration_min_secs_;
         float duration_max_secs_;
 
-        int secs_;
+        int secs_ = 0;
         bool blocked_ = false;
 
         unsigned int    flags_ = 0;
 
         public:
 
+        APP_TRACKED_NEW(AllocSubsystem::signatures)
+
         enum {
             next_flag_value =   1
         };
@@ -88,7 +91,7 @@ class Signature {
 
             if (!blocked_ && upm >= upm_min_ && upm < upm_max_) {
                 secs_ += secs;
-                if (secs > duration_max_secs_) {
+                if (secs_ > duration_max_secs_) {
                     reset();
                     blocked_ = true;
                 } 
@@ -106,6 +109,10 @@ class Signature {
         void reset() {
             secs_ = 0;
         }
+
+        bool is_running() const {
+            return secs_ > 0;
+        }
     
         void convert_uom(/*std::function<float(float &)>f*/) {
             //usage = f(usage);
@@ -124,8 +131,8 @@ class Signature {
 
         // It deserves a json object but we use a json array because it 
         // serializes much more compactly.
-        JsonArray& toJson() const {
-            JsonArray& ja = global_json_buffer.createArray();
+        JsonArray& toJson(JsonBuffer& jb) const {
+            JsonArray& ja = jb.createArray();
             ja.add(upm_min_);
             ja.add(upm_allowance_);
             ja.add(duration_min_secs_);
@@ -149,10 +156,16 @@ class Signature {
     int         segment_count_ = 0;
     int         segment_index = 0;
 
+    // Usage and seconds of the run in progress
+    float       run_usage_ = 0;
+    int         run_secs_ = 0;
+
     unsigned int    flags_ = 0;
 
     public:
 
+    APP_TRACKED_NEW(AllocSubsystem::signatures)
+
     enum {
         built_in =          1,
         next_flag_value =   built_in << 1
@@ -169,6 +182,10 @@ class Signature {
 
     ReportLevel report_level = ReportLevel::report;
 
+    // Usage and seconds of the last match
+    float       matched_usage = 0;
+    int         matched_secs = 0;
+
     public:
     Signature(int segment_count, const char* _name, TranslationManager& xlate_mgr,
         int flags=0):
@@ -219,15 +236,34 @@ class Signature {
     bool is_match(float lpm, float secs) {
         bool ret = false;
 
-        if (segments_[segment_index].is_match(lpm, secs)) {
+        Segment& segment = segments_[segment_index];
+        if (segment.is_match(lpm, secs)) {
             if (++segment_index >= segment_count_) {
                 ret = true;
                 segment_index = 0;
+                matched_usage = run_usage_;
+                matched_secs = run_secs_;
             }
+        } else if (segment_index > 0 && !segment.is_running()) {
+            // A later segment did not follow, start over
+            segment_index = 0;
         }
+
+        if (segment_index > 0 || segments_[0].is_running()) {
+            run_usage_ += lpm * secs / 60;
+            run_secs_ += secs;
+        } else {
+            run_usage_ = 0;
+            run_secs_ = 0;
+        }
+
         return ret;
     }
 
+    const std::string& get_name() const {
+        return name;
+    }
+
     // flags test and set
     bool is(unsigned int flag) const {
         return flags_ & flag;
@@ -239,16 +275,17 @@ class Signature {
         flags_ &= ~flag;
     }
 
-    JsonObject& toJson() const {
-        JsonObject& jo = global_json_buffer.createObject();
+    JsonObject& toJson(JsonBuffer& jb) const {
+        JsonObject& jo = jb.createObject();
         jo["name"] = name;
         jo["uom"] = uom;
         jo["ver"] = ver;
-        JsonArray& ja = global_json_buffer.createArray();
+        JsonArray& ja = jb.createArray();
         int i = 0;
         for (Segment* segment = segments_; i < segment_count_; ++i, ++segment) {
-            ja.add(segment->toJson());
+            ja.add(segment->toJson(jb));
         }
+        jo["segments"] = ja;
 
         return jo;
     }
@@ -285,7 +322,7 @@ class SignatureOverLimit: public Signature {
 };
 
 
-class SignatureManager: public std::vector<Signature*> {
+class SignatureManager: public tracked_vector<Signature*, AllocSubsystem::signatures> {
     TranslationManager& xlate_mgr_;
     public:
     SignatureManager(TranslationManager& xlate_mgr):
@@ -301,17 +338,15 @@ class SignatureManager: public std::vector<Signature*> {
         }; 
     }
 
-    std::vector<std::reference_wrapper<Signature>> is_match(float upm, float secs) {
-
-        std::vector<std::reference_wrapper<Signature>> ret;
-
+    // Calls on_match(signature) for each signature that matches. Called
+    // for every report, so nothing is allocated here.
+    template<class F>
+    void is_match(float upm, float secs, F on_match) {
         for (Signature* signature: *this ) {
             if (signature->is_match(upm, secs)) {
-                ret.push_back(*signature);
+                on_match(*signature);
             }
         }; 
-
-        return ret;
     }
 
     void convert_uom(const char* from, float old_calibrate_factor=0) {
@@ -321,21 +356,34 @@ class SignatureManager: public std::vector<Signature*> {
         }
     }
 
-    JsonArray& toJson() const {
-        JsonArray& ja = global_json_buffer.createArray();
+    JsonArray& toJson(JsonBuffer& jb) const {
+        JsonArray& ja = jb.createArray();
         for (Signature* signature: *this ) {
-            ja.add(signature->toJson());
+            ja.add(signature->toJson(jb));
         };
         return ja;
     }
 
+    // Replaces all but the built-in signatures. The same list can now
+    // arrive more than once (/stat and /stat/signatures), so appending
+    // would duplicate it.
     bool fromJson(const JsonArray& ja) {
+        auto it = begin();
+        while (it != end()) {
+            if ((*it)->is(Signature::built_in)) {
+                ++it;
+            } else {
+                delete *it;
+                it = erase(it);
+            }
+        }
+
         for (const JsonObject& jo : ja) {
             push_back(new Signature(jo, xlate_mgr_));
         }
 
         return true;
-}
+    }
 
 };
 
@@ -0,0 +1,145 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "helper.h"
+#include "app_defs.h"
+#include "app_clock.h"
+
+////////////////////////////////////////////////////////
+// SpecificAllowance: a temporary flow and usage
+// allowance sent by the controller, e.g., while a washer
+// runs or an irrigation valve is open, on top of the
+// channel 0 limits until it is deleted or expires (see
+// dApp::add_allowance()). With an upm it is also a known
+// load (see known_loads.h).
+////////////////////////////////////////////////////////
+
+struct SpecificAllowance {
+    std::string name;
+    float       upm = 0;
+    float       usage = 0;
+    time_t      expire_time = 0; 
+    bool        create_named_session = false;
+
+    SpecificAllowance(
+      const std::string&  _name,
+      float               _upm,
+      float               _usage,
+      time_t              _expire_time,
+      bool                _create_named_session):
+        name(_name),
+        upm(_upm),
+        usage(_usage),
+        expire_time(_expire_time),
+        create_named_session(_create_named_session) {
+        }
+
+    SpecificAllowance(const JsonObject& jo):
+      name(getString(jo, "name", "")),
+      upm(getFloat(jo, "upm", 0)),
+      usage(getFloat(jo, "usage", 0)),
+      expire_time(getInt(jo, "expire_time", 0)),
+      create_named_session(getBool(jo, "cns", false))
+    { }
+
+    // An expire_time of 0 never expires
+    bool is_expired(time_t now) const {
+        return expire_time != 0 && expire_time <= now;
+    }
+
+    void convert_uom(std::function<float(float &)>f) {
+        upm = f(upm);
+        usage = f(usage);
+    }
+
+    JsonObject& toJson(JsonBuffer& jb) const {
+        JsonObject& jo = jb.createObject();
+
+        jo["name"] = name;
+        jo["upm"] = upm;
+        jo["usage"] = usage;
+        jo["expire_time"] = expire_time;
+        jo["cns"] = create_named_session;
+
+        return jo;
+    }
+
+
+};
+
+struct SpecificAllowances: public tracked_vector<SpecificAllowance, AllocSubsystem::allowances> {
+
+  SpecificAllowances() {}
+
+  SpecificAllowances(const JsonArray& ja) {
+    for (int i = 0; i < ja.size(); ++i) {
+      if (ja[i].is<JsonObject>()) {
+        push_back(SpecificAllowance((const JsonObject&)ja[i]));
+      }
+    }
+  }
+
+  void convert_uom(std::function<float(float &)>f) {
+      for (auto it = begin(); it != end(); ++it) {
+          it->convert_uom(f);
+      }
+  }
+
+  void add_item(const std::string& name, float upm, float usage, 
+    time_t expire_time, bool create_named_session) {
+    this->delete_item(name);
+    push_back(SpecificAllowance(name, upm, usage, expire_time, create_named_session));
+  }
+
+  void delete_item(const std::string& name) {
+    auto now = app_clock.now();
+    auto it = begin();
+    while ( it != end()) {
+      if (it->name == name || it->is_expired(now)) {
+        // delete
+        it = erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  SpecificAllowance* get(const std::string& name) {
+    for (auto it = begin(); it != end(); ++it) {
+      if (it->name == name) {
+        return &*it;
+      }
+    }
+    return nullptr;
+  }
+
+  // Note that we delete allowances without notifying caller
+  // This should be OK because these are allowance that have not been
+  // properly explicitly deleted. Auto created named sessions will be
+  // timed deleted elsewhere.
+  void get_totals(float& upm_allowance, float& usage_allowance) {
+    auto now = app_clock.now();
+    auto it = begin();
+    while ( it != end()) {
+      if (it->is_expired(now)) {
+        // delete
+        it = erase(it);
+      } else {
+        upm_allowance += it->upm;
+        usage_allowance += it->usage;
+        ++it;
+      }
+    }
+  }
+
+  JsonArray& toJson(JsonBuffer& jb) const {
+    JsonArray& ja = jb.createArray();
+    for (auto it = begin(); it != end(); ++it) {
+      ja.add(it->toJson(jb));
+    }
+    return ja;
+  }
+
+
+};
@@ -0,0 +1,56 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////
+// SpscQueue: a fixed size, lock free, single producer
+// single consumer queue
+//
+// Only the producer writes head_ and only the consumer
+// writes tail_. Each publishes with a release store that
+// the other side reads with an acquire load, so an item
+// is fully written before the consumer can see it. No
+// locks, no allocation and nothing FreeRTOS specific, so
+// it works between a task and the loop task on either
+// core as well as between std::threads on a host.
+//
+// Holds N - 1 items.
+////////////////////////////////////////////////////////
+
+template<class T, int N>
+class SpscQueue {
+  T items_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+
+  public:
+
+  // Producer only. Returns false, leaving the queue as is, if full.
+  bool push(const T& item) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t next = (head + 1) % N;
+    if (next == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    items_[head] = item;
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if empty.
+  bool pop(T& item) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items_[tail];
+    tail_.store((tail + 1) % N, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+  }
+};
@@ -0,0 +1,48 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+////////////////////////////////////////////////////////
+// The host tests' checks: each TEST() runs once from
+// check_main.cpp, a failed CHECK() is printed and fails
+// the run without stopping it.
+////////////////////////////////////////////////////////
+
+struct TestCase {
+  const char* name;
+  void (*run)();
+
+  static std::vector<TestCase>& all() {
+    static std::vector<TestCase> tests;
+    return tests;
+  }
+
+  static int& failures() {
+    static int count = 0;
+    return count;
+  }
+
+  TestCase(const char* _name, void (*_run)()): name(_name), run(_run) {
+    all().push_back(*this);
+  }
+};
+
+inline bool check(bool ok, const char* what, const char* file, int line) {
+  if (!ok) {
+    fprintf(stderr, "%s:%i: CHECK(%s) failed\n", file, line, what);
+    ++TestCase::failures();
+  }
+  return ok;
+}
+
+#define TEST(name) \
+  static void name(); \
+  static TestCase name##_case(#name, name); \
+  static void name()
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+#define CHECK_NEAR(a, b, tolerance) check(fabs(double(a) - double(b)) <= (tolerance), \
+  #a " near " #b, __FILE__, __LINE__)
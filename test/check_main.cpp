@@ -0,0 +1,11 @@
+// Copyright 2020 Brenton Olander
+#include "check.h"
+
+int main() {
+  for (const TestCase& test : TestCase::all()) {
+    int before = TestCase::failures();
+    test.run();
+    printf("%s %s\n", TestCase::failures() == before ? "ok  " : "FAIL", test.name);
+  }
+  return TestCase::failures() ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+////////////////////////////////////////////////////////
+// FlowTrace: labeled synthetic flow for the host tests
+//
+// Pulses per 1 sec sensor sample, built level by level
+// from a seeded generator so every run gets the same
+// trace. Pulse counts are Poisson: their deviation is
+// the square root of the level. Each level that differs
+// from the one before is labeled as a change at its
+// first sample.
+////////////////////////////////////////////////////////
+
+struct TraceRandom {
+  uint32_t seed;
+
+  // Small seeds are spread over the state first: xorshift's first
+  // outputs from a state with few bits set are far from random
+  explicit TraceRandom(uint32_t _seed): seed(_seed * 2654435761u + 0x9e3779b9u) {
+    for (int i = 0; i < 8; ++i) {
+      next();
+    }
+  }
+
+  uint32_t next() {
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+
+  // In (0, 1]
+  float uniform() {
+    return (next() >> 8) / float(1 << 24) + 1.0f / (1 << 25);
+  }
+
+  float gaussian() {
+    return sqrtf(-2 * logf(uniform())) * cosf(6.2831853f * uniform());
+  }
+
+  // Exact below 30, normal approximated above
+  int poisson(float mean) {
+    if (mean <= 0) {
+      return 0;
+    }
+    if (mean >= 30) {
+      int x = int(lroundf(mean + sqrtf(mean) * gaussian()));
+      return x < 0 ? 0 : x;
+    }
+    float limit = expf(-mean);
+    float p = uniform();
+    int x = 0;
+    while (p > limit) {
+      p *= uniform();
+      ++x;
+    }
+    return x;
+  }
+};
+
+struct FlowTrace {
+  std::vector<float> pulses;
+  // Sample index of each labeled change
+  std::vector<int> changes;
+  TraceRandom random;
+  float last_rate = 0;
+
+  explicit FlowTrace(uint32_t seed): random(seed) {
+  }
+
+  int size() const { return int(pulses.size()); }
+
+  // samples at rate pulses per sample
+  FlowTrace& level(int samples, float rate) {
+    if (rate != last_rate && !pulses.empty()) {
+      changes.push_back(size());
+    }
+    last_rate = rate;
+    for (int i = 0; i < samples; ++i) {
+      pulses.push_back(float(random.poisson(rate)));
+    }
+    return *this;
+  }
+
+  // A single sample off the level, e.g., water hammer, not a change
+  FlowTrace& spike(float rate) {
+    pulses.push_back(float(random.poisson(rate)));
+    return *this;
+  }
+};
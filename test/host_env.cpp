@@ -0,0 +1,102 @@
+// Copyright 2020 Brenton Olander
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "esphome.h"
+#include "app_defs.h"
+#include "app_clock.h"
+
+// What the ESPHome build and the app's yaml define on the device
+
+namespace host_env {
+thread_local uint32_t millis_now = 0;
+char log_level = 'E';
+uint32_t free_heap = 200000;
+uint32_t largest_free_block = 110000;
+}  // namespace host_env
+
+uint32_t millis() {
+  return host_env::millis_now;
+}
+
+uint32_t micros() {
+  static const auto start = std::chrono::steady_clock::now();
+  return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count());
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+HostEsp ESP;
+
+// Tasks run until stop_tasks(), which has vTaskDelayUntil() throw to
+// unwind them
+
+namespace host_env {
+uint32_t tick_us = 1000;
+}  // namespace host_env
+
+namespace {
+struct TaskStopped {};
+std::atomic<bool> tasks_stopping{false};
+std::mutex tasks_mutex;
+std::vector<std::thread> tasks;
+}  // namespace
+
+void host_env::stop_tasks() {
+  tasks_stopping = true;
+  std::lock_guard<std::mutex> lock(tasks_mutex);
+  for (std::thread& task : tasks) {
+    task.join();
+  }
+  tasks.clear();
+  tasks_stopping = false;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack_depth,
+  void* arg, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+  std::lock_guard<std::mutex> lock(tasks_mutex);
+  tasks.emplace_back([task, arg]() {
+    try {
+      task(arg);
+    } catch (const TaskStopped&) {
+    }
+  });
+  if (handle != nullptr) {
+    // Not null, nothing more
+    *handle = reinterpret_cast<TaskHandle_t>(tasks.size());
+  }
+  return pdPASS;
+}
+
+TickType_t xTaskGetTickCount() {
+  return TickType_t(micros() / host_env::tick_us);
+}
+
+void vTaskDelayUntil(TickType_t* previous_wake, TickType_t increment) {
+  *previous_wake += increment;
+  int32_t ticks = int32_t(*previous_wake - xTaskGetTickCount());
+  if (ticks > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(uint64_t(ticks) * host_env::tick_us));
+  }
+  if (tasks_stopping) {
+    throw TaskStopped();
+  }
+}
+
+static sntp::SNTPComponent host_sntp;
+static mqtt::MQTTClientComponent host_mqtt;
+sntp::SNTPComponent* sntp_time = &host_sntp;
+mqtt::MQTTClientComponent* mqtt_client = &host_mqtt;
+
+APP_GLOBAL_STORAGE AppClock app_clock;
+#ifdef APP_METRICS
+APP_GLOBAL_STORAGE AppMetrics app_metrics;
+#endif
+#ifdef APP_LOG
+APP_GLOBAL_STORAGE AppLog app_log;
+#endif
@@ -0,0 +1,454 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "esphome.h"
+#include "app_defs.h"
+#include "app_clock.h"
+#include "water_usage.h"
+#include "flow_channel.h"
+#include "specific_allowance.h"
+#include "known_loads.h"
+#include "early_samples.h"
+#include "json_arena.h"
+
+////////////////////////////////////////////////////////
+// Replay: a trace of pulses through the app's sample
+// path on the host
+//
+// dApp itself needs the display, switches and light, so
+// this wires channel 0 as dApp does: the sensor's report
+// periods, flow change and over limit policy, then
+// process_wf_on_value(), check_limits(), process_sample()
+// and disaggregate(), the early samples until SNTP has
+// the time, and on_new_hour() and on_new_day() from the
+// time of day as ESPHome's on_time triggers them. It
+// publishes what they publish, built the same way. Left
+// out: usage budgets, water_usage_max, schedules, the
+// baseline and continuous flow, snapshots.
+//
+// A trace is a text file, a command a line, # comments:
+//
+//  tz <POSIX TZ>          local time (UTC0)
+//  uptime <ms>            millis() at the start (1000)
+//  sntp <epoch>           SNTP's time at the start, 0
+//                         for none yet (0)
+//  channel <json>         channel 0's settings, as the
+//                         "channels" property has them
+//  closed_periods_max <n> the hourly and daily lists'
+//  signatures <json>      the signatures
+//  pulses <secs> <n>..    a sample a second for secs,
+//                         cycling through the counts
+//  flow <secs> <upm>      the same at a steady flow
+//  sntp_time <epoch>      SNTP gets the time
+//  sntp_step <secs>       SNTP's time steps
+//  allowance <json>       add_allowance()
+//  delete_allowance <name>
+//  named <name> <secs>    add_named_usage(), expiring
+//  delete_named <name>
+//
+// The output is every message published, after the secs
+// into the trace it went out, then the usage lists.
+////////////////////////////////////////////////////////
+
+class Replay {
+  public:
+  TranslationManager xlate;
+  WaterflowSensor wf;
+  FlowChannel ch;
+  WaterUsageNamedList named;
+  SpecificAllowances allowances;
+  EarlySamples early;
+  JsonPublisher json;
+
+  std::string topic_named;
+  std::vector<std::string> output;
+  // Sensor updates replayed
+  int samples = 0;
+
+  Replay(): wf(4, 0, xlate) {
+    sntp_time->epoch = 0;
+    sntp_time->timezone = "UTC0";
+    set_tz("UTC0");
+    host_env::millis_now = 1000;
+    app_clock = AppClock();
+    mqtt_client->published.clear();
+
+    ch.wf = &wf;
+    ch.makeMqttTopics("ww", 0);
+    topic_named = "ww/sensor/wf/usage/named/state";
+    wf.on_start_init(15, 2);
+    wf.add_on_state_callback([this](float upm) { process_wf_on_value(upm); });
+    calc_max_plus_values();
+  }
+
+  // Runs the trace in path. Returns false if it cannot be read or has a
+  // line it does not know.
+  bool run(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+      return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+      size_t hash = line.find('#');
+      if (hash != std::string::npos) {
+        line.resize(hash);
+      }
+      std::istringstream words(line);
+      std::string command;
+      if (!(words >> command)) {
+        continue;
+      }
+      std::string rest;
+      std::getline(words >> std::ws, rest);
+      if (!command_line(command, rest)) {
+        fprintf(stderr, "%s: cannot replay: %s\n", path.c_str(), line.c_str());
+        return false;
+      }
+    }
+    finish();
+    return true;
+  }
+
+  std::string text() const {
+    std::string all;
+    for (const std::string& line : output) {
+      all += line + "\n";
+    }
+    return all;
+  }
+
+  private:
+  uint32_t start_ms_ = 1000;
+  uint32_t clock_synced_ms_ = 0;
+  int secs_since_publish_ = 0;
+  float carry_ = 0;
+  // ESPHome's on_time trigger: the last second it checked
+  time_t cron_checked_ = 0;
+
+  void set_tz(const std::string& tz) {
+    setenv("TZ", tz.c_str(), 1);
+    tzset();
+    sntp_time->timezone = tz;
+  }
+
+  bool command_line(const std::string& command, const std::string& rest) {
+    std::istringstream args(rest);
+    DynamicJsonBuffer jb;
+    if (command == "tz") {
+      set_tz(rest);
+    } else if (command == "uptime") {
+      args >> start_ms_;
+      host_env::millis_now = start_ms_;
+      app_clock = AppClock();
+      app_clock.snapshot();
+    } else if (command == "sntp" || command == "sntp_time") {
+      long epoch = 0;
+      args >> epoch;
+      sntp_time->epoch = epoch;
+    } else if (command == "sntp_step") {
+      long secs = 0;
+      args >> secs;
+      sntp_time->epoch += secs;
+    } else if (command == "channel") {
+      std::string copy = rest;
+      JsonObject& jo = jb.parseObject(&copy[0]);
+      if (!jo.success()) {
+        return false;
+      }
+      ch.fromJson(jo, xlate);
+      calc_max_plus_values();
+    } else if (command == "closed_periods_max") {
+      int max = 0;
+      args >> max;
+      ch.hourly_usage.set_max_closed(max);
+      ch.daily_usage.set_max_closed(max);
+    } else if (command == "signatures") {
+      std::string copy = rest;
+      return wf.set_signatures_from_json(jb.parseArray(&copy[0]));
+    } else if (command == "flow") {
+      int secs = 0;
+      float upm = 0;
+      args >> secs >> upm;
+      // Whole pulses a second, the fractions carried
+      float per_sec = xlate.current->convert_uom_to_pulses(upm) / 60;
+      for (int i = 0; i < secs; ++i) {
+        carry_ += per_sec;
+        int pulses = int(carry_);
+        carry_ -= pulses;
+        second(pulse_counter_t(pulses));
+      }
+    } else if (command == "pulses") {
+      int secs = 0;
+      std::vector<int> counts;
+      args >> secs;
+      for (int count; args >> count;) {
+        counts.push_back(count);
+      }
+      if (counts.empty()) {
+        return false;
+      }
+      for (int i = 0; i < secs; ++i) {
+        second(pulse_counter_t(counts[i % counts.size()]));
+      }
+    } else if (command == "allowance") {
+      std::string copy = rest;
+      add_allowance(jb.parseObject(&copy[0]));
+    } else if (command == "delete_allowance") {
+      delete_allowance(rest);
+    } else if (command == "named") {
+      std::string name;
+      int secs = 7200;
+      args >> name >> secs;
+      ch.session_usage.clearCurrent();
+      named.add_usage_unit(name, app_clock.now() + secs);
+    } else if (command == "delete_named") {
+      delete_named_usage(rest);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // A second of the device: the time triggers, on_tick() and the
+  // sensor's update
+  void second(pulse_counter_t pulses) {
+    host_env::millis_now += 1000;
+    if (sntp_time->epoch != 0) {
+      sntp_time->epoch += 1;
+      on_time();
+    }
+    on_tick();
+    wf.process_pulses(pulses);
+    ++samples;
+    collect();
+  }
+
+  void collect() {
+    int secs = int((host_env::millis_now - start_ms_) / 1000);
+    for (const auto& message : mqtt_client->published) {
+      output.push_back(to_string(secs) + " " + message.topic + " " + message.payload);
+    }
+    mqtt_client->published.clear();
+  }
+
+  // As ESPHome's CronTrigger: every second since the last check is
+  // checked, so a step forward fires what it skipped, and a step back of
+  // more than 900 secs starts over from the new time
+  void on_time() {
+    time_t now = sntp_time->epoch;
+    if (cron_checked_ != 0) {
+      if (cron_checked_ > now && cron_checked_ - now > 900) {
+        // Jumped back
+      } else if (cron_checked_ >= now) {
+        return;
+      } else {
+        for (time_t t = cron_checked_ + 1; t < now; ++t) {
+          cron_match(t);
+        }
+      }
+    }
+    cron_checked_ = now;
+    cron_match(now);
+  }
+
+  void cron_match(time_t t) {
+    time::ESPTime local = time::ESPTime::from_epoch_local(t);
+    if (local.minute == 0 && local.second == 0) {
+      on_new_hour();
+      if (local.hour == 0) {
+        on_new_day();
+      }
+    }
+  }
+
+  // dApp::on_tick()'s clock
+  void on_tick() {
+    app_clock.snapshot();
+    if (!app_clock.is_valid() || uint32_t(millis() - clock_synced_ms_) >= 60000) {
+      if (app_clock.sync(sntp_time->timestamp_now())) {
+        clock_synced_ms_ = millis();
+        replay_early_samples();
+      }
+    }
+  }
+
+  void calc_max_plus_values() {
+    float upm_allowance = 0;
+    float usage_allowance = 0;
+    allowances.get_totals(upm_allowance, usage_allowance);
+    ch.calc_max_plus_values(upm_allowance, usage_allowance);
+    ch.set_sensor_limits(xlate, false);
+  }
+
+  void add_allowance(const JsonObject& jo) {
+    std::string name(getString(jo, "name", ""));
+    time_t expire_time = app_clock.now() + getInt(jo, "expire_secs", 7200);
+    bool create_named_session = getBool(jo, "create_named_session", false);
+    allowances.add_item(name, getFloat(jo, "upm", 0), getFloat(jo, "usage", 0), expire_time,
+      create_named_session);
+    if (create_named_session) {
+      named.add_usage_unit(name, expire_time);
+    }
+    calc_max_plus_values();
+  }
+
+  void delete_allowance(const std::string& name) {
+    SpecificAllowance* sa = allowances.get(name);
+    if (sa) {
+      bool create_named_session = sa->create_named_session;
+      allowances.delete_item(name);
+      if (create_named_session) {
+        delete_named_usage(name);
+      }
+    }
+    calc_max_plus_values();
+  }
+
+  void delete_named_usage(const std::string& name) {
+    if (named.delete_usage_unit(name)) {
+      json.publish(topic_named, [&](JsonBuffer& jb, JsonObject& root) {
+        named.getLastClosed().toJson(jb, &root);
+      });
+    }
+  }
+
+  void process_wf_on_value(float upm) {
+    app_clock.snapshot();
+    if (upm < 0.00000001) upm = 0.0;
+    int secs = wf.get_last_report_period_secs();
+
+    float before_upm, after_upm;
+    bool flow_changed = wf.take_flow_change(before_upm, after_upm);
+
+    if (!app_clock.is_valid()) {
+      early.add(app_clock.uptime_ms() / 1000, 0, upm, secs);
+      check_limits();
+    } else {
+      replay_early_samples();
+      if (flow_changed) {
+        json.publish(ch.topic_flow_change, [&](JsonBuffer& jb, JsonObject& root) {
+          root["before"] = before_upm;
+          root["after"] = after_upm;
+          root["timestamp"] = app_clock.now();
+        });
+      }
+      check_limits();
+      process_sample(upm, secs);
+    }
+  }
+
+  void check_limits() {
+    bool was_over = ch.policy.over_limit;
+    bool valve_closed = false;
+    OverLimitPolicy::Verdict verdict = wf.take_verdict(ch.policy, valve_closed);
+    if (verdict == OverLimitPolicy::Verdict::over_limit) {
+      mqtt_client->publish(ch.topic_over_limit, "on", 2, 2);
+    } else if (was_over && !ch.policy.over_limit) {
+      mqtt_client->publish(ch.topic_over_limit, "off", 3, 2);
+    }
+  }
+
+  void process_sample(float upm, int secs) {
+    float usage = upm * secs / 60.0;
+    ch.add_usage(usage);
+    ch.session_usage.set_segment_zones(true);
+
+    if (named.count() == 0 && ch.session_usage.addUsage(usage, upm)) {
+      publish_usage(ch.topic_session_usage, ch.session_usage.getLastClosed());
+    }
+
+    float rest_upm = KnownLoads::split(upm, secs, allowances, named);
+    wf.match_signatures(rest_upm, secs, [&](Signature& signature) {
+      if (signature.is(Signature::built_in)) {
+        return;
+      }
+      time_t now = app_clock.now();
+      if (named.add_closed_unit(signature.get_name(), now - signature.matched_secs,
+        signature.matched_secs, signature.matched_usage)) {
+        json.publish(topic_named, [&](JsonBuffer& jb, JsonObject& root) {
+          named.getLastClosed().toJson(jb, &root);
+          root["signature"] = true;
+        });
+      }
+    });
+
+    secs_since_publish_ += secs;
+    if (secs_since_publish_ >= 60) {
+      ch.settle_usage();
+      json.publish(ch.topic_current_usage, [&](JsonBuffer& jb, JsonObject& root) {
+        ch.current_usage.toJson(jb, &root);
+        ch.next_current();
+      });
+      secs_since_publish_ = 0;
+    }
+  }
+
+  void replay_early_samples() {
+    if (early.empty()) {
+      return;
+    }
+    for (int i = 0; i < early.count; ++i) {
+      const EarlySample& sample = early.samples[i];
+      app_clock.replay_at(uint64_t(sample.end_secs) * 1000);
+      process_sample(sample.upm, sample.secs);
+    }
+    early.clear();
+    app_clock.snapshot();
+  }
+
+  void on_new_hour() {
+    app_clock.snapshot();
+    ch.next_hour();
+    publish_usage(ch.topic_hourly_usage, ch.hourly_usage.getLastClosed());
+    while (named.purgeFirstExpired());
+    calc_max_plus_values();
+  }
+
+  void on_new_day() {
+    app_clock.snapshot();
+    ch.next_day();
+    publish_usage(ch.topic_daily_usage, ch.daily_usage.getLastClosed());
+  }
+
+  template<class T>
+  void publish_usage(const std::string& topic, const T& unit) {
+    json.publish(topic, [&](JsonBuffer& jb, JsonObject& root) {
+      unit.toJson(jb, &root);
+    });
+  }
+
+  // The lists as get_closed() has them. A list that has had no unit yet
+  // is "none", its toJson() would read the unit before its first, and one
+  // that counts more closed units than it keeps is "overrun", its
+  // toJson() would read past its last.
+  template<class T>
+  void list_line(const char* name, WaterUsageList<T>& list) {
+    std::string s;
+    if (list.indexCurrent == -1) {
+      s = "none";
+    } else if (list.countClosed > list.closedMax) {
+      s = "overrun " + to_string(list.countClosed) + " closed of " + to_string(list.closedMax);
+    } else {
+      DynamicJsonBuffer jb;
+      list.toJson(jb).printTo(s);
+    }
+    output.push_back(std::string(name) + " " + s);
+  }
+
+  void finish() {
+    ch.settle_usage();
+    list_line("hourly", ch.hourly_usage);
+    list_line("daily", ch.daily_usage);
+    list_line("sessions", ch.session_usage);
+    DynamicJsonBuffer jb;
+    std::string s;
+    named.toJson(jb).printTo(s);
+    output.push_back("named " + s);
+  }
+};
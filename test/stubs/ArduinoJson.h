@@ -0,0 +1,853 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <type_traits>
+
+////////////////////////////////////////////////////////
+// A host stand-in for the part of ArduinoJson 5 the app
+// uses, for the host tests only (the device builds with
+// the real library; see test/CMakeLists.txt to use it
+// here too).
+//
+// As in ArduinoJson 5, everything (objects, arrays, their
+// nodes and copied strings) is allocated from the buffer
+// through JsonBuffer::alloc(), so a JsonArena running out
+// behaves as on the device: the creation or assignment
+// that does not fit fails and the buffer reports it.
+// const char* values and keys are kept by pointer, other
+// strings are copied into the buffer.
+////////////////////////////////////////////////////////
+
+namespace ArduinoJson {
+
+class JsonArray;
+class JsonObject;
+class JsonBuffer;
+
+namespace Internals {
+
+// Appends to a char buffer, counting what does not fit
+struct JsonWriter {
+  char* buf;
+  size_t size;
+  size_t length = 0;
+
+  JsonWriter(char* _buf, size_t _size): buf(_buf), size(_size) {
+    if (buf && size) {
+      buf[0] = '\0';
+    }
+  }
+
+  void write(char c) {
+    if (buf && length + 1 < size) {
+      buf[length] = c;
+      buf[length + 1] = '\0';
+    }
+    ++length;
+  }
+
+  void write(const char* s) {
+    while (*s) {
+      write(*s++);
+    }
+  }
+
+  void write_string(const char* s) {
+    write('"');
+    for (; *s; ++s) {
+      switch (*s) {
+        case '"': write("\\\""); break;
+        case '\\': write("\\\\"); break;
+        case '\n': write("\\n"); break;
+        case '\r': write("\\r"); break;
+        case '\t': write("\\t"); break;
+        default: write(*s);
+      }
+    }
+    write('"');
+  }
+};
+
+}  // namespace Internals
+
+class JsonVariant {
+  public:
+  enum class Type : uint8_t { undefined, boolean, integer, real, string, array, object };
+
+  JsonVariant(): type_(Type::undefined) { value_.i = 0; }
+  JsonVariant(bool b): type_(Type::boolean) { value_.i = b; }
+  JsonVariant(double d): type_(Type::real) { value_.d = d; }
+  JsonVariant(float f): type_(Type::real) { value_.d = f; }
+  JsonVariant(const char* s): type_(s ? Type::string : Type::undefined) { value_.s = s; }
+  JsonVariant(char* s): JsonVariant((const char*)s) {}
+  JsonVariant(JsonArray& a);
+  JsonVariant(JsonObject& o);
+  template<typename T, typename std::enable_if<std::is_integral<T>::value
+    && !std::is_same<T, bool>::value, int>::type = 0>
+  JsonVariant(T i): type_(Type::integer) { value_.i = (long long)i; }
+
+  Type type() const { return type_; }
+  bool success() const { return type_ != Type::undefined; }
+
+  template<typename T>
+  typename std::enable_if<std::is_same<T, bool>::value, bool>::type as() const {
+    return type_ == Type::boolean || type_ == Type::integer ? value_.i != 0
+      : (type_ == Type::real ? value_.d != 0 : false);
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, T>::type
+  as() const {
+    if (type_ == Type::integer || type_ == Type::boolean) {
+      return T(value_.i);
+    }
+    if (type_ == Type::real) {
+      return T(value_.d);
+    }
+    if (type_ == Type::string) {
+      return T(strtod(value_.s, nullptr));
+    }
+    return T(0);
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_same<T, const char*>::value || std::is_same<T, char*>::value,
+    const char*>::type
+  as() const {
+    return type_ == Type::string ? value_.s : nullptr;
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_same<T, std::string>::value, std::string>::type as() const {
+    return type_ == Type::string ? std::string(value_.s) : std::string();
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_same<typename std::remove_cv<typename std::remove_reference<T>::type>::type,
+    JsonArray>::value, JsonArray&>::type
+  as() const;
+
+  template<typename T>
+  typename std::enable_if<std::is_same<typename std::remove_cv<typename std::remove_reference<T>::type>::type,
+    JsonObject>::value, JsonObject&>::type
+  as() const;
+
+  template<typename T>
+  bool is() const {
+    typedef typename std::remove_cv<typename std::remove_reference<T>::type>::type U;
+    if (std::is_same<U, bool>::value) {
+      return type_ == Type::boolean;
+    }
+    if (std::is_same<U, const char*>::value || std::is_same<U, char*>::value
+      || std::is_same<U, std::string>::value) {
+      return type_ == Type::string;
+    }
+    if (std::is_same<U, JsonArray>::value) {
+      return type_ == Type::array;
+    }
+    if (std::is_same<U, JsonObject>::value) {
+      return type_ == Type::object;
+    }
+    if (std::is_floating_point<U>::value) {
+      return type_ == Type::real || type_ == Type::integer;
+    }
+    if (std::is_integral<U>::value) {
+      return type_ == Type::integer;
+    }
+    return false;
+  }
+
+  template<typename T, typename std::enable_if<std::is_arithmetic<T>::value
+    || std::is_same<T, const char*>::value || std::is_same<T, std::string>::value, int>::type = 0>
+  operator T() const { return as<T>(); }
+
+  operator JsonArray&() const;
+  operator JsonObject&() const;
+
+  void writeTo(Internals::JsonWriter& w) const;
+
+  private:
+  Type type_;
+  union {
+    long long i;
+    double d;
+    const char* s;
+    JsonArray* a;
+    JsonObject* o;
+  } value_;
+};
+
+class JsonBuffer {
+  public:
+  virtual ~JsonBuffer() {}
+  virtual void* alloc(size_t size) = 0;
+
+  JsonArray& createArray();
+  JsonObject& createObject();
+
+  // A copy of s in the buffer, nullptr if it does not fit
+  char* strdup(const char* s) {
+    if (!s) {
+      return nullptr;
+    }
+    size_t len = strlen(s) + 1;
+    char* p = static_cast<char*>(alloc(len));
+    if (p) {
+      memcpy(p, s, len);
+    }
+    return p;
+  }
+
+  char* strdup(const std::string& s) { return strdup(s.c_str()); }
+
+  protected:
+  static size_t round_size_up(size_t bytes) {
+    const size_t x = sizeof(void*) - 1;
+    return (bytes + x) & ~x;
+  }
+
+  template<typename T>
+  T* make() {
+    void* p = alloc(sizeof(T));
+    return p ? new (p) T(this) : nullptr;
+  }
+};
+
+namespace Internals {
+
+// Nothing is copied: objects live in their buffer
+class ReferenceType {
+  public:
+  ReferenceType() {}
+  ReferenceType(const ReferenceType&) = delete;
+  ReferenceType& operator=(const ReferenceType&) = delete;
+
+  bool operator==(const ReferenceType& other) const { return this == &other; }
+  bool operator!=(const ReferenceType& other) const { return this != &other; }
+};
+
+}  // namespace Internals
+
+class JsonArray: public Internals::ReferenceType {
+  struct Node {
+    JsonVariant value;
+    Node* next;
+  };
+
+  JsonBuffer* buffer_;
+  Node* first_ = nullptr;
+  Node* last_ = nullptr;
+  size_t size_ = 0;
+
+  public:
+  explicit JsonArray(JsonBuffer* buffer): buffer_(buffer) {}
+
+  static JsonArray& invalid() {
+    static JsonArray instance(nullptr);
+    return instance;
+  }
+
+  bool success() const { return buffer_ != nullptr; }
+  size_t size() const { return size_; }
+  JsonBuffer* buffer() const { return buffer_; }
+
+  // Returns false if it does not fit
+  bool add(const JsonVariant& value) {
+    if (!buffer_) {
+      return false;
+    }
+    void* p = buffer_->alloc(sizeof(Node));
+    if (!p) {
+      return false;
+    }
+    Node* node = new (p) Node{value, nullptr};
+    (last_ ? last_->next : first_) = node;
+    last_ = node;
+    ++size_;
+    return true;
+  }
+
+  bool add(const std::string& s) {
+    const char* copy = buffer_ ? buffer_->strdup(s) : nullptr;
+    return copy && add(JsonVariant(copy));
+  }
+
+  template<typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+  bool add(T value) { return add(JsonVariant(value)); }
+  bool add(const char* s) { return add(JsonVariant(s)); }
+  bool add(JsonArray& a) { return add(JsonVariant(a)); }
+  bool add(JsonObject& o) { return add(JsonVariant(o)); }
+
+  JsonArray& createNestedArray() {
+    JsonArray& a = buffer_ ? buffer_->createArray() : invalid();
+    return a.success() && add(a) ? a : invalid();
+  }
+
+  JsonObject& createNestedObject();
+
+  JsonVariant operator[](size_t index) const {
+    Node* node = first_;
+    for (; node && index; --index) {
+      node = node->next;
+    }
+    return node ? node->value : JsonVariant();
+  }
+
+  struct const_iterator {
+    Node* node;
+    const JsonVariant& operator*() const { return node->value; }
+    const JsonVariant* operator->() const { return &node->value; }
+    const_iterator& operator++() { node = node->next; return *this; }
+    bool operator!=(const const_iterator& other) const { return node != other.node; }
+  };
+
+  const_iterator begin() const { return const_iterator{first_}; }
+  const_iterator end() const { return const_iterator{nullptr}; }
+
+  void writeTo(Internals::JsonWriter& w) const {
+    w.write('[');
+    for (Node* node = first_; node; node = node->next) {
+      if (node != first_) {
+        w.write(',');
+      }
+      node->value.writeTo(w);
+    }
+    w.write(']');
+  }
+
+  size_t printTo(char* buf, size_t size) const {
+    Internals::JsonWriter w(buf, size);
+    writeTo(w);
+    return w.length < size ? w.length : (size ? size - 1 : 0);
+  }
+
+  size_t measureLength() const {
+    Internals::JsonWriter w(nullptr, 0);
+    writeTo(w);
+    return w.length;
+  }
+};
+
+class JsonObject: public Internals::ReferenceType {
+  public:
+  struct Pair {
+    const char* key;
+    JsonVariant value;
+  };
+
+  private:
+  struct Node {
+    Pair pair;
+    Node* next;
+  };
+
+  JsonBuffer* buffer_;
+  Node* first_ = nullptr;
+  Node* last_ = nullptr;
+  size_t size_ = 0;
+
+  Node* find(const char* key) const {
+    for (Node* node = first_; node; node = node->next) {
+      if (strcmp(node->pair.key, key) == 0) {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  public:
+  explicit JsonObject(JsonBuffer* buffer): buffer_(buffer) {}
+
+  static JsonObject& invalid() {
+    static JsonObject instance(nullptr);
+    return instance;
+  }
+
+  bool success() const { return buffer_ != nullptr; }
+  size_t size() const { return size_; }
+  JsonBuffer* buffer() const { return buffer_; }
+
+  // Returns false if it does not fit. key is kept by pointer.
+  bool set(const char* key, const JsonVariant& value) {
+    if (!buffer_ || !key) {
+      return false;
+    }
+    Node* node = find(key);
+    if (node) {
+      node->pair.value = value;
+      return true;
+    }
+    void* p = buffer_->alloc(sizeof(Node));
+    if (!p) {
+      return false;
+    }
+    node = new (p) Node{Pair{key, value}, nullptr};
+    (last_ ? last_->next : first_) = node;
+    last_ = node;
+    ++size_;
+    return true;
+  }
+
+  bool set(const std::string& key, const JsonVariant& value) {
+    const char* copy = buffer_ ? buffer_->strdup(key) : nullptr;
+    return copy && set(copy, value);
+  }
+
+  bool set(const char* key, const std::string& s) {
+    const char* copy = buffer_ ? buffer_->strdup(s) : nullptr;
+    return copy && set(key, JsonVariant(copy));
+  }
+
+  JsonVariant get(const char* key) const {
+    Node* node = find(key);
+    return node ? node->pair.value : JsonVariant();
+  }
+
+  bool containsKey(const char* key) const { return find(key) != nullptr; }
+  bool containsKey(const std::string& key) const { return containsKey(key.c_str()); }
+
+  void remove(const char* key) {
+    Node* prev = nullptr;
+    for (Node* node = first_; node; prev = node, node = node->next) {
+      if (strcmp(node->pair.key, key) == 0) {
+        (prev ? prev->next : first_) = node->next;
+        if (last_ == node) {
+          last_ = prev;
+        }
+        --size_;
+        return;
+      }
+    }
+  }
+
+  // jo["key"] = value
+  class Subscript {
+    JsonObject& object_;
+    const char* key_;
+    std::string key_copy_;
+
+    const char* key() {
+      if (!key_ && object_.buffer_) {
+        key_ = object_.buffer_->strdup(key_copy_);
+      }
+      return key_;
+    }
+
+    public:
+    Subscript(JsonObject& object, const char* key): object_(object), key_(key) {}
+    Subscript(JsonObject& object, const std::string& key):
+      object_(object), key_(nullptr), key_copy_(key) {}
+
+    void assign(const JsonVariant& value) {
+      const char* k = key();
+      if (k) {
+        object_.set(k, value);
+      }
+    }
+
+    void assign(const std::string& s) {
+      const char* k = key();
+      if (k) {
+        object_.set(k, s);
+      }
+    }
+
+    void assign(const char* s) { assign(JsonVariant(s)); }
+
+    template<typename T>
+    Subscript& operator=(const T& value) {
+      assign(value);
+      return *this;
+    }
+
+    template<typename T>
+    Subscript& operator=(T& value) {
+      assign(value);
+      return *this;
+    }
+
+    Subscript& operator=(const Subscript& other) {
+      return *this = other.value();
+    }
+
+    JsonVariant value() const {
+      return key_ ? object_.get(key_) : object_.get(key_copy_.c_str());
+    }
+
+    template<typename T> auto as() const -> decltype(JsonVariant().as<T>()) { return value().as<T>(); }
+    template<typename T> bool is() const { return value().is<T>(); }
+    bool success() const { return value().success(); }
+
+    template<typename T, typename std::enable_if<std::is_arithmetic<T>::value
+      || std::is_same<T, const char*>::value || std::is_same<T, std::string>::value, int>::type = 0>
+    operator T() const { return value().as<T>(); }
+    operator JsonArray&() const { return value().as<JsonArray&>(); }
+    operator JsonObject&() const { return value().as<JsonObject&>(); }
+    operator JsonVariant() const { return value(); }
+  };
+
+  Subscript operator[](const char* key) { return Subscript(*this, key); }
+  Subscript operator[](const std::string& key) { return Subscript(*this, key); }
+  JsonVariant operator[](const char* key) const { return get(key); }
+  JsonVariant operator[](const std::string& key) const { return get(key.c_str()); }
+
+  JsonArray& createNestedArray(const char* key) {
+    JsonArray& a = buffer_ ? buffer_->createArray() : JsonArray::invalid();
+    return a.success() && set(key, JsonVariant(a)) ? a : JsonArray::invalid();
+  }
+
+  JsonObject& createNestedObject(const char* key) {
+    JsonObject& o = buffer_ ? buffer_->createObject() : invalid();
+    return o.success() && set(key, JsonVariant(o)) ? o : invalid();
+  }
+
+  struct const_iterator {
+    Node* node;
+    const Pair& operator*() const { return node->pair; }
+    const Pair* operator->() const { return &node->pair; }
+    const_iterator& operator++() { node = node->next; return *this; }
+    bool operator!=(const const_iterator& other) const { return node != other.node; }
+  };
+
+  const_iterator begin() const { return const_iterator{first_}; }
+  const_iterator end() const { return const_iterator{nullptr}; }
+
+  void writeTo(Internals::JsonWriter& w) const {
+    w.write('{');
+    for (Node* node = first_; node; node = node->next) {
+      if (node != first_) {
+        w.write(',');
+      }
+      w.write_string(node->pair.key);
+      w.write(':');
+      node->pair.value.writeTo(w);
+    }
+    w.write('}');
+  }
+
+  size_t printTo(char* buf, size_t size) const {
+    Internals::JsonWriter w(buf, size);
+    writeTo(w);
+    return w.length < size ? w.length : (size ? size - 1 : 0);
+  }
+
+  size_t printTo(std::string& s) const {
+    s.assign(measureLength(), '\0');
+    std::string buf(s.size() + 1, '\0');
+    printTo(&buf[0], buf.size());
+    s.assign(buf.c_str());
+    return s.size();
+  }
+
+  size_t measureLength() const {
+    Internals::JsonWriter w(nullptr, 0);
+    writeTo(w);
+    return w.length;
+  }
+};
+
+inline JsonVariant::JsonVariant(JsonArray& a): type_(a.success() ? Type::array : Type::undefined) {
+  value_.a = &a;
+}
+
+inline JsonVariant::JsonVariant(JsonObject& o): type_(o.success() ? Type::object : Type::undefined) {
+  value_.o = &o;
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_same<typename std::remove_cv<typename std::remove_reference<T>::type>::type,
+  JsonArray>::value, JsonArray&>::type
+JsonVariant::as() const {
+  return type_ == Type::array ? *value_.a : JsonArray::invalid();
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_same<typename std::remove_cv<typename std::remove_reference<T>::type>::type,
+  JsonObject>::value, JsonObject&>::type
+JsonVariant::as() const {
+  return type_ == Type::object ? *value_.o : JsonObject::invalid();
+}
+
+inline JsonVariant::operator JsonArray&() const { return as<JsonArray&>(); }
+inline JsonVariant::operator JsonObject&() const { return as<JsonObject&>(); }
+
+inline void JsonVariant::writeTo(Internals::JsonWriter& w) const {
+  char buf[32];
+  switch (type_) {
+    case Type::undefined:
+      w.write("null");
+      break;
+    case Type::boolean:
+      w.write(value_.i ? "true" : "false");
+      break;
+    case Type::integer:
+      snprintf(buf, sizeof(buf), "%lld", value_.i);
+      w.write(buf);
+      break;
+    case Type::real:
+      if (value_.d != value_.d) {
+        w.write("NaN");
+      } else {
+        snprintf(buf, sizeof(buf), "%.9g", value_.d);
+        w.write(buf);
+      }
+      break;
+    case Type::string:
+      w.write_string(value_.s);
+      break;
+    case Type::array:
+      value_.a->writeTo(w);
+      break;
+    case Type::object:
+      value_.o->writeTo(w);
+      break;
+  }
+}
+
+inline JsonArray& JsonBuffer::createArray() {
+  JsonArray* a = make<JsonArray>();
+  return a ? *a : JsonArray::invalid();
+}
+
+inline JsonObject& JsonBuffer::createObject() {
+  JsonObject* o = make<JsonObject>();
+  return o ? *o : JsonObject::invalid();
+}
+
+inline JsonObject& JsonArray::createNestedObject() {
+  JsonObject& o = buffer_ ? buffer_->createObject() : JsonObject::invalid();
+  return o.success() && add(o) ? o : JsonObject::invalid();
+}
+
+namespace Internals {
+
+// Parses in place: strings are unescaped where they are and kept by
+// pointer, as ArduinoJson 5 does with a char* input
+class JsonParser {
+  JsonBuffer* buffer_;
+  char* p_;
+  int nesting_;
+
+  void skip_space() {
+    while (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r') {
+      ++p_;
+    }
+  }
+
+  bool eat(char c) {
+    skip_space();
+    if (*p_ != c) {
+      return false;
+    }
+    ++p_;
+    return true;
+  }
+
+  const char* parse_string() {
+    skip_space();
+    char quote = *p_;
+    if (quote != '"' && quote != '\'') {
+      return nullptr;
+    }
+    char* start = ++p_;
+    char* out = start;
+    while (*p_ && *p_ != quote) {
+      char c = *p_++;
+      if (c == '\\') {
+        c = *p_++;
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case '\0': return nullptr;
+          default: break;
+        }
+      }
+      *out++ = c;
+    }
+    if (*p_ != quote) {
+      return nullptr;
+    }
+    ++p_;
+    *out = '\0';
+    return start;
+  }
+
+  bool parse_value(JsonVariant& value) {
+    skip_space();
+    if (*p_ == '{') {
+      JsonObject* o = parse_object();
+      value = o ? JsonVariant(*o) : JsonVariant();
+      return o != nullptr;
+    }
+    if (*p_ == '[') {
+      JsonArray* a = parse_array();
+      value = a ? JsonVariant(*a) : JsonVariant();
+      return a != nullptr;
+    }
+    if (*p_ == '"' || *p_ == '\'') {
+      const char* s = parse_string();
+      value = JsonVariant(s);
+      return s != nullptr;
+    }
+    if (strncmp(p_, "true", 4) == 0) {
+      p_ += 4;
+      value = JsonVariant(true);
+      return true;
+    }
+    if (strncmp(p_, "false", 5) == 0) {
+      p_ += 5;
+      value = JsonVariant(false);
+      return true;
+    }
+    if (strncmp(p_, "null", 4) == 0) {
+      p_ += 4;
+      value = JsonVariant((const char*)nullptr);
+      return true;
+    }
+
+    char* end;
+    long long i = strtoll(p_, &end, 10);
+    if (end != p_ && *end != '.' && *end != 'e' && *end != 'E') {
+      p_ = end;
+      value = JsonVariant(i);
+      return true;
+    }
+    double d = strtod(p_, &end);
+    if (end == p_) {
+      return false;
+    }
+    p_ = end;
+    value = JsonVariant(d);
+    return true;
+  }
+
+  JsonObject* parse_object() {
+    if (!eat('{') || ++nesting_ > 10) {
+      return nullptr;
+    }
+    JsonObject& o = buffer_->createObject();
+    if (!o.success()) {
+      return nullptr;
+    }
+    if (!eat('}')) {
+      do {
+        const char* key = parse_string();
+        JsonVariant value;
+        if (!key || !eat(':') || !parse_value(value) || !o.set(key, value)) {
+          return nullptr;
+        }
+      } while (eat(','));
+      if (!eat('}')) {
+        return nullptr;
+      }
+    }
+    --nesting_;
+    return &o;
+  }
+
+  JsonArray* parse_array() {
+    if (!eat('[') || ++nesting_ > 10) {
+      return nullptr;
+    }
+    JsonArray& a = buffer_->createArray();
+    if (!a.success()) {
+      return nullptr;
+    }
+    if (!eat(']')) {
+      do {
+        JsonVariant value;
+        if (!parse_value(value) || !a.add(value)) {
+          return nullptr;
+        }
+      } while (eat(','));
+      if (!eat(']')) {
+        return nullptr;
+      }
+    }
+    --nesting_;
+    return &a;
+  }
+
+  public:
+  JsonParser(JsonBuffer* buffer, char* json): buffer_(buffer), p_(json), nesting_(0) {}
+
+  JsonObject& object() {
+    JsonObject* o = p_ ? parse_object() : nullptr;
+    return o ? *o : JsonObject::invalid();
+  }
+
+  JsonArray& array() {
+    JsonArray* a = p_ ? parse_array() : nullptr;
+    return a ? *a : JsonArray::invalid();
+  }
+};
+
+template<typename TDerived>
+class JsonBufferBase: public JsonBuffer {
+  public:
+  JsonObject& parseObject(char* json) {
+    return JsonParser(this, json).object();
+  }
+
+  JsonArray& parseArray(char* json) {
+    return JsonParser(this, json).array();
+  }
+
+  // As ArduinoJson 5 does with a const input, parses a copy
+  JsonObject& parseObject(const std::string& json) {
+    return parseObject(strdup(json));
+  }
+};
+
+}  // namespace Internals
+
+// Heap backed, for the tests' own use
+class DynamicJsonBuffer: public Internals::JsonBufferBase<DynamicJsonBuffer> {
+  struct Block {
+    Block* next;
+  };
+  Block* blocks_ = nullptr;
+  size_t size_ = 0;
+
+  public:
+  DynamicJsonBuffer() {}
+  DynamicJsonBuffer(const DynamicJsonBuffer&) = delete;
+  ~DynamicJsonBuffer() { clear(); }
+
+  void* alloc(size_t bytes) override {
+    bytes = round_size_up(bytes);
+    Block* block = static_cast<Block*>(malloc(sizeof(Block) + bytes));
+    if (!block) {
+      return nullptr;
+    }
+    block->next = blocks_;
+    blocks_ = block;
+    size_ += bytes;
+    return block + 1;
+  }
+
+  void clear() {
+    while (blocks_) {
+      Block* next = blocks_->next;
+      free(blocks_);
+      blocks_ = next;
+    }
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+};
+
+}  // namespace ArduinoJson
+
+using namespace ArduinoJson;
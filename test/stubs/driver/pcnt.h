@@ -0,0 +1,4 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+typedef int pcnt_unit_t;
@@ -0,0 +1,15 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+namespace host_env {
+extern uint32_t largest_free_block;
+}
+
+inline size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return host_env::largest_free_block;
+}
@@ -0,0 +1,110 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+// The host stand-in for the esphome.h an ESPHome build generates, with
+// just what the app's host tested headers use: logging, millis() and
+// micros(), ESP, the SNTP time, a recording mqtt client and FreeRTOS
+// tasks. Time and heap are fakes the tests set (see host_env).
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <ArduinoJson.h>
+#include "esphome/components/time/real_time_clock.h"
+#include "freertos/task.h"
+
+#define ESP_LOGE(tag, ...) host_env::log('E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) host_env::log('W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) host_env::log('I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) host_env::log('D', tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) host_env::log('V', tag, __VA_ARGS__)
+
+namespace host_env {
+
+// Set by the tests. millis() is fake so a replay runs at any speed,
+// micros() is the real clock so time budgets measure real work. Each
+// thread has its own, as it has its own app_clock.
+extern thread_local uint32_t millis_now;
+// Log lines at or above this level ('E' only by default) are printed
+extern char log_level;
+extern uint32_t free_heap;
+extern uint32_t largest_free_block;
+
+inline void log(char level, const char* tag, const char* format, ...) {
+  static const char levels[] = "EWIDV";
+  if (strchr(levels, level) > strchr(levels, log_level)) {
+    return;
+  }
+  va_list arg;
+  va_start(arg, format);
+  fprintf(stderr, "[%c][%s] ", level, tag);
+  vfprintf(stderr, format, arg);
+  fputc('\n', stderr);
+  va_end(arg);
+}
+
+}  // namespace host_env
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+struct HostEsp {
+  uint32_t getFreeHeap() const { return host_env::free_heap; }
+  uint32_t getMinFreeHeap() const { return host_env::free_heap; }
+  // Microseconds as cycles of a 1 MHz cpu
+  uint32_t getCycleCount() const { return micros(); }
+  uint32_t getCpuFreqMHz() const { return 1; }
+};
+
+extern HostEsp ESP;
+
+namespace esphome {
+
+using std::to_string;
+
+namespace json {}
+
+namespace sntp {
+
+class SNTPComponent: public time::RealTimeClock {};
+
+}  // namespace sntp
+
+namespace mqtt {
+
+// Keeps what is published for the tests to check
+class MQTTClientComponent {
+  public:
+  struct Message {
+    std::string topic;
+    std::string payload;
+    uint8_t qos;
+    bool retain;
+  };
+
+  std::vector<Message> published;
+
+  bool publish(const std::string& topic, const char* payload, size_t length, uint8_t qos = 0, 
+    bool retain = false) {
+    published.push_back(Message{topic, std::string(payload, length), qos, retain});
+    return true;
+  }
+};
+
+}  // namespace mqtt
+
+}  // namespace esphome
+
+using namespace esphome;
+
+extern sntp::SNTPComponent* sntp_time;
+extern mqtt::MQTTClientComponent* mqtt_client;
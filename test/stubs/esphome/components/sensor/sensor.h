@@ -0,0 +1,46 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace sensor {
+
+// publish_state() hands the state to the callbacks, as on the device
+class Sensor {
+  public:
+  virtual ~Sensor() {}
+  void set_name(const std::string& name) { name_ = name; }
+  const std::string& get_name() const { return name_; }
+  void set_unit_of_measurement(const std::string& unit) { unit_ = unit; }
+  void set_icon(const std::string& icon) { icon_ = icon; }
+  void set_accuracy_decimals(int8_t decimals) { decimals_ = decimals; }
+  void set_force_update(bool force_update) { force_update_ = force_update; }
+
+  void add_on_state_callback(std::function<void(float)>&& callback) {
+    callbacks_.push_back(std::move(callback));
+  }
+
+  void publish_state(float state) {
+    this->state = state;
+    for (auto& callback : callbacks_) {
+      callback(state);
+    }
+  }
+
+  float state = 0;
+
+  protected:
+  std::string name_;
+  std::string unit_;
+  std::string icon_;
+  int8_t decimals_ = 0;
+  bool force_update_ = false;
+  std::vector<std::function<void(float)>> callbacks_;
+};
+
+}  // namespace sensor
+}  // namespace esphome
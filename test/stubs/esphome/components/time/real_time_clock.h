@@ -0,0 +1,63 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace esphome {
+namespace time {
+
+// ESPTime as the app uses it, local time from the process's TZ
+struct ESPTime {
+  uint8_t second;
+  uint8_t minute;
+  uint8_t hour;
+  // 1 (Sunday) to 7
+  uint8_t day_of_week;
+  uint8_t day_of_month;
+  uint16_t day_of_year;
+  uint8_t month;
+  uint16_t year;
+  bool is_dst;
+  time_t timestamp;
+
+  static ESPTime from_epoch_local(time_t epoch) {
+    struct tm c;
+    localtime_r(&epoch, &c);
+    ESPTime t;
+    t.second = c.tm_sec;
+    t.minute = c.tm_min;
+    t.hour = c.tm_hour;
+    t.day_of_week = c.tm_wday + 1;
+    t.day_of_month = c.tm_mday;
+    t.day_of_year = c.tm_yday + 1;
+    t.month = c.tm_mon + 1;
+    t.year = c.tm_year + 1900;
+    t.is_dst = c.tm_isdst > 0;
+    t.timestamp = epoch;
+    return t;
+  }
+
+  std::string strftime(const std::string& format) const {
+    struct tm c;
+    localtime_r(&timestamp, &c);
+    char buf[64];
+    size_t len = ::strftime(buf, sizeof(buf), format.c_str(), &c);
+    return std::string(buf, len);
+  }
+};
+
+class RealTimeClock {
+  public:
+  // The tests set the epoch; 0 is not synced
+  time_t epoch = 0;
+  std::string timezone = "UTC0";
+
+  std::string get_timezone() const { return timezone; }
+  time_t timestamp_now() const { return epoch; }
+  ESPTime now() const { return ESPTime::from_epoch_local(epoch); }
+};
+
+}  // namespace time
+}  // namespace esphome
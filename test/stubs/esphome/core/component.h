@@ -0,0 +1,39 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stdint.h>
+
+namespace esphome {
+
+namespace setup_priority {
+const float DATA = 600.0f;
+}  // namespace setup_priority
+
+const uint32_t SCHEDULER_DONT_RUN = 4294967295UL;
+
+// Only the virtuals the app's components override; nothing schedules them
+class Component {
+  public:
+  virtual ~Component() {}
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return 0; }
+  bool is_failed() const { return failed_; }
+  void mark_failed() { failed_ = true; }
+
+  protected:
+  bool failed_ = false;
+};
+
+class PollingComponent: public Component {
+  public:
+  virtual void update() = 0;
+  void set_update_interval(uint32_t update_interval) { update_interval_ = update_interval; }
+  uint32_t get_update_interval() const { return update_interval_; }
+
+  protected:
+  uint32_t update_interval_ = 0;
+};
+
+}  // namespace esphome
@@ -0,0 +1,38 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#define INPUT 0x01
+#define OUTPUT 0x02
+#define RISING 0x01
+#define FALLING 0x02
+
+namespace esphome {
+
+// Keeps the level written for the tests to check, from any thread
+class GPIOPin {
+  public:
+  GPIOPin(uint8_t pin, uint8_t mode, bool inverted = false):
+    pin_(pin), mode_(mode), inverted_(inverted) {}
+
+  void setup() {}
+  bool digital_read() { return value_; }
+  void digital_write(bool value) {
+    value_ = value;
+    ++writes_;
+  }
+  uint8_t get_pin() const { return pin_; }
+  bool is_inverted() const { return inverted_; }
+  int writes() const { return writes_; }
+
+  protected:
+  uint8_t pin_;
+  uint8_t mode_;
+  bool inverted_;
+  std::atomic<bool> value_{false};
+  std::atomic<int> writes_{0};
+};
+
+}  // namespace esphome
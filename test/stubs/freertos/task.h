@@ -0,0 +1,29 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <stdint.h>
+
+// FreeRTOS tasks as host threads (see host_env.cpp). A tick is 
+// host_env::tick_us of real time, so a task that runs every second on
+// the device can run every few milliseconds in a test.
+
+typedef void* TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+namespace host_env {
+// Real microseconds a tick
+extern uint32_t tick_us;
+// Ends every task at its next vTaskDelayUntil() and waits for them
+void stop_tasks();
+}  // namespace host_env
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack_depth,
+  void* arg, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+TickType_t xTaskGetTickCount();
+void vTaskDelayUntil(TickType_t* previous_wake, TickType_t increment);
@@ -0,0 +1,172 @@
+// Copyright 2020 Brenton Olander
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "check.h"
+#include "water_flow_sensor.h"
+#include "seqlock.h"
+#include "usage_snapshot.h"
+#include "flow_trace.h"
+
+////////////////////////////////////////////////////////
+// The APP_ACQUISITION_TASK pipeline on host threads,
+// built with it defined (see CMakeLists.txt):
+//
+//  acquisition task  reads a labeled trace a sample a
+//                    tick, decides over limit and
+//                    closes the valve's pins
+//  SpscQueue         carries its reports
+//  loop task         publishes them, stalled now and
+//                    then as a big publish or an MQTT
+//                    reconnect would stall it, and
+//                    writes a UsageSnapshot
+//  reader            polls the snapshot's Seqlock, as
+//                    the display or a web handler would
+//
+// The valve must close on the sample the policy decides
+// on whatever the loop task is doing. When the loop and
+// the reader see it is measured and printed: that is how
+// late the valve would have closed when decided in the
+// loop task.
+////////////////////////////////////////////////////////
+
+// Real microseconds a tick, so a 1 sec sample takes 2 ms
+static const uint32_t tick_us = 2;
+static const int sample_us = 1000 * tick_us;
+
+// The trace as the PCNT units would count it: sample n is read on the
+// n-th read
+static FlowTrace* trace = nullptr;
+static std::atomic<int> samples_read{0};
+static GPIOPin valve_open(32, OUTPUT, true);
+static GPIOPin valve_close(22, OUTPUT, true);
+// The read at which the close pin was first seen set, less one: the
+// sample whose processing closed it
+static std::atomic<int> closed_at{-1};
+
+namespace esphome {
+namespace pulse_counter {
+
+void PulseCounterStorage::read_raw_values(PulseCounterStorage *const *storages,
+  pulse_counter_t *values, int n) {
+  int sample = samples_read.load();
+  if (closed_at < 0 && valve_close.digital_read()) {
+    closed_at = sample - 1;
+  }
+  for (int i = 0; i < n; ++i) {
+    values[i] = sample < trace->size() ? pulse_counter_t(trace->pulses[sample]) : 0;
+  }
+  samples_read = sample + 1;
+}
+
+void PulseCounterSensor::setup() {}
+void PulseCounterSensor::update() {}
+void PulseCounterSensor::dump_config() {}
+
+}  // namespace pulse_counter
+}  // namespace esphome
+
+TEST(valve_closes_on_the_deciding_sample_whatever_the_loop_does) {
+  host_env::tick_us = tick_us;
+  // Quiet, a tap under the limit, then a burst pipe over it, then quiet
+  // long enough for the last report
+  FlowTrace flow(45);
+  flow.level(60, 0).level(20, 10).level(120, 40).level(60, 0);
+  trace = &flow;
+
+  TranslationManager xlate;
+  WaterflowSensor wf(4, 0, xlate);
+  wf.on_start_init(15, 2);
+  WaterflowSensor::set_valve_pins(&valve_open, &valve_close);
+  OverLimitPolicy settings;
+  const float max_pulses_plus = 20;
+  wf.set_over_limit(settings, max_pulses_plus, true);
+
+  // The sample the policy decides on, as it would step through the trace
+  OverLimitPolicy reference = settings;
+  int decided_at = -1;
+  for (int i = 0; i < flow.size() && decided_at < 0; ++i) {
+    if (reference.step(flow.pulses[i], 0, max_pulses_plus, 1) == OverLimitPolicy::Verdict::over_limit) {
+      decided_at = i;
+    }
+  }
+  CHECK(decided_at > 80);
+
+  // Loop task side, each written by it alone
+  static Seqlock<UsageSnapshot> snapshot_lock;
+  UsageSnapshot snapshot;
+  memset(&snapshot, 0, sizeof(snapshot));
+  OverLimitPolicy app_policy = settings;
+  int loop_saw_at = -1;
+  bool valve_closed_reported = false;
+  double reported_pulses = 0;
+  int reports = 0;
+  wf.add_on_state_callback([&](float upm) {
+    bool valve_closed;
+    OverLimitPolicy::Verdict verdict = wf.take_verdict(app_policy, valve_closed);
+    if (verdict == OverLimitPolicy::Verdict::over_limit && loop_saw_at < 0) {
+      loop_saw_at = samples_read - 1;
+    }
+    valve_closed_reported |= valve_closed;
+    reported_pulses += xlate.current->convert_uom_to_pulses(upm) * wf.get_last_report_period_secs() / 60;
+    ++reports;
+
+    snapshot.time = samples_read - 1;
+    snapshot.channels[0].upm = upm;
+    snapshot.channels[0].over_limit = app_policy.over_limit;
+    snapshot_lock.write(snapshot);
+  });
+
+  std::atomic<bool> done{false};
+  std::atomic<int> reader_saw_at{-1};
+  std::thread reader([&]() {
+    UsageSnapshot s;
+    while (!done) {
+      if (snapshot_lock.try_read(s) && s.channels[0].over_limit && reader_saw_at < 0) {
+        reader_saw_at = samples_read - 1;
+      }
+      std::this_thread::yield();
+    }
+  });
+
+  // The loop twice a sample, stalled for 12 samples now and then, one
+  // stall from just before the decision
+  std::vector<int> stall_at = {40, 80, decided_at - 2, 160, 200};
+  int stalls = 0;
+  while (samples_read < flow.size()) {
+    wf.loop();
+    int sample = samples_read;
+    if (stalls < int(stall_at.size()) && sample >= stall_at[stalls]) {
+      ++stalls;
+      std::this_thread::sleep_for(std::chrono::microseconds(12 * sample_us));
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(sample_us / 2));
+    }
+  }
+  host_env::stop_tasks();
+  wf.loop();
+  done = true;
+  reader.join();
+
+  double trace_pulses = 0;
+  for (float p : flow.pulses) {
+    trace_pulses += p;
+  }
+
+  printf("over limit decided at sample %i, valve closed at %i, the loop saw it at %i and the "
+    "reader at %i (%i stalls of 12 samples)\n", decided_at, closed_at.load(), loop_saw_at,
+    reader_saw_at.load(), stalls);
+  printf("%i reports of %.0f pulses, %.0f read\n", reports, reported_pulses, trace_pulses);
+
+  CHECK(closed_at == decided_at);
+  CHECK(valve_open.writes() == 1 && !valve_open.digital_read());
+  CHECK(valve_close.writes() == 1);
+  CHECK(valve_closed_reported);
+  // The stalled loop gets the report later, and the reader after it
+  CHECK(loop_saw_at > decided_at);
+  CHECK(reader_saw_at >= loop_saw_at);
+  // No report lost to the stalls
+  CHECK_NEAR(reported_pulses, trace_pulses, 0.5);
+  CHECK(!app_policy.over_limit);
+}
@@ -0,0 +1,294 @@
+// Copyright 2020 Brenton Olander
+#include <atomic>
+#include <new>
+
+#include "check.h"
+#include "esphome.h"
+#include "app_defs.h"
+#include "water_usage.h"
+#include "translation_unit.h"
+#include "signature.h"
+#include "specific_allowance.h"
+#include "json_arena.h"
+
+////////////////////////////////////////////////////////
+// Leak and fragmentation regression over a long replay
+//
+// 91 days of a household's flow at a sample every 10
+// secs run through the structures that allocate at run
+// time: the usage lists and their names, the allowances,
+// the signatures (re-applied nightly, as the retained
+// /stat does), the app log and the json messages. The
+// AllocTracker must see every subsystem level off once
+// the lists are full and stay there, the heap history
+// must stay bounded, and a sample must allocate nothing
+// unless the flow changes or a signature matches.
+//
+// The host heap is not the ESP32's, so fragmentation is
+// measured by what causes it: allocations per day once
+// steady, which must stay under a small bound, and none
+// per steady sample.
+////////////////////////////////////////////////////////
+
+// Every heap allocation of the process, tracked or not
+static std::atomic<uint64_t> heap_allocs{0};
+
+void* operator new(size_t size) {
+  ++heap_allocs;
+  void* p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+static const int sample_secs = 10;
+static const int days = 91;
+// Lists full (168 hours) and a week of every event after this
+static const int warmup_days = 14;
+
+static const char* signatures_json =
+  "[{\"name\":\"Toilet flush\",\"level\":\"report\",\"segments\":[[2.5,1.5,30,60]]},"
+  "{\"name\":\"Shower\",\"segments\":[[1.5,1,300,900]]}]";
+
+struct Household {
+  TranslationManager xlate;
+  SignatureManager signatures{xlate};
+  FlowConfig config;
+  WaterUsagePeriodList hourly;
+  WaterUsagePeriodList daily;
+  WaterUsageSessionList sessions{config};
+  WaterUsageNamedList named;
+  SpecificAllowances allowances;
+  JsonPublisher publisher;
+  uint32_t seed = 12345;
+
+  Household() {
+    hourly.set_max_closed(24 * 7);
+    daily.set_max_closed(31);
+    sessions.set_max_closed(APP_MAX_CLOSED_SESSIONS);
+    named.set_max_closed(24);
+    apply_signatures();
+  }
+
+  uint32_t random(uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+  }
+
+  void apply_signatures() {
+    DynamicJsonBuffer jb;
+    std::string json = signatures_json;
+    signatures.fromJson(jb.parseArray(&json[0]));
+  }
+
+  // Gallons per minute at second of the day
+  float flow(int day, int second) {
+    int minute = second / 60;
+    // Irrigation, four zones from 02:00
+    if (minute >= 120 && minute < 160) {
+      return 6.0f + (minute - 120) / 10;
+    }
+    // Shower at 07:00, longer at weekends
+    if (minute >= 420 && minute < 420 + (day % 7 < 2 ? 15 : 8)) {
+      return 2.0f;
+    }
+    // Toilet flushes
+    if ((minute % 97 == 0 || minute % 131 == 0) && second % 60 < 50 && minute > 360) {
+      return 3.0f;
+    }
+    // Washer
+    if (minute >= 600 && minute < 640 && minute % 10 < 4) {
+      return 4.0f;
+    }
+    return 0;
+  }
+
+  // The per sample path. Returns whether a signature matched.
+  bool sample(float upm) {
+    bool matched = false;
+    float usage = upm * sample_secs / 60;
+    hourly.addUsage(usage);
+    daily.addUsage(usage);
+    sessions.addUsage(usage, upm);
+    named.addUsage(usage);
+    signatures.is_match(upm, sample_secs, [&](Signature& signature) {
+      named.add_closed_unit(signature.get_name(), app_clock.now() - signature.matched_secs,
+        signature.matched_secs, signature.matched_usage);
+      matched = true;
+    });
+    return matched;
+  }
+
+  void publish_usage(const char* topic, const WaterUsageTimed& unit) {
+    publisher.publish(topic, [&](JsonBuffer& jb, JsonObject& root) {
+      unit.toJson(jb, &root);
+    });
+  }
+
+  // What the hour and the minute events of dApp do
+  void on_minute(int day, int minute) {
+    if (minute == 119) {
+      named.add_usage_unit("Irrigation zone " + to_string(1 + day % 3), app_clock.now() + 3600);
+    } else if (minute == 160) {
+      named.delete_usage_unit("Irrigation zone " + to_string(1 + day % 3));
+    } else if (minute == 599) {
+      allowances.add_item("washer", 4.5, 40, app_clock.now() + 7200, true);
+      named.add_usage_unit("washer", app_clock.now() + 7200);
+    } else if (minute == 640 && random(4)) {
+      // Sometimes left to expire
+      allowances.delete_item("washer");
+      named.delete_usage_unit("washer");
+    } else if (minute == 24 * 60 - 1) {
+      apply_signatures();
+    }
+    if (named.purgeFirstExpired()) {
+      APP_LOG_LOG("minute %i: %i named active", minute, named.count());
+    }
+  }
+
+  void on_hour(int day, int hour) {
+    APP_LOG_LOG("hour %i", hour);
+    hourly.next();
+    publish_usage("t/hourly", hourly.getLastClosed());
+    app_metrics.alloc.sample_heap(true);
+    if (hour == 0) {
+      daily.next();
+      publish_usage("t/daily", daily.getLastClosed());
+      publisher.publish("t/closed", [&](JsonBuffer& jb, JsonObject& root) {
+        root["named"] = named.toJson(jb);
+      });
+      if (day % 30 == 29) {
+        // clear_closed
+        hourly.clearClosed();
+        daily.clearClosed();
+        sessions.clearClosed();
+        named.clearClosed();
+      }
+    }
+  }
+};
+
+static uint32_t live_bytes(AllocSubsystem subsystem) {
+  return app_metrics.alloc.subsystems[int(subsystem)].bytes;
+}
+
+static uint32_t live_allocs(AllocSubsystem subsystem) {
+  const AllocStats& stats = app_metrics.alloc.subsystems[int(subsystem)];
+  return stats.allocs - stats.frees;
+}
+
+TEST(long_replay_levels_off) {
+  host_env::millis_now = 1000;
+  app_clock = AppClock();
+  // Midnight UTC, 2020-09-14
+  app_clock.sync(1600041600);
+
+  static Household house;
+  const int count = int(AllocSubsystem::count);
+
+  uint32_t steady_bytes[count] = {0};
+  uint32_t steady_allocs[count] = {0};
+  uint64_t sample_allocs = 0;
+  uint64_t event_allocs = 0;
+  float last_upm = 0;
+  uint64_t allocs_at_day_start = 0;
+  uint64_t max_allocs_per_day = 0;
+
+  for (int day = 0; day < days; ++day) {
+    allocs_at_day_start = heap_allocs;
+
+    for (int second = 0; second < 24 * 3600; second += sample_secs) {
+      host_env::millis_now += sample_secs * 1000;
+      app_clock.snapshot();
+
+      if (second % 3600 == 0) {
+        house.on_hour(day, second / 3600);
+      }
+      if (second % 60 == 0) {
+        house.on_minute(day, second / 60);
+      }
+
+      // A session start or end, a zone or a signature match may
+      // allocate (an app log line, a name), a steady sample not
+      float upm = house.flow(day, second);
+      uint64_t before = heap_allocs;
+      bool matched = house.sample(upm);
+      if (upm != last_upm || matched) {
+        event_allocs += heap_allocs - before;
+      } else {
+        sample_allocs += heap_allocs - before;
+      }
+      last_upm = upm;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      uint32_t bytes = live_bytes(AllocSubsystem(i));
+      uint32_t allocs = live_allocs(AllocSubsystem(i));
+      if (AllocSubsystem(i) == AllocSubsystem::usage_names) {
+        // A named slot keeps its name's capacity when it is reused, so
+        // the names only level off once every slot had a long name. They
+        // are bounded by the slots and the last closed copy instead.
+        int slots = house.named.get_max_closed() + 1 + 1;
+        if (!CHECK(allocs <= uint32_t(slots) && bytes <= uint32_t(slots) * 32)) {
+          fprintf(stderr, "day %i: %u names in %u bytes for %i slots\n", day, allocs, bytes,
+            slots);
+        }
+      } else if (day < warmup_days) {
+        steady_bytes[i] = std::max(steady_bytes[i], bytes);
+        steady_allocs[i] = std::max(steady_allocs[i], allocs);
+      } else if (!CHECK(bytes <= steady_bytes[i] && allocs <= steady_allocs[i])) {
+        fprintf(stderr, "day %i: %s has %u bytes in %u allocs, was at most %u in %u\n",
+          day, AllocTracker::name(AllocSubsystem(i)), bytes, allocs, steady_bytes[i],
+          steady_allocs[i]);
+      }
+    }
+
+    if (day >= warmup_days) {
+      max_allocs_per_day = std::max(max_allocs_per_day, heap_allocs - allocs_at_day_start);
+    }
+  }
+
+  CHECK(sample_allocs == 0);
+  // The nightly signatures, the named units, the sessions' and the
+  // hours' app log lines: a couple of hundred, nothing per sample
+  CHECK(max_allocs_per_day < 400);
+  CHECK(app_metrics.alloc.heap_history_size == AllocTracker::heap_history_count);
+
+  printf("%i days: %llu heap allocations a day at most once steady, %llu on flow events, "
+    "%llu on steady samples\n", days, (unsigned long long)max_allocs_per_day,
+    (unsigned long long)event_allocs, (unsigned long long)sample_allocs);
+  for (int i = 0; i < count; ++i) {
+    const AllocStats& stats = app_metrics.alloc.subsystems[i];
+    printf("  %-12s live %6u bytes in %4u allocs, high water %6u bytes\n",
+      AllocTracker::name(AllocSubsystem(i)), stats.bytes, stats.allocs - stats.frees,
+      stats.high_water_bytes);
+  }
+}
+
+TEST(heap_history_keeps_a_day) {
+  AllocTracker tracker;
+  for (int hour = 0; hour < 30; ++hour) {
+    host_env::largest_free_block = 100000 - hour * 100;
+    tracker.sample_heap(true);
+  }
+  CHECK(tracker.heap_history_size == AllocTracker::heap_history_count);
+  CHECK(tracker.largest_block_low_water == 100000 - 29 * 100);
+
+  DynamicJsonBuffer jb;
+  JsonObject& jo = jb.createObject();
+  tracker.toJson(jb, jo);
+  JsonArray& hourly = jo["heap"].as<JsonObject&>()["hourly"];
+  CHECK(hourly.size() == AllocTracker::heap_history_count);
+  // Oldest first
+  CHECK(hourly[0].as<JsonArray&>()[1].as<uint32_t>() == 100000 - 6 * 100);
+  host_env::largest_free_block = 110000;
+}
@@ -0,0 +1,455 @@
+// Copyright 2020 Brenton Olander
+#include <chrono>
+#include <map>
+#include <string>
+
+#include "check.h"
+#include "esphome.h"
+#include "app_defs.h"
+#include "app_clock.h"
+#include "flow_config.h"
+#include "over_limit_policy.h"
+#include "water_usage.h"
+#include "flow_trace.h"
+#include "work_stealing_pool.h"
+
+////////////////////////////////////////////////////////
+// Fleet simulator for tuning the over limit policy and
+// the sessions
+//
+// A fleet of devices, a day of labeled flow each, runs
+// through the pipeline once for every point of a grid of
+// test_period_secs, initial_surge_secs, end_session_secs
+// and min_session_secs: OverLimitPolicy::step() on every
+// 1 sec sample, as the sensor does, and
+// WaterUsageSessionList::addUsage() on every report, 2
+// secs with flow and 15 without, as dApp does. Each
+// (device, grid point) is a task on a WorkStealingPool,
+// with the app's globals its own (APP_GLOBAL_STORAGE).
+// The sessions are built as released
+// (APP_RELEASE_SESSIONS): DEBUG_SESSION ignores both
+// session settings.
+//
+// Scored per grid point over the fleet:
+//
+//  leaks     - leak events (a burst pipe, a broken
+//              sprinkler head) alarmed while they last,
+//              and how long after they started
+//  false     - alarms outside any leak, e.g., on the
+//              surge of an irrigation zone filling or a
+//              shower and the washer at once
+//  sessions  - the long events (irrigation nights,
+//              bursts) each closed as one session, split
+//              into more, and sessions of nothing long
+//              (a shower, the washer)
+//
+// The results table goes to stdout, best first, and all
+// of it to the file FLEET_SIM_RESULTS names. The fleet
+// is FLEET_SIM_DEVICES devices (8 by default) and the
+// sweep runs on FLEET_SIM_THREADS threads (a thread a
+// core by default), after a run on one thread to compare
+// with: the results must match and, with more than one
+// core, the speedup must be near the core count.
+////////////////////////////////////////////////////////
+
+static const time_t epoch = 1600000000;
+static const int day_secs = 24 * 3600;
+// The device's max_upm_plus: upm_base 0 plus its allowance
+static const float max_upm_plus = 6.0f;
+
+struct Event {
+  const char* kind;
+  int start;
+  int end;
+  bool leak;
+  // Long enough to be a session of its own
+  bool session;
+};
+
+struct Device {
+  std::vector<float> upm;
+  std::vector<Event> events;
+
+  // rate for secs from start, with 3% noise
+  void add(TraceRandom& random, int start, int secs, float rate) {
+    for (int t = start; t < start + secs && t < day_secs; ++t) {
+      upm[t] += rate * (1 + 0.03f * random.gaussian());
+    }
+  }
+};
+
+static int between(TraceRandom& random, int from, int to) {
+  return from + int(random.next() % uint32_t(to - from + 1));
+}
+
+static float between(TraceRandom& random, float from, float to) {
+  return from + (to - from) * random.uniform();
+}
+
+// An irrigation night: zones of steady flow with pauses between them as
+// the controller moves on, each zone first surging while its pipes fill.
+// A broken head runs one zone at well over the limit.
+static void irrigate(Device& d, TraceRandom& random, int start, bool broken_head) {
+  int zones = between(random, 2, 6);
+  int broken_zone = broken_head ? between(random, 0, zones - 1) : -1;
+  int t = start;
+  for (int z = 0; z < zones; ++z) {
+    if (z > 0) {
+      t += between(random, 20, 150);
+    }
+    int secs = between(random, 8, 20) * 60;
+    float zone_upm = between(random, 2.5f, 5.0f);
+    if (z == broken_zone) {
+      zone_upm = std::max(2.2f * zone_upm, 8.0f);
+      d.events.push_back({"broken head", t, t + secs, true, false});
+    }
+    int surge_secs = between(random, 20, 90);
+    d.add(random, t, surge_secs, zone_upm * between(random, 1.8f, 2.5f));
+    d.add(random, t + surge_secs, secs - surge_secs, zone_upm);
+    t += secs;
+  }
+  d.events.push_back({"irrigation", start, t, false, true});
+}
+
+static Device make_device(uint32_t seed) {
+  TraceRandom random(seed);
+  Device d;
+  d.upm.assign(day_secs, 0);
+  bool leaks = random.uniform() < 0.4f;
+  bool burst = leaks && random.uniform() < 0.5f;
+
+  if (random.uniform() < 0.7f) {
+    irrigate(d, random, between(random, 2, 4) * 3600 + between(random, 0, 1800), leaks && !burst);
+  }
+
+  // The household, 06:00 to 23:00
+  int flushes = between(random, 6, 12);
+  for (int i = 0; i < flushes; ++i) {
+    int t = between(random, 6 * 3600, 23 * 3600);
+    d.add(random, t, 45, 3.25f);
+    d.events.push_back({"flush", t, t + 45, false, false});
+  }
+  int showers = between(random, 1, 3);
+  int first_shower = 0;
+  for (int i = 0; i < showers; ++i) {
+    int t = between(random, 6 * 3600, 22 * 3600);
+    int secs = between(random, 6, 10) * 60;
+    d.add(random, t, secs, 2.0f);
+    d.events.push_back({"shower", t, t + secs, false, false});
+    if (i == 0) {
+      first_shower = t;
+    }
+  }
+  // Some washes start during the first shower: over the limit for a fill
+  int washes = between(random, 0, 2);
+  for (int i = 0; i < washes; ++i) {
+    int t = random.uniform() < 0.5f ? first_shower + 60 : between(random, 8 * 3600, 20 * 3600);
+    for (int fill = 0; fill < 3; ++fill) {
+      int at = t + fill * 15 * 60;
+      d.add(random, at, 180, 4.5f);
+      d.events.push_back({"washer", at, at + 180, false, false});
+    }
+  }
+
+  if (burst) {
+    int t = between(random, 1 * 3600, 22 * 3600);
+    int secs = between(random, 15, 40) * 60;
+    d.add(random, t, secs, between(random, 10.0f, 14.0f));
+    d.events.push_back({"burst", t, t + secs, true, true});
+  }
+
+  for (float& upm : d.upm) {
+    upm = std::max(upm, 0.0f);
+  }
+  return d;
+}
+
+struct Params {
+  int test_period_secs;
+  int surge_secs;
+  int end_session_secs;
+  int min_session_secs;
+};
+
+struct Score {
+  int leaks = 0;
+  int leaks_found = 0;
+  int latency_secs = 0;
+  int false_alarms = 0;
+  int sessions = 0;
+  int sessions_found = 0;
+  int splits = 0;
+  int spurious = 0;
+
+  void add(const Score& s) {
+    leaks += s.leaks;
+    leaks_found += s.leaks_found;
+    latency_secs += s.latency_secs;
+    false_alarms += s.false_alarms;
+    sessions += s.sessions;
+    sessions_found += s.sessions_found;
+    splits += s.splits;
+    spurious += s.spurious;
+  }
+
+  int session_errors() const { return sessions - sessions_found + splits + spurious; }
+
+  bool operator==(const Score& s) const {
+    return leaks == s.leaks && leaks_found == s.leaks_found && latency_secs == s.latency_secs
+      && false_alarms == s.false_alarms && sessions == s.sessions
+      && sessions_found == s.sessions_found && splits == s.splits && spurious == s.spurious;
+  }
+};
+
+// One device's day through the pipeline with params, on this thread's
+// clock
+static Score simulate(const Device& d, const Params& p) {
+  host_env::millis_now = 1000;
+  app_clock = AppClock();
+  app_clock.sync(epoch);
+  time_t start = app_clock.now();
+
+  OverLimitPolicy policy;
+  policy.test_period_secs = p.test_period_secs;
+  policy.allow_initial_surge_seconds = p.surge_secs;
+  policy.grace_for_surge = p.surge_secs;
+  FlowConfig config;
+  WaterUsageSessionList sessions(config);
+  sessions.set_max_closed(4);
+  sessions.set_end_session_secs(p.end_session_secs);
+  sessions.set_min_session_secs(p.min_session_secs);
+
+  std::vector<int> alarms;
+  std::vector<std::pair<int, int>> closed;
+  float total = 0;
+  int secs = 0;
+  bool wf_on = false;
+
+  for (int t = 0; t < day_secs; ++t) {
+    float upm = d.upm[t];
+    bool was_over = policy.over_limit;
+    if (policy.step(upm, config.upm_base, max_upm_plus, 1) == OverLimitPolicy::Verdict::over_limit
+      && !was_over) {
+      alarms.push_back(t);
+    }
+
+    total += upm;
+    ++secs;
+    if (secs >= (wf_on ? 2 : 15)) {
+      float report_upm = total / secs;
+      host_env::millis_now = 1000 + (t + 1) * 1000;
+      app_clock.snapshot();
+      if (sessions.addUsage(report_upm * secs / 60, report_upm)) {
+        const WaterUsageSession& s = sessions.getLastClosed();
+        int from = int(s.start_time - start);
+        closed.push_back({from, from + s.seconds});
+      }
+      total = 0;
+      secs = 0;
+    }
+    wf_on = upm > config.upm_base;
+  }
+
+  Score score;
+  for (const Event& e : d.events) {
+    if (e.leak) {
+      ++score.leaks;
+      for (int t : alarms) {
+        if (t >= e.start && t < e.end) {
+          ++score.leaks_found;
+          score.latency_secs += t - e.start;
+          break;
+        }
+      }
+    }
+    if (e.session) {
+      ++score.sessions;
+      int n = 0;
+      for (const auto& s : closed) {
+        if (s.first < e.end && s.second > e.start) {
+          ++n;
+        }
+      }
+      score.sessions_found += n > 0;
+      score.splits += std::max(n - 1, 0);
+    }
+  }
+  for (int t : alarms) {
+    bool in_leak = false;
+    for (const Event& e : d.events) {
+      in_leak |= e.leak && t >= e.start && t < e.end;
+    }
+    score.false_alarms += !in_leak;
+  }
+  for (const auto& s : closed) {
+    bool expected = false;
+    for (const Event& e : d.events) {
+      expected |= e.session && s.first < e.end && s.second > e.start;
+    }
+    score.spurious += !expected;
+  }
+  return score;
+}
+
+static std::vector<Params> grid() {
+  std::vector<Params> all;
+  for (int test_period : {5, 15, 30, 60, 120, 180}) {
+    for (int surge : {0, 30, 60, 120}) {
+      for (int end_session : {60, 180, 300}) {
+        for (int min_session : {120, 240, 480, 720}) {
+          all.push_back({test_period, surge, end_session, min_session});
+        }
+      }
+    }
+  }
+  return all;
+}
+
+static int env_int(const char* name, int def) {
+  const char* value = getenv(name);
+  return value != nullptr && atoi(value) > 0 ? atoi(value) : def;
+}
+
+// Every (device, grid point) on threads threads. Returns the scores by
+// grid point, with the seconds it took.
+static std::vector<Score> sweep(const std::vector<Device>& fleet, const std::vector<Params>& params,
+  int threads, double& secs, uint64_t& steals) {
+  std::vector<std::vector<Score>> scores(params.size(), std::vector<Score>(fleet.size()));
+  std::vector<std::function<void()>> tasks;
+  for (size_t p = 0; p < params.size(); ++p) {
+    for (size_t d = 0; d < fleet.size(); ++d) {
+      tasks.push_back([&, p, d]() { scores[p][d] = simulate(fleet[d], params[p]); });
+    }
+  }
+
+  WorkStealingPool pool(threads);
+  auto start = std::chrono::steady_clock::now();
+  pool.run(tasks);
+  secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  steals = pool.steals;
+
+  std::vector<Score> totals(params.size());
+  for (size_t p = 0; p < params.size(); ++p) {
+    for (const Score& s : scores[p]) {
+      totals[p].add(s);
+    }
+  }
+  return totals;
+}
+
+// Best first: leaks missed, then false alarms, then session errors, then
+// how long leaks took to alarm
+static std::vector<int> rank(const std::vector<Score>& scores) {
+  std::vector<int> order(scores.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = int(i);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    const Score& x = scores[a];
+    const Score& y = scores[b];
+    if (x.leaks_found != y.leaks_found) return x.leaks_found > y.leaks_found;
+    if (x.false_alarms != y.false_alarms) return x.false_alarms < y.false_alarms;
+    if (x.session_errors() != y.session_errors()) return x.session_errors() < y.session_errors();
+    return x.latency_secs < y.latency_secs;
+  });
+  return order;
+}
+
+static void print_row(FILE* f, int rank, const Params& p, const Score& s, int devices) {
+  fprintf(f, "%4i %6i %5i %7i %7i   %3i/%-3i %8.0f %8.1f   %3i/%-3i %5i %8i\n", rank,
+    p.test_period_secs, p.surge_secs, p.end_session_secs, p.min_session_secs,
+    s.leaks_found, s.leaks, s.leaks_found ? float(s.latency_secs) / s.leaks_found : 0.0f,
+    100.0f * s.false_alarms / devices, s.sessions_found, s.sessions, s.splits, s.spurious);
+}
+
+static void print_table(FILE* f, const std::vector<Params>& params, const std::vector<Score>& scores,
+  const std::vector<int>& order, int devices, int rows) {
+  fprintf(f, "rank  test surge end_ses min_ses   leaks   latency false/100   sessions split spurious\n");
+  fprintf(f, "      secs  secs    secs    secs   found      secs dev-days      found\n");
+  for (int i = 0; i < rows && i < int(order.size()); ++i) {
+    print_row(f, i + 1, params[order[i]], scores[order[i]], devices);
+  }
+}
+
+TEST(fleet_sweep) {
+  int devices = env_int("FLEET_SIM_DEVICES", 8);
+  int cores = int(std::max(1u, std::thread::hardware_concurrency()));
+  // At least 2, so the stealing runs even on one core
+  int threads = env_int("FLEET_SIM_THREADS", std::max(cores, 2));
+
+  std::vector<Device> fleet(devices);
+  std::vector<std::function<void()>> make;
+  for (int d = 0; d < devices; ++d) {
+    make.push_back([&, d]() { fleet[d] = make_device(1000 + d); });
+  }
+  WorkStealingPool(threads).run(make);
+
+  std::vector<Params> params = grid();
+  double one_secs, secs;
+  uint64_t steals;
+  std::vector<Score> one = sweep(fleet, params, 1, one_secs, steals);
+  std::vector<Score> scores = sweep(fleet, params, threads, secs, steals);
+
+  // The same results whatever the threads
+  bool same = true;
+  for (size_t p = 0; p < params.size(); ++p) {
+    same &= one[p] == scores[p];
+  }
+  CHECK(same);
+
+  std::vector<int> order = rank(scores);
+  print_table(stdout, params, scores, order, devices, 10);
+  const Score& best = scores[order[0]];
+  const Score& worst = scores[order.back()];
+  printf("... %zu grid points, worst: ", params.size());
+  print_row(stdout, int(params.size()), params[order.back()], worst, devices);
+
+  const char* path = getenv("FLEET_SIM_RESULTS");
+  if (path != nullptr) {
+    FILE* f = fopen(path, "w");
+    CHECK(f != nullptr);
+    if (f != nullptr) {
+      print_table(f, params, scores, order, devices, int(order.size()));
+      fclose(f);
+    }
+  }
+
+  double speedup = one_secs / secs;
+  printf("%i devices x %zu grid points: %.2f s on 1 thread, %.2f s on %i (%llu stolen), "
+    "%.2fx on %i core%s\n", devices, params.size(), one_secs, secs, threads,
+    (unsigned long long)steals, speedup, cores, cores > 1 ? "s" : "");
+  if (cores == 1) {
+    printf("one core: the scaling with cores cannot be measured on this host\n");
+  } else {
+    CHECK(speedup >= 0.7 * std::min(cores, threads));
+  }
+
+  // The labels matter: alarming on every surge is worst, and the best
+  // finds the leaks without false alarms
+  CHECK(worst.false_alarms > 0);
+  CHECK(best.leaks_found == best.leaks);
+  CHECK(best.false_alarms == 0);
+}
+
+TEST(pool_runs_every_task_once) {
+  std::vector<std::atomic<int>> runs(1000);
+  std::vector<std::function<void()>> tasks;
+  for (int i = 0; i < 1000; ++i) {
+    // Uneven: every 4th is long, and they all land on the first thread
+    tasks.push_back([&runs, i]() {
+      volatile int spin = i % 4 == 0 ? 200000 : 0;
+      while (spin > 0) {
+        --spin;
+      }
+      ++runs[i];
+    });
+  }
+  WorkStealingPool pool(4);
+  pool.run(tasks);
+  bool once = true;
+  for (std::atomic<int>& n : runs) {
+    once &= n == 1;
+  }
+  CHECK(once);
+  printf("1000 tasks on 4 threads, %llu stolen\n", (unsigned long long)pool.steals);
+}
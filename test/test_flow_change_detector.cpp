@@ -0,0 +1,218 @@
+// Copyright 2020 Brenton Olander
+#include <chrono>
+
+#include "check.h"
+#include "flow_change_detector.h"
+#include "flow_trace.h"
+
+////////////////////////////////////////////////////////
+// FlowChangeDetector benchmark: detection latency versus
+// false positives over labeled traces, for thresholds
+// around the default and for the fixed delta between
+// two samples that ReportPeriod used before (a change of
+// more than 10 pulses).
+//
+// A detection within match_window samples of a labeled
+// change, and before the next one, detects it, the first
+// one only. Every other detection is a false positive.
+////////////////////////////////////////////////////////
+
+static const int match_window = 30;
+
+// ReportPeriod's old test
+struct DeltaDetector {
+  float delta = 10;
+  float last = -1;
+
+  bool add(float x) {
+    bool changed = last >= 0 && fabsf(x - last) > delta;
+    last = x;
+    return changed;
+  }
+};
+
+struct Score {
+  int changes = 0;
+  int detected = 0;
+  int false_positives = 0;
+  int latency_total = 0;
+  int latency_max = 0;
+  int samples = 0;
+
+  float mean_latency() const { return detected ? float(latency_total) / detected : 0; }
+  float false_per_hour() const { return false_positives * 3600.0f / samples; }
+
+  void add(const Score& s) {
+    changes += s.changes;
+    detected += s.detected;
+    false_positives += s.false_positives;
+    latency_total += s.latency_total;
+    latency_max = std::max(latency_max, s.latency_max);
+    samples += s.samples;
+  }
+};
+
+template<class D>
+static Score score(D detector, const FlowTrace& trace) {
+  Score s;
+  s.changes = int(trace.changes.size());
+  s.samples = trace.size();
+  // The last labeled change at or before the sample, if any
+  int last = -1;
+  bool matched = false;
+  for (int i = 0; i < trace.size(); ++i) {
+    if (!detector.add(trace.pulses[i])) {
+      continue;
+    }
+    while (last + 1 < s.changes && trace.changes[last + 1] <= i) {
+      ++last;
+      matched = false;
+    }
+    if (last >= 0 && i < trace.changes[last] + match_window && !matched) {
+      matched = true;
+      int latency = i - trace.changes[last];
+      ++s.detected;
+      s.latency_total += latency;
+      s.latency_max = std::max(s.latency_max, latency);
+    } else {
+      ++s.false_positives;
+    }
+  }
+  return s;
+}
+
+static FlowChangeDetector cusum(float threshold) {
+  FlowChangeDetector detector;
+  detector.threshold = threshold;
+  return detector;
+}
+
+// The traces, pulses per 1 sec sample. A toilet fill is 30, a shower
+// 40, an irrigation zone 90 to 150, a drip leak 3.
+static std::vector<FlowTrace> traces() {
+  std::vector<FlowTrace> all;
+
+  // A morning: flushes, a shower, a tap on during it
+  FlowTrace morning(1);
+  morning.level(600, 0).level(45, 30).level(900, 0).level(40, 30).level(600, 0)
+    .level(300, 40).level(60, 55).level(180, 40).level(900, 0).level(45, 30).level(600, 0);
+  all.push_back(morning);
+
+  // Irrigation zones, one after another, and a valve closing slowly
+  FlowTrace irrigation(2);
+  irrigation.level(300, 0).level(600, 120).level(600, 90).level(600, 150).level(5, 100)
+    .level(5, 50).level(600, 0);
+  all.push_back(irrigation);
+
+  // A drip leak starting at night
+  FlowTrace leak(3);
+  leak.level(1800, 0).level(3600, 3).level(600, 8);
+  all.push_back(leak);
+
+  // Small steps: a second tap during a shower. The smallest step the
+  // default detects at 40 pulses is 2 deviations, 13.
+  FlowTrace small(4);
+  small.level(300, 40).level(300, 55).level(300, 40).level(300, 60).level(300, 40);
+  all.push_back(small);
+
+  // Hours of steady irrigation with water hammer spikes: nothing to detect
+  FlowTrace steady(5);
+  for (int i = 0; i < 36; ++i) {
+    steady.level(299, 120).spike(200);
+  }
+  all.push_back(steady);
+
+  return all;
+}
+
+template<class D>
+static Score score_all(D detector, const std::vector<FlowTrace>& all) {
+  Score total;
+  for (const FlowTrace& trace : all) {
+    total.add(score(detector, trace));
+  }
+  return total;
+}
+
+static void print(const char* name, const Score& s) {
+  printf("  %-16s %3i of %3i  latency mean %5.1f max %3i  false %4i (%6.2f an hour)\n",
+    name, s.detected, s.changes, s.mean_latency(), s.latency_max, s.false_positives,
+    s.false_per_hour());
+}
+
+TEST(latency_versus_false_positives) {
+  std::vector<FlowTrace> all = traces();
+  printf("detector          detected      latency, samples       false positives\n");
+
+  Score by_threshold[4];
+  const float thresholds[4] = {2, 4, 8, 16};
+  for (int i = 0; i < 4; ++i) {
+    by_threshold[i] = score_all(cusum(thresholds[i]), all);
+    char name[32];
+    snprintf(name, sizeof(name), "cusum h=%g", thresholds[i]);
+    print(name, by_threshold[i]);
+  }
+  Score delta = score_all(DeltaDetector(), all);
+  print("delta > 10", delta);
+
+  // The default finds every change within seconds, with next to no
+  // false positives where the old delta test has them by the thousand
+  const Score& defaults = by_threshold[1];
+  CHECK(FlowChangeDetector().threshold == thresholds[1]);
+  CHECK(defaults.detected == defaults.changes);
+  CHECK(defaults.mean_latency() < 5);
+  CHECK(defaults.latency_max <= 15);
+  CHECK(defaults.false_per_hour() < 1);
+  CHECK(delta.false_positives > 100 * std::max(defaults.false_positives, 1));
+
+  // A higher threshold trades latency for fewer false positives, down
+  // to the few a slowly closing valve makes at any threshold
+  for (int i = 1; i < 4; ++i) {
+    CHECK(by_threshold[i].mean_latency() > by_threshold[i - 1].mean_latency());
+    CHECK(by_threshold[i].false_positives * 4 <= by_threshold[0].false_positives);
+  }
+}
+
+TEST(reports_levels_either_side) {
+  FlowTrace trace(6);
+  trace.level(300, 0).level(300, 120).level(300, 60);
+  FlowChangeDetector detector;
+  std::vector<std::pair<float, float>> changes;
+  for (float x : trace.pulses) {
+    if (detector.add(x)) {
+      changes.push_back({detector.before, detector.after});
+    }
+  }
+  CHECK(changes.size() == 2);
+  if (changes.size() == 2) {
+    // A large step is detected on its first sample, so the level after
+    // is that one sample, within 3 of its deviations. The level before
+    // is the mean of up to max_level_samples.
+    CHECK_NEAR(changes[0].first, 0, 1);
+    CHECK_NEAR(changes[0].second, 120, 3 * sqrtf(120));
+    CHECK_NEAR(changes[1].first, 120, 3 * sqrtf(120.0f / FlowChangeDetector::max_level_samples));
+    CHECK_NEAR(changes[1].second, 60, 3 * sqrtf(60));
+  }
+}
+
+TEST(constant_time_per_sample) {
+  FlowTrace trace(7);
+  for (int i = 0; i < 100; ++i) {
+    trace.level(500, 0).level(500, 30).level(500, 120);
+  }
+  FlowChangeDetector detector;
+  int detected = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < 20; ++pass) {
+    for (float x : trace.pulses) {
+      detected += detector.add(x);
+    }
+  }
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double per_sample_ns = secs * 1e9 / (20.0 * trace.size());
+  printf("%.1f ns a sample over %i samples, %i changes\n", per_sample_ns, 20 * trace.size(),
+    detected);
+  // Far under the 1 sec sample period on any host
+  CHECK(per_sample_ns < 1000);
+  CHECK(sizeof(FlowChangeDetector) <= 64);
+}
@@ -0,0 +1,145 @@
+// Copyright 2020 Brenton Olander
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+#include "check.h"
+#include "replay.h"
+
+////////////////////////////////////////////////////////
+// Golden traces: each trace in traces/ replayed through
+// the app's sample path (see replay.h), its MQTT messages
+// and usage lists compared with traces/<name>.golden, so
+// a change to the accounting, the sessions, the named
+// usage or the over limit policy shows as a diff of what
+// a device would have published.
+//
+// Then all of them replayed over and over, the samples a
+// second against the floor in traces/throughput.golden,
+// a quarter of what it measured when it was written.
+//
+// GOLDEN_UPDATE=1 writes the goldens instead, to be
+// looked over and checked in with the change that made
+// them differ.
+//
+// Built as the firmware is, so with DEBUG_SESSION (see
+// app_defs.h) a session ends on its first report without
+// flow.
+////////////////////////////////////////////////////////
+
+static const char* traces[] = {
+  "irrigation_night",
+  "toilet_flushes",
+  "leak",
+  "sntp_steps",
+  "dst_spring",
+  "dst_fall",
+  "counter_wrap",
+};
+
+static const int throughput_rounds = 40;
+
+// The replay hands the sensor its pulses (see Replay::second())
+namespace esphome {
+namespace pulse_counter {
+
+void PulseCounterStorage::read_raw_values(PulseCounterStorage *const *storages,
+  pulse_counter_t *values, int n) {
+  for (int i = 0; i < n; ++i) {
+    values[i] = 0;
+  }
+}
+
+void PulseCounterSensor::setup() {}
+void PulseCounterSensor::update() {}
+void PulseCounterSensor::dump_config() {}
+
+}  // namespace pulse_counter
+}  // namespace esphome
+
+static bool updating() {
+  const char* update = getenv("GOLDEN_UPDATE");
+  return update && strcmp(update, "1") == 0;
+}
+
+static std::string read_file(const std::string& path) {
+  std::ifstream in(path);
+  std::stringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
+static void write_file(const std::string& path, const std::string& text) {
+  std::ofstream out(path);
+  out << text;
+}
+
+// The first line where they differ, 0 if none
+static int first_difference(const std::string& a, const std::string& b, std::string& line_a,
+  std::string& line_b) {
+  std::istringstream in_a(a);
+  std::istringstream in_b(b);
+  for (int line = 1;; ++line) {
+    bool more_a = bool(std::getline(in_a, line_a));
+    bool more_b = bool(std::getline(in_b, line_b));
+    if (!more_a && !more_b) {
+      return 0;
+    }
+    if (!more_a || !more_b || line_a != line_b) {
+      return line;
+    }
+  }
+}
+
+TEST(traces_match_their_goldens) {
+  for (const char* name : traces) {
+    std::string path = std::string("traces/") + name;
+    // A JsonPublisher is too big for the stack of a test
+    std::unique_ptr<Replay> replay(new Replay());
+    CHECK(replay->run(path + ".trace"));
+    std::string text = replay->text();
+
+    if (updating()) {
+      write_file(path + ".golden", text);
+      printf("  %-18s %6i samples, %4zu lines written\n", name, replay->samples,
+        replay->output.size());
+      continue;
+    }
+
+    std::string line_got, line_golden;
+    int line = first_difference(text, read_file(path + ".golden"), line_got, line_golden);
+    if (line) {
+      printf("  %s.golden:%i\n    golden: %s\n    replay: %s\n", path.c_str(), line,
+        line_golden.c_str(), line_got.c_str());
+    }
+    CHECK(line == 0);
+  }
+}
+
+TEST(replay_throughput) {
+  int samples = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < throughput_rounds; ++round) {
+    for (const char* name : traces) {
+      std::unique_ptr<Replay> replay(new Replay());
+      CHECK(replay->run(std::string("traces/") + name + ".trace"));
+      samples += replay->samples;
+    }
+  }
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double per_sec = samples / secs;
+
+  const char* floor_path = "traces/throughput.golden";
+  if (updating()) {
+    write_file(floor_path, to_string(long(per_sec / 4)) + "\n");
+  }
+  double floor = atof(read_file(floor_path).c_str());
+  printf("  %i samples in %.3f secs, %.0f a sec, the floor %.0f\n", samples, secs, per_sec, floor);
+  CHECK(floor > 0);
+  // The floor is of the optimized build, Release unless asked otherwise
+  // (see CMakeLists.txt)
+#ifdef NDEBUG
+  CHECK(per_sec >= floor);
+#endif
+}
@@ -0,0 +1,242 @@
+// Copyright 2020 Brenton Olander
+#include "check.h"
+#include "esphome.h"
+#include "app_defs.h"
+#include "water_usage.h"
+#include "json_arena.h"
+
+////////////////////////////////////////////////////////
+// JsonArena and JsonPublisher bounds: a message that
+// does not fit is replaced by an error, never written
+// past the arena or the payload, and the largest real
+// messages, the get_closed pages of full lists, fit and
+// can be built again and again without memory growing.
+//
+// The stand-in ArduinoJson's nodes on a 64 bit host are
+// larger than the library's on the ESP32, so a page that
+// fits here fits on the device.
+////////////////////////////////////////////////////////
+
+static JsonPublisher publisher;
+
+static float stat(const char* name, const JsonPublisher& from=publisher) {
+  DynamicJsonBuffer jb;
+  return from.toJson(jb)[name].as<float>();
+}
+
+static const mqtt::MQTTClientComponent::Message& last_message() {
+  return mqtt_client->published.back();
+}
+
+// Clock at epoch, then advanced by each tick()
+static void start_clock(time_t epoch) {
+  host_env::millis_now = 1000;
+  app_clock = AppClock();
+  app_clock.sync(epoch);
+}
+
+static void tick(uint32_t ms) {
+  host_env::millis_now += ms;
+  app_clock.snapshot();
+}
+
+TEST(arena_alloc_stops_at_capacity) {
+  static JsonArena arena;
+  size_t allocated = 0;
+  while (arena.alloc(100)) {
+    allocated += 104;
+  }
+  CHECK(arena.overflowed());
+  CHECK(arena.size() <= arena.capacity());
+  CHECK(allocated == arena.size());
+  CHECK(arena.capacity() - arena.size() < 104);
+
+  arena.clear();
+  CHECK(!arena.overflowed());
+  CHECK(arena.size() == 0);
+  CHECK(arena.alloc(8) != nullptr);
+}
+
+TEST(publish_fits) {
+  mqtt_client->published.clear();
+  bool ok = publisher.publish("t/small", [](JsonBuffer& jb, JsonObject& root) {
+    root["usage"] = 1.5;
+    root["name"] = std::string("sprinkler");
+  }, 1, true);
+
+  CHECK(ok);
+  CHECK(mqtt_client->published.size() == 1);
+  CHECK(last_message().topic == "t/small");
+  CHECK(last_message().payload.find("\"sprinkler\"") != std::string::npos);
+  CHECK(last_message().qos == 1 && last_message().retain);
+}
+
+TEST(publish_arena_overflow_sends_error) {
+  mqtt_client->published.clear();
+  float overflows = stat("overflows");
+
+  bool ok = publisher.publish("t/big", [](JsonBuffer& jb, JsonObject& root) {
+    JsonArray& ja = jb.createArray();
+    for (int i = 0; i < APP_JSON_ARENA_SIZE; ++i) {
+      ja.add(i);
+    }
+    root["all"] = ja;
+  });
+
+  CHECK(!ok);
+  CHECK(mqtt_client->published.size() == 1);
+  CHECK(last_message().payload.find("json_overflow") != std::string::npos);
+  CHECK(last_message().payload.size() < APP_JSON_PAYLOAD_SIZE);
+  CHECK(stat("overflows") == overflows + 1);
+  CHECK(stat("arena_high_water") <= APP_JSON_ARENA_SIZE);
+}
+
+TEST(publish_payload_overflow_sends_error) {
+  // Kept by pointer, so small in the arena but large printed
+  static std::string text(1000, 'x');
+  mqtt_client->published.clear();
+
+  bool ok = publisher.publish("t/long", [](JsonBuffer& jb, JsonObject& root) {
+    JsonArray& ja = jb.createArray();
+    for (int i = 0; i < APP_JSON_PAYLOAD_SIZE / 1000 + 1; ++i) {
+      ja.add(text.c_str());
+    }
+    root["text"] = ja;
+  });
+
+  CHECK(!ok);
+  CHECK(last_message().payload.find("json_overflow") != std::string::npos);
+  CHECK(stat("payload_high_water") < APP_JSON_PAYLOAD_SIZE);
+}
+
+TEST(publish_skips_unchanged_with_hash) {
+  mqtt_client->published.clear();
+  uint32_t last_hash = 0;
+  int value = 1;
+  auto build = [&](JsonBuffer& jb, JsonObject& root) {
+    root["value"] = value;
+  };
+
+  publisher.publish("t/stat", build, 0, true, &last_hash);
+  publisher.publish("t/stat", build, 0, true, &last_hash);
+  CHECK(mqtt_client->published.size() == 1);
+  CHECK(last_hash == publisher.hash(build));
+
+  value = 2;
+  publisher.publish("t/stat", build, 0, true, &last_hash);
+  CHECK(mqtt_client->published.size() == 2);
+}
+
+TEST(print_and_parse) {
+  char buf[64];
+  CHECK(publisher.print([](JsonBuffer& jb, JsonObject& root) {
+    root["max"] = 5;
+    root["start"] = 23;
+  }, buf, sizeof(buf)));
+
+  int max = 0;
+  CHECK(publisher.parse(buf, [&](JsonObject& jo) {
+    max = jo["max"].as<int>();
+  }));
+  CHECK(max == 5);
+
+  char bad[] = "{\"max\": ";
+  CHECK(!publisher.parse(bad, [](JsonObject& jo) {}));
+
+  CHECK(!publisher.print([](JsonBuffer& jb, JsonObject& root) {
+    root["text"] = "longer than the buffer it is printed into, which is 64";
+  }, buf, sizeof(buf)));
+}
+
+// Publishes list in pages as dApp::publish_closed_list() does. Returns
+// the number of pages that did not fit.
+template<class L>
+static int publish_closed_list(JsonPublisher& publisher, const char* list_name, L& list,
+  int page_units) {
+  int failed = 0;
+  int count = list.get_closed_count();
+  for (int first = 0; first == 0 || first < count; first += page_units) {
+    bool ok = publisher.publish("t/closed", [&](JsonBuffer& jb, JsonObject& root) {
+      root["part"] = first / page_units;
+      root["parts"] = 99;
+      root["channel"] = 3;
+      root["name"] = std::string("back yard irrigation");
+      root[list_name] = list.toJson(jb, first, page_units);
+    });
+    if (!ok) {
+      ++failed;
+    }
+  }
+  return failed;
+}
+
+TEST(full_closed_pages_fit_and_do_not_grow_memory) {
+  start_clock(1600000000);
+
+  static WaterUsagePeriodList hourly;
+  hourly.set_max_closed(24 * 7);
+  for (int i = 0; i < 24 * 7 + 1; ++i) {
+    hourly.addUsage(12.345678f);
+    tick(3600 * 1000);
+    hourly.next();
+  }
+  CHECK(hourly.get_closed_count() == 24 * 7);
+
+  static FlowConfig config;
+  static WaterUsageSessionList sessions(config);
+  sessions.set_max_closed(1000);
+  CHECK(sessions.get_max_closed() == APP_MAX_CLOSED_SESSIONS);
+  for (int i = 0; i < APP_MAX_CLOSED_SESSIONS + 1; ++i) {
+    // Steps between two flows, two samples each, make a zone each
+    for (int zone = 0; zone < APP_MAX_SESSION_ZONES + 2; ++zone) {
+      for (int sample = 0; sample < 2; ++sample) {
+        tick(2000);
+        sessions.addUsage(0.25f, zone % 2 ? 8.0f : 3.0f);
+      }
+    }
+    tick(60000);
+    sessions.addUsage(0, 0);
+  }
+  CHECK(sessions.get_closed_count() == APP_MAX_CLOSED_SESSIONS);
+  CHECK(sessions.getLastClosed().zone_count == APP_MAX_SESSION_ZONES);
+
+  static WaterUsageNamedList named;
+  named.set_max_closed(24);
+  for (int i = 0; i < 25; ++i) {
+    named.add_closed_unit("a named usage of some length " + to_string(i), app_clock.now(), 600, 1.25f);
+  }
+
+  // Its own, for high water marks of these pages only
+  static JsonPublisher pages;
+  auto publish_all = [&]() {
+    int failed = publish_closed_list(pages, "hourly", hourly, APP_CLOSED_PAGE_UNITS)
+      + publish_closed_list(pages, "sessions", sessions, APP_CLOSED_PAGE_SESSIONS);
+    bool ok = pages.publish("t/closed", [&](JsonBuffer& jb, JsonObject& root) {
+      root["named"] = named.toJson(jb);
+    });
+    return ok ? failed : failed + 1;
+  };
+
+  CHECK(publish_all() == 0);
+
+  float arena_high_water = stat("arena_high_water", pages);
+  float payload_high_water = stat("payload_high_water", pages);
+  CHECK(stat("overflows", pages) == 0);
+  AllocStats lists = app_metrics.alloc.subsystems[int(AllocSubsystem::usage_lists)];
+  AllocStats names = app_metrics.alloc.subsystems[int(AllocSubsystem::usage_names)];
+
+  for (int i = 0; i < 100; ++i) {
+    mqtt_client->published.clear();
+    CHECK(publish_all() == 0);
+  }
+
+  CHECK(stat("arena_high_water", pages) == arena_high_water);
+  CHECK(stat("payload_high_water", pages) == payload_high_water);
+  const AllocStats& lists_after = app_metrics.alloc.subsystems[int(AllocSubsystem::usage_lists)];
+  const AllocStats& names_after = app_metrics.alloc.subsystems[int(AllocSubsystem::usage_names)];
+  CHECK(lists_after.bytes == lists.bytes && lists_after.allocs == lists.allocs);
+  CHECK(names_after.bytes == names.bytes);
+
+  printf("closed pages: arena high water %.0f of %i, payload %.0f of %i\n",
+    arena_high_water, APP_JSON_ARENA_SIZE, payload_high_water, APP_JSON_PAYLOAD_SIZE);
+}
@@ -0,0 +1,279 @@
+// Copyright 2020 Brenton Olander
+#include <map>
+
+#include "check.h"
+#include "esphome.h"
+#include "app_defs.h"
+#include "translation_unit.h"
+#include "signature.h"
+#include "known_loads.h"
+#include "flow_trace.h"
+
+////////////////////////////////////////////////////////
+// Disaggregation evaluation over labeled overlapping
+// events: what dApp::disaggregate() does per sample,
+// KnownLoads::split() then signature matching on the
+// rest, against the same matching on the total flow.
+//
+// Each scenario is a set of labeled events, each a
+// steady flow with 2% noise. The known loads come with
+// their allowance (upm) and named usage ("cns") for as
+// long as they run, the others are to be found by the
+// signatures. Scored per appliance:
+//
+//  recall     - its events matched, within 3 secs of
+//               their end
+//  false      - matches that are none of its events
+//  attributed - for a known load, its named usage over
+//               the flow it really used
+////////////////////////////////////////////////////////
+
+static const char* signatures_json =
+  "[{\"name\":\"Toilet flush\",\"segments\":[[2.5,1.5,30,60]]},"
+  "{\"name\":\"Shower\",\"segments\":[[1.5,1,300,900]]}]";
+
+static const int match_within = 3;
+
+struct Event {
+  std::string name;
+  int start;
+  int secs;
+  float upm;
+  // An allowance with a upm and its named usage while it runs
+  bool known;
+};
+
+struct Scenario {
+  const char* name;
+  int secs;
+  std::vector<Event> events;
+};
+
+struct ApplianceScore {
+  int events = 0;
+  int matched = 0;
+  int false_matches = 0;
+  bool known = false;
+  float used = 0;
+  float attributed = 0;
+};
+
+typedef std::map<std::string, ApplianceScore> Scores;
+
+// Clock at epoch, then advanced by each tick()
+static void start_clock(time_t epoch) {
+  host_env::millis_now = 1000;
+  app_clock = AppClock();
+  app_clock.sync(epoch);
+}
+
+static void tick(uint32_t ms) {
+  host_env::millis_now += ms;
+  app_clock.snapshot();
+}
+
+// Runs the scenario a sample a second. disaggregate false matches the
+// signatures against the total flow and adds it all to every named
+// usage, as before disaggregation.
+// upm_error is added to every known load's declared upm.
+static Scores run(const Scenario& scenario, bool disaggregate, float upm_error=0) {
+  start_clock(1600000000);
+  TranslationManager xlate;
+  SignatureManager signatures(xlate);
+  DynamicJsonBuffer jb;
+  std::string json = signatures_json;
+  signatures.fromJson(jb.parseArray(&json[0]));
+  WaterUsageNamedList named;
+  named.set_max_closed(24);
+  SpecificAllowances allowances;
+  TraceRandom random(17);
+
+  Scores scores;
+  // Match times by name
+  std::map<std::string, std::vector<int>> matches;
+
+  for (int t = 0; t < scenario.secs; ++t) {
+    float upm = 0;
+    for (const Event& event : scenario.events) {
+      ApplianceScore& score = scores[event.name];
+      score.known = event.known;
+      if (event.known && t == event.start) {
+        allowances.add_item(event.name, event.upm + upm_error, 0, 0, true);
+        named.add_usage_unit(event.name, 0);
+      }
+      if (event.known && t == event.start + event.secs) {
+        allowances.delete_item(event.name);
+        named.delete_usage_unit(event.name);
+        score.attributed += named.getLastClosed().usage;
+      }
+      if (t >= event.start && t < event.start + event.secs) {
+        float event_upm = event.upm * (1 + 0.02f * random.gaussian());
+        score.used += event_upm / 60;
+        upm += event_upm;
+      }
+    }
+
+    float rest_upm = upm;
+    if (disaggregate) {
+      rest_upm = KnownLoads::split(upm, 1, allowances, named);
+    } else {
+      // Every named usage gets all of it
+      named.addUsage(upm / 60);
+    }
+    signatures.is_match(rest_upm, 1, [&](Signature& signature) {
+      if (!signature.is(Signature::built_in)) {
+        matches[signature.get_name()].push_back(t);
+      }
+    });
+    tick(1000);
+  }
+
+  for (auto& it : matches) {
+    ApplianceScore& score = scores[it.first];
+    for (int t : it.second) {
+      bool matched = false;
+      for (const Event& event : scenario.events) {
+        int end = event.start + event.secs;
+        if (event.name == it.first && t >= end && t <= end + match_within) {
+          matched = true;
+        }
+      }
+      if (matched) {
+        ++score.matched;
+      } else {
+        ++score.false_matches;
+      }
+    }
+  }
+  for (const Event& event : scenario.events) {
+    ++scores[event.name].events;
+  }
+  return scores;
+}
+
+// In the middle of its signature's segment, 2.5 to 4
+static Event flush(int start) {
+  return {"Toilet flush", start, 45, 3.25f, false};
+}
+
+static std::vector<Scenario> scenarios() {
+  std::vector<Scenario> all;
+
+  Scenario alone = {"flushes alone", 3600, {}};
+  for (int i = 0; i < 6; ++i) {
+    alone.events.push_back(flush(300 + i * 500));
+  }
+  all.push_back(alone);
+
+  Scenario irrigation = {"flushes during irrigation", 4200,
+    {{"irrigation", 300, 3600, 8.0f, true}}};
+  for (int i = 0; i < 6; ++i) {
+    irrigation.events.push_back(flush(400 + i * 550 + i * 37));
+  }
+  all.push_back(irrigation);
+
+  // The washer fills within the irrigation, a flush during both
+  Scenario two = {"irrigation and washer", 4200,
+    {{"irrigation", 300, 3600, 8.0f, true}, {"washer", 1000, 900, 4.0f, true}}};
+  two.events.push_back(flush(500));
+  two.events.push_back(flush(1200));
+  two.events.push_back(flush(1700));
+  two.events.push_back(flush(2500));
+  all.push_back(two);
+
+  // Not a known load: the flush is lost in the shower either way
+  Scenario shower = {"flush during shower", 1200,
+    {{"Shower", 100, 480, 2.0f, false}, flush(300)}};
+  all.push_back(shower);
+
+  return all;
+}
+
+static void print(const char* scenario, const char* how, const Scores& scores) {
+  for (const auto& it : scores) {
+    const ApplianceScore& s = it.second;
+    if (s.known) {
+      printf("  %-26s %-6s %-13s attributed %6.2f of %6.2f (%+.2f%%)\n", scenario, how,
+        it.first.c_str(), s.attributed, s.used, 100 * (s.attributed - s.used) / s.used);
+    } else {
+      printf("  %-26s %-6s %-13s matched %i of %i, %i false\n", scenario, how, it.first.c_str(),
+        s.matched, s.events, s.false_matches);
+    }
+  }
+}
+
+TEST(overlapping_events) {
+  std::vector<Scenario> all = scenarios();
+  std::vector<Scores> before;
+  std::vector<Scores> after;
+  for (const Scenario& scenario : all) {
+    before.push_back(run(scenario, false));
+    after.push_back(run(scenario, true));
+    print(scenario.name, "total", before.back());
+    print(scenario.name, "rest", after.back());
+  }
+
+  // Alone, either way finds every flush
+  CHECK(before[0]["Toilet flush"].matched == 6 && after[0]["Toilet flush"].matched == 6);
+  // On top of known loads only the rest finds them
+  for (int i = 1; i <= 2; ++i) {
+    ApplianceScore& flushes = after[i]["Toilet flush"];
+    CHECK(before[i]["Toilet flush"].matched == 0);
+    CHECK(flushes.matched == flushes.events);
+    CHECK(flushes.false_matches == 0);
+  }
+  // A known load gets its own usage, within the noise, not the others'
+  for (const char* load : {"irrigation", "washer"}) {
+    const ApplianceScore& s = after[2][load];
+    CHECK_NEAR(s.attributed, s.used, s.used * 0.01);
+    CHECK(before[2][load].attributed > s.used * 1.05);
+  }
+  CHECK_NEAR(after[1]["irrigation"].attributed, after[1]["irrigation"].used,
+    after[1]["irrigation"].used * 0.01);
+  // The shower is found, the flush in it is not
+  CHECK(after[3]["Shower"].matched == 1);
+  CHECK(after[3]["Toilet flush"].matched == 0);
+}
+
+// How far a known load's declared upm may be off: the flush is found
+// while the rest, noise included, stays within its signature's segment,
+// 0.75 either side of the flush
+TEST(declared_upm_error) {
+  Scenario irrigation = scenarios()[1];
+  printf("  irrigation declared off by  flushes matched\n");
+  for (float error : {-1.0f, -0.5f, -0.25f, 0.0f, 0.25f, 0.5f, 1.0f}) {
+    Scores scores = run(irrigation, true, error);
+    const ApplianceScore& flushes = scores["Toilet flush"];
+    printf("  %+26.2f  %i of %i, %i false\n", error, flushes.matched, flushes.events,
+      flushes.false_matches);
+    if (fabsf(error) <= 0.25f) {
+      CHECK(flushes.matched == flushes.events);
+    }
+    if (fabsf(error) >= 1.0f) {
+      CHECK(flushes.matched == 0);
+    }
+  }
+}
+
+TEST(known_loads_cannot_exceed_the_flow) {
+  start_clock(1600000000);
+  WaterUsageNamedList named;
+  named.set_max_closed(8);
+  SpecificAllowances allowances;
+  allowances.add_item("irrigation", 8, 0, 0, true);
+  allowances.add_item("washer", 4, 0, 0, true);
+  named.add_usage_unit("irrigation", 0);
+  named.add_usage_unit("washer", 0);
+  named.add_usage_unit("other", 0);
+
+  // Half the declared flow: both scaled down, nothing left
+  CHECK(KnownLoads::split(6, 60, allowances, named) == 0);
+  CHECK_NEAR(named.findActive("irrigation")->usage, 4, 1e-4);
+  CHECK_NEAR(named.findActive("washer")->usage, 2, 1e-4);
+  CHECK(named.findActive("other")->usage == 0);
+
+  // More than declared: the rest goes to the others
+  CHECK_NEAR(KnownLoads::split(15, 60, allowances, named), 3, 1e-4);
+  CHECK_NEAR(named.findActive("irrigation")->usage, 12, 1e-4);
+  CHECK_NEAR(named.findActive("other")->usage, 3, 1e-4);
+}
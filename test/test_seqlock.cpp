@@ -0,0 +1,207 @@
+// Copyright 2020 Brenton Olander
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "seqlock.h"
+#include "spsc_queue.h"
+#include "usage_snapshot.h"
+
+////////////////////////////////////////////////////////
+// Seqlock and SpscQueue stress: real threads, on as
+// many cores as the host has.
+//
+// The writer publishes UsageSnapshots whose every field
+// is derived from a write number, so a reader can tell a
+// torn copy, some fields from one write and some from
+// another, from a consistent one. Readers must never
+// keep a torn copy, must see the writes in order, and
+// must not slow the writer down much: it never waits for
+// them.
+//
+// The queue carries a numbered sequence from a producer
+// to a consumer, which must get every item once and in
+// order through a small queue that is often full.
+////////////////////////////////////////////////////////
+
+static const int readers = 3;
+static const auto run_time = std::chrono::milliseconds(300);
+
+// Every field from n, padding included (memset), as the Seqlock copies it
+static void fill(UsageSnapshot& s, uint32_t n) {
+  memset(&s, 0, sizeof(s));
+  s.time = n;
+  s.channel_count = n % 7;
+  s.valve_open = n & 1;
+  for (int c = 0; c < APP_MAX_FLOW_CHANNELS; ++c) {
+    UsageSnapshot::Channel& ch = s.channels[c];
+    // Exact in a float below 2^24
+    float f = float((n + c) & 0xfffff);
+    ch.upm = f;
+    ch.current_usage = f + 1;
+    ch.hourly_usage = f + 2;
+    ch.daily_usage = f + 3;
+    ch.session_active = (n + c) & 1;
+    ch.session_start_time = n + c;
+    ch.session_usage = f + 4;
+    ch.session_zones = (n + c) % 16;
+    ch.over_limit = (n + c) & 2;
+    ch.hourly_closed = n + c;
+    ch.daily_closed = n + c + 1;
+    ch.sessions_closed = n + c + 2;
+    ch.last_hour = {time_t(n), int(n), f};
+    ch.last_day = {time_t(n + 1), int(n + 1), f + 1};
+    ch.last_session = {time_t(n + 2), int(n + 2), f + 2};
+  }
+}
+
+static bool consistent(const UsageSnapshot& s) {
+  UsageSnapshot expected;
+  fill(expected, uint32_t(s.time));
+  return memcmp(&s, &expected, sizeof(s)) == 0;
+}
+
+struct ReaderStats {
+  uint64_t reads = 0;
+  uint64_t torn = 0;
+  uint64_t out_of_order = 0;
+  uint64_t failed_tries = 0;
+};
+
+// Writes as fast as it can for run_time with the readers given reading
+// all along. Returns the writes a second.
+static double run(Seqlock<UsageSnapshot>& lock, int reader_count,
+  std::vector<ReaderStats>& stats) {
+  std::atomic<bool> done{false};
+  stats.assign(reader_count, ReaderStats());
+  // Write 0, so no reader sees the zeroed initial data
+  UsageSnapshot s;
+  fill(s, 0);
+  lock.write(s);
+  uint32_t writes = 0;
+
+  std::vector<std::thread> threads;
+  for (int r = 0; r < reader_count; ++r) {
+    threads.emplace_back([&, r]() {
+      ReaderStats& st = stats[r];
+      UsageSnapshot s;
+      time_t last = 0;
+      while (!done.load(std::memory_order_relaxed)) {
+        // Both ways in: try_read() as a poller would, read() as a waiter
+        if (st.reads % 2) {
+          if (!lock.try_read(s)) {
+            ++st.failed_tries;
+            continue;
+          }
+        } else {
+          lock.read(s);
+        }
+        ++st.reads;
+        if (!consistent(s)) {
+          ++st.torn;
+        }
+        if (s.time < last) {
+          ++st.out_of_order;
+        }
+        last = s.time;
+      }
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto now = start;
+  while (now - start < run_time) {
+    // A sample every so often would be realistic, but as fast as
+    // possible gives the readers the most chances to tear
+    for (int i = 0; i < 64; ++i) {
+      fill(s, ++writes);
+      lock.write(s);
+    }
+    now = std::chrono::steady_clock::now();
+  }
+  done = true;
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  CHECK(lock.version() == writes + 1);
+  return writes / std::chrono::duration<double>(now - start).count();
+}
+
+TEST(seqlock_readers_never_keep_a_torn_copy) {
+  static Seqlock<UsageSnapshot> alone;
+  std::vector<ReaderStats> stats;
+  double alone_rate = run(alone, 0, stats);
+
+  static Seqlock<UsageSnapshot> lock;
+  double rate = run(lock, readers, stats);
+
+  ReaderStats total;
+  for (const ReaderStats& st : stats) {
+    CHECK(st.reads > 0);
+    total.reads += st.reads;
+    total.torn += st.torn;
+    total.out_of_order += st.out_of_order;
+    total.failed_tries += st.failed_tries;
+  }
+
+  printf("%u cores, %i readers: %.2fM writes a second (%.2fM alone), %.2fM reads, "
+    "%.2fM tries failed on a write in progress\n", std::thread::hardware_concurrency(),
+    readers, rate / 1e6, alone_rate / 1e6, total.reads / 1e6, total.failed_tries / 1e6);
+
+  CHECK(total.torn == 0);
+  CHECK(total.out_of_order == 0);
+  // The readers share the writer's cache lines, which costs it, but it
+  // never waits for them
+  CHECK(rate > alone_rate / 20);
+}
+
+TEST(spsc_queue_delivers_every_item_in_order) {
+  static SpscQueue<uint32_t, 16> queue;
+  const uint32_t items = 2000000;
+  uint32_t full = 0;
+
+  std::thread consumer([&]() {
+    uint32_t expected = 0;
+    uint32_t wrong = 0;
+    uint32_t item;
+    while (expected < items) {
+      if (queue.pop(item)) {
+        if (item != expected) {
+          ++wrong;
+        }
+        ++expected;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    CHECK(wrong == 0);
+  });
+
+  for (uint32_t i = 0; i < items;) {
+    if (queue.push(i)) {
+      ++i;
+    } else {
+      ++full;
+      std::this_thread::yield();
+    }
+  }
+  consumer.join();
+
+  CHECK(queue.empty());
+  printf("%u items through a queue of 15, found full %u times\n", items, full);
+}
+
+TEST(spsc_queue_holds_n_less_one) {
+  SpscQueue<int, 4> queue;
+  CHECK(queue.push(1) && queue.push(2) && queue.push(3));
+  CHECK(!queue.push(4));
+  int item = 0;
+  CHECK(queue.pop(item) && item == 1);
+  CHECK(queue.push(4));
+  for (int expected = 2; expected <= 4; ++expected) {
+    CHECK(queue.pop(item) && item == expected);
+  }
+  CHECK(!queue.pop(item) && queue.empty());
+}
@@ -0,0 +1,123 @@
+// Copyright 2020 Brenton Olander
+#include "check.h"
+#include "esphome.h"
+#include "app_defs.h"
+#include "tick_budget.h"
+
+////////////////////////////////////////////////////////
+// TickBudget: the optional work is shed in order, one
+// level per hold_ms at most, restored one level per
+// recover_ms without an overrun, and counted.
+////////////////////////////////////////////////////////
+
+// A sample every second for secs, each taking us, asking for every kind
+// of optional work as dApp does. Returns the level changes.
+static int run(TickBudget& budget, uint32_t& now_ms, int secs, uint32_t us) {
+  int changes = 0;
+  for (int i = 0; i < secs; ++i) {
+    now_ms += 1000;
+    budget.allows(TickBudget::no_display);
+    budget.allows(TickBudget::no_signatures);
+    budget.allows(TickBudget::no_zones);
+    changes += budget.record(us, now_ms);
+  }
+  return changes;
+}
+
+TEST(sheds_in_order_one_level_per_hold) {
+  TickBudget budget;
+  uint32_t now_ms = 100000;
+  const uint32_t over = budget.budget_us + 1;
+
+  CHECK(run(budget, now_ms, 60, budget.budget_us / 10) == 0);
+  CHECK(budget.level == TickBudget::full);
+
+  // Display first
+  CHECK(run(budget, now_ms, 1, over) == 1);
+  CHECK(budget.level == TickBudget::no_display);
+  CHECK(!budget.allows(TickBudget::no_display));
+  CHECK(budget.allows(TickBudget::no_signatures));
+  CHECK(budget.allows(TickBudget::no_zones));
+
+  // Overruns within hold_ms shed nothing more
+  CHECK(run(budget, now_ms, budget.hold_ms / 1000 - 1, over) == 0);
+  CHECK(budget.level == TickBudget::no_display);
+
+  // Then signatures, then zones, and nothing past zones
+  CHECK(run(budget, now_ms, 1, over) == 1);
+  CHECK(budget.level == TickBudget::no_signatures);
+  CHECK(!budget.allows(TickBudget::no_signatures));
+  CHECK(budget.allows(TickBudget::no_zones));
+  run(budget, now_ms, 600, over);
+  CHECK(budget.level == TickBudget::no_zones);
+  CHECK(!budget.allows(TickBudget::no_zones));
+  CHECK(budget.degrades == 3);
+}
+
+TEST(restores_one_level_per_recover) {
+  TickBudget budget;
+  uint32_t now_ms = 100000;
+  run(budget, now_ms, 20, budget.budget_us * 2);
+  CHECK(budget.level == TickBudget::no_zones);
+
+  // Not before recover_ms without an overrun
+  int recover_secs = budget.recover_ms / 1000;
+  CHECK(run(budget, now_ms, recover_secs - 1, 1000) == 0);
+  CHECK(run(budget, now_ms, 1, 1000) == 1);
+  CHECK(budget.level == TickBudget::no_signatures);
+
+  // One overrun holds the restoring off for another recover_ms
+  run(budget, now_ms, recover_secs / 2, 1000);
+  run(budget, now_ms, 1, budget.budget_us * 2);
+  CHECK(budget.level == TickBudget::no_zones);
+  CHECK(run(budget, now_ms, recover_secs - 1, 1000) == 0);
+
+  run(budget, now_ms, 3 * recover_secs + 1, 1000);
+  CHECK(budget.level == TickBudget::full);
+}
+
+TEST(a_one_off_sheds_the_display_only) {
+  TickBudget budget;
+  uint32_t now_ms = 100000;
+  run(budget, now_ms, 1, budget.budget_us * 10);
+  run(budget, now_ms, budget.recover_ms / 1000, 1000);
+  CHECK(budget.level == TickBudget::full);
+  CHECK(budget.degrades == 1);
+  CHECK(budget.overruns == 1);
+  CHECK(budget.max_us == budget.budget_us * 10);
+}
+
+TEST(counts_shed_work_and_reports) {
+  TickBudget budget;
+  uint32_t now_ms = 100000;
+  // no_display for hold_ms, no_signatures for hold_ms, then no_zones
+  int hold_secs = budget.hold_ms / 1000;
+  run(budget, now_ms, 2 * hold_secs + 10, budget.budget_us * 2);
+  CHECK(budget.level == TickBudget::no_zones);
+  CHECK(budget.shed[TickBudget::no_display] == uint32_t(2 * hold_secs + 10 - 1));
+  CHECK(budget.shed[TickBudget::no_signatures] == uint32_t(hold_secs + 10 - 1));
+  CHECK(budget.shed[TickBudget::no_zones] == uint32_t(10 - 1));
+
+  DynamicJsonBuffer jb;
+  JsonObject& jo = budget.toJson(jb);
+  CHECK(jo["level"].as<int>() == TickBudget::no_zones);
+  CHECK(jo["overruns"].as<int>() == 2 * hold_secs + 10);
+  JsonArray& shed = jo["shed"];
+  CHECK(shed.size() == 3);
+  CHECK(shed[2].as<int>() == 10 - 1);
+}
+
+TEST(timer_records_the_scope) {
+  TickBudget budget;
+  budget.budget_us = 1000;
+  host_env::millis_now = 100000;
+  {
+    TickBudgetTimer timer(budget);
+    uint32_t start = micros();
+    while (micros() - start < 2000) {
+    }
+  }
+  CHECK(budget.overruns == 1);
+  CHECK(budget.max_us >= 2000);
+  CHECK(budget.level == TickBudget::no_display);
+}
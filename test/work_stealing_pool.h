@@ -0,0 +1,99 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////
+// WorkStealingPool: runs independent tasks on a thread
+// each, one thread a core by default
+//
+// The tasks are dealt round robin to the threads' own
+// queues. A thread takes from the front of its own and,
+// once that is empty, from the back of another's, so
+// uneven tasks (a long trace, a device with many
+// events) still keep every core busy to the end. A
+// task runs start to end on one thread, so what it
+// keeps in thread_local state (the app's globals on the
+// host) is its own.
+////////////////////////////////////////////////////////
+
+class WorkStealingPool {
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  int threads_;
+
+  // Takes from the front of worker's queue, or steals from its back
+  static bool take(Worker& worker, bool steal, std::function<void()>& task) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) {
+      return false;
+    }
+    if (steal) {
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    } else {
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    }
+    return true;
+  }
+
+  public:
+  // Tasks taken from another thread's queue in the last run()
+  uint64_t steals = 0;
+
+  explicit WorkStealingPool(int threads = 0):
+    threads_(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+  }
+
+  int threads() const { return threads_; }
+
+  // Runs every task and returns when all are done
+  void run(std::vector<std::function<void()>>& tasks) {
+    std::vector<Worker> workers(threads_);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      workers[i % threads_].tasks.push_back(std::move(tasks[i]));
+    }
+    tasks.clear();
+
+    std::atomic<uint64_t> stolen{0};
+    auto work = [&](int self) {
+      std::function<void()> task;
+      for (;;) {
+        if (take(workers[self], false, task)) {
+          task();
+          continue;
+        }
+        // Nothing is queued after the start, so all empty is done
+        bool found = false;
+        for (int i = 1; i < threads_ && !found; ++i) {
+          found = take(workers[(self + i) % threads_], true, task);
+        }
+        if (!found) {
+          return;
+        }
+        ++stolen;
+        task();
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads_; ++i) {
+      pool.emplace_back(work, i);
+    }
+    work(0);
+    for (std::thread& thread : pool) {
+      thread.join();
+    }
+    steals = stolen;
+  }
+};
@@ -0,0 +1,112 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "app_defs.h"
+
+////////////////////////////////////////////////////////
+// TickBudget: the time a sample or tick may take, and
+// the optional work shed when it takes longer
+//
+// Each run of process_wf_on_value() and on_tick() is
+// timed. One over budget_us sheds the next level of
+// optional work, at most one level per hold_ms so a one
+// off (a big publish) does not shed everything. After
+// recover_ms without an overrun the last level shed is
+// restored. The levels, in the order shed:
+//
+//  display     - the display is not redrawn
+//  signatures  - no signature matching
+//  zones       - sessions are not split into zones
+//
+// Valve safety (the over limit policy, budgets and the
+// valve) and the accounting (the usage sums, sessions,
+// named usage) are never shed.
+////////////////////////////////////////////////////////
+
+struct TickBudget {
+  enum Level : uint8_t { full, no_display, no_signatures, no_zones, level_count };
+
+  uint32_t budget_us = APP_TICK_BUDGET_US;
+  uint32_t hold_ms = 5000;
+  uint32_t recover_ms = 60000;
+
+  Level    level = full;
+  uint32_t level_ms = 0;
+  uint32_t overrun_ms = 0;
+
+  // Metrics
+  uint32_t overruns = 0;
+  uint32_t max_us = 0;
+  uint32_t degrades = 0;
+  // Times each kind of work was skipped, by the level that sheds it
+  uint32_t shed[level_count] = {0};
+
+  // Returns true if the work shed at work_level should run now, and
+  // counts it as shed if not
+  bool allows(Level work_level) {
+    if (level >= work_level) {
+      ++shed[work_level];
+      return false;
+    }
+    return true;
+  }
+
+  // Returns true if the level changed
+  bool record(uint32_t us, uint32_t now_ms) {
+    if (us > max_us) {
+      max_us = us;
+    }
+
+    if (us > budget_us) {
+      ++overruns;
+      overrun_ms = now_ms;
+      if (level < no_zones && uint32_t(now_ms - level_ms) >= hold_ms) {
+        level = Level(level + 1);
+        level_ms = now_ms;
+        ++degrades;
+        return true;
+      }
+    } else if (level > full && uint32_t(now_ms - overrun_ms) >= recover_ms
+      && uint32_t(now_ms - level_ms) >= recover_ms) {
+      level = Level(level - 1);
+      level_ms = now_ms;
+      return true;
+    }
+
+    return false;
+  }
+
+  JsonObject& toJson(JsonBuffer& jb) const {
+    JsonObject& jo = jb.createObject();
+    jo["level"] = int(level);
+    jo["budget_us"] = budget_us;
+    jo["overruns"] = overruns;
+    jo["max_us"] = max_us;
+    jo["degrades"] = degrades;
+    // [display, signatures, zones]
+    JsonArray& ja = jb.createArray();
+    for (int i = no_display; i < level_count; ++i) {
+      ja.add(shed[i]);
+    }
+    jo["shed"] = ja;
+    return jo;
+  }
+};
+
+// Times the enclosing scope against the budget
+struct TickBudgetTimer {
+  TickBudget& budget_;
+  uint32_t start_us_;
+
+  TickBudgetTimer(TickBudget& budget):
+    budget_(budget),
+    start_us_(micros()) {
+  }
+
+  ~TickBudgetTimer() {
+    if (budget_.record(micros() - start_us_, millis())) {
+      ESP_LOGW("main", "tick budget: level %i", int(budget_.level));
+    }
+  }
+};
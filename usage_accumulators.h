@@ -0,0 +1,66 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include <functional>
+
+////////////////////////////////////////////////////////
+// UsageAccumulators: a channel's open usage sums, side
+// by side
+//
+// Every sample's usage goes to each of these. Rather
+// than a call per list, each finding its current unit
+// and checking whether it has started, the sums are one
+// float per kind in one array and add() is a single
+// loop over it that the compiler can unroll or
+// vectorize. A new kind of accumulator is a new slot,
+// not a new call on the sample path.
+//
+// The limit sums are added to apart from the others
+// (add_limits()): limits are checked on every sample as
+// it arrives, while the accounting of a sample from
+// before the clock was set waits for the clock.
+//
+// The sums are the truth for the open units. The usage
+// lists' current units are set from them (see
+// FlowChannel::settle_usage()) only on the slow path:
+// before a rollover, a publish, a read of the lists or
+// a save.
+////////////////////////////////////////////////////////
+
+struct UsageAccumulators {
+  enum Slot {
+    // The accounting, the open units' usage
+    current,
+    hourly,
+    daily,
+    // The limits, toward max_usage and the schedule's max usage
+    since_max_set,
+    since_schedule,
+    slot_count
+  };
+
+  static const int first_limit = since_max_set;
+
+  float usage[slot_count] = {0};
+
+  void add(float amount) {
+    for (int i = 0; i < first_limit; ++i) {
+      usage[i] += amount;
+    }
+  }
+
+  void add_limits(float amount) {
+    for (int i = first_limit; i < slot_count; ++i) {
+      usage[i] += amount;
+    }
+  }
+
+  float& operator[](Slot slot) { return usage[slot]; }
+  float operator[](Slot slot) const { return usage[slot]; }
+
+  void convert_uom(std::function<float(float &)>f) {
+    for (int i = 0; i < slot_count; ++i) {
+      usage[i] = f(usage[i]);
+    }
+  }
+};
@@ -0,0 +1,175 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "esphome.h"
+#include "helper.h"
+
+#define APP_MAX_USAGE_BUDGETS 4
+
+////////////////////////////////////////////////////////
+// UsageBudget: a limit on water used over a window
+//
+// Either a daily window of local hours ("no more than
+// 5 gal between 23:00 and 06:00") or a rolling window of
+// the last n hours ("no more than 200 gal in any 24
+// hours"). Sums are kept incrementally: a sample adds to
+// the current hour and the hourly rollover moves that
+// hour into the window, and for a rolling window takes
+// the hour falling out of it back off, using a ring of
+// hourly sums. Nothing is rescanned.
+////////////////////////////////////////////////////////
+
+struct UsageBudget {
+  static const int max_hours = 24;
+
+  int channel = 0;
+  float max_usage = -1;
+  // Daily window: local hours, end exclusive. -1 for a rolling window.
+  int start_hour = -1;
+  int end_hour = -1;
+  // Rolling window length in hours
+  int hours = 24;
+
+  // Usage in the closed hours of the window and in the current hour
+  float window_usage = 0;
+  float hour_usage = 0;
+  // Rolling windows only: the last <hours> closed hourly sums
+  float ring[max_hours] = {0};
+  int ring_next = 0;
+
+  bool active = false;
+  bool over = false;
+  // A daily window set before the local hour was known
+  bool waiting = false;
+
+  bool is_rolling() const { return start_hour < 0; }
+
+  bool in_window(int hour) const {
+    if (is_rolling()) {
+      return true;
+    }
+    return start_hour <= end_hour
+      ? hour >= start_hour && hour < end_hour
+      : hour >= start_hour || hour < end_hour;
+  }
+
+  void reset() {
+    window_usage = 0;
+    hour_usage = 0;
+    for (float& usage : ring) {
+      usage = 0;
+    }
+    ring_next = 0;
+    over = false;
+  }
+
+  // hour is the current local hour or -1 if time is not known yet. A
+  // rolling window needs no clock, a daily one waits for set_hour().
+  void start(int hour) {
+    reset();
+    waiting = hour < 0 && !is_rolling();
+    active = is_rolling() || (hour >= 0 && in_window(hour));
+  }
+
+  // Called when the local hour becomes known
+  void set_hour(int hour) {
+    if (waiting) {
+      start(hour);
+    }
+  }
+
+  // True if b sums usage over the same window, whatever its max
+  bool same_window(const UsageBudget& b) const {
+    return channel == b.channel && start_hour == b.start_hour 
+      && end_hour == b.end_hour && (!is_rolling() || hours == b.hours);
+  }
+
+  // Carries on from the sums of b, a budget over the same window
+  void continue_from(const UsageBudget& b) {
+    window_usage = b.window_usage;
+    hour_usage = b.hour_usage;
+    for (int i = 0; i < max_hours; ++i) {
+      ring[i] = b.ring[i];
+    }
+    ring_next = b.ring_next;
+    active = b.active;
+    waiting = b.waiting;
+    over = active && window_usage + hour_usage > max_usage;
+  }
+
+  // Returns true when over budget
+  bool add(float usage) {
+    if (active) {
+      hour_usage += usage;
+      over = window_usage + hour_usage > max_usage;
+    }
+    return over;
+  }
+
+  // Called on the hourly rollover with the new local hour
+  void next_hour(int hour) {
+    if (is_rolling()) {
+      window_usage += hour_usage - ring[ring_next];
+      if (window_usage < 0) {
+        // float rounding
+        window_usage = 0;
+      }
+      ring[ring_next] = hour_usage;
+      ring_next = (ring_next + 1) % hours;
+      hour_usage = 0;
+      active = true;
+      over = window_usage > max_usage;
+      return;
+    }
+
+    bool was_active = active;
+    active = in_window(hour);
+    waiting = false;
+
+    if (active && was_active) {
+      window_usage += hour_usage;
+      hour_usage = 0;
+    } else {
+      // A window starts or ends, or we are outside of one
+      reset();
+    }
+  }
+
+  void convert_uom(std::function<float(float &)>f) {
+    max_usage = f(max_usage);
+    window_usage = f(window_usage);
+    hour_usage = f(hour_usage);
+    for (float& usage : ring) {
+      usage = f(usage);
+    }
+  }
+
+  JsonObject& toJson(JsonBuffer& jb) const {
+    JsonObject& jo = jb.createObject();
+    jo["channel"] = channel;
+    jo["max"] = max_usage;
+    if (is_rolling()) {
+      jo["hours"] = hours;
+    } else {
+      jo["start"] = start_hour;
+      jo["end"] = end_hour;
+    }
+    return jo;
+  }
+
+  // Returns false if jo does not describe a budget
+  bool fromJson(const JsonObject& jo) {
+    channel = getInt(jo, "channel", 0);
+    max_usage = getFloat(jo, "max", -1);
+    start_hour = getInt(jo, "start", -1);
+    end_hour = getInt(jo, "end", -1);
+    hours = getInt(jo, "hours", 24);
+
+    if (start_hour < 0 || end_hour < 0) {
+      start_hour = end_hour = -1;
+    }
+
+    return max_usage >= 0 && channel >= 0 && start_hour < 24 && end_hour < 24 
+      && hours > 0 && hours <= max_hours;
+  }
+};
@@ -0,0 +1,61 @@
+// Copyright 2020 Brenton Olander
+#pragma once
+
+#include "app_defs.h"
+#include <time.h>
+
+////////////////////////////////////////////////////////
+// UsageSnapshot: the usage counters as of the last
+// sample, for readers outside the sample path
+//
+// dApp writes one after every sample and hourly rollover
+// through a Seqlock (see dApp::read_usage()), so a reader
+// on another task or core, e.g., a web server, gets the
+// counters of all channels as of one instant without
+// locking them against the sample path.
+//
+// The closed lists are too big to copy per sample, so
+// only their counts and most recent entries are here.
+// Whole lists are for readers on the loop task
+// (get_closed()).
+////////////////////////////////////////////////////////
+
+struct UsageSnapshot {
+  struct Closed {
+    time_t  start_time;
+    int     seconds;
+    float   usage;
+  };
+
+  struct Channel {
+    float   upm;
+    float   current_usage;
+    float   hourly_usage;
+    float   daily_usage;
+    bool    session_active;
+    time_t  session_start_time;
+    float   session_usage;
+    int     session_zones;
+    bool    over_limit;
+
+    int     hourly_closed;
+    int     daily_closed;
+    int     sessions_closed;
+    Closed  last_hour;
+    Closed  last_day;
+    Closed  last_session;
+  };
+
+  // app_clock time of the sample
+  time_t  time;
+  int     channel_count;
+  bool    valve_open;
+  Channel channels[APP_MAX_FLOW_CHANNELS];
+
+  template<class U>
+  static void set_closed(Closed& closed, const U& unit) {
+    closed.start_time = unit.start_time;
+    closed.seconds = unit.seconds;
+    closed.usage = unit.usage;
+  }
+};
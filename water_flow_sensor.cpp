@@ -1,5 +1,27 @@
 #include "water_flow_sensor.h"
 
+WaterflowSensor* WaterflowSensor::sensors_[APP_MAX_FLOW_CHANNELS];
+int WaterflowSensor::sensor_count_ = 0;
+GPIOPin* WaterflowSensor::valve_open_pin_ = nullptr;
+GPIOPin* WaterflowSensor::valve_close_pin_ = nullptr;
+
+#ifdef APP_ACQUISITION_TASK
+TaskHandle_t WaterflowSensor::task_ = nullptr;
+
+// Reads every sensor each update interval, on time whatever the loop task
+// is doing: it runs above the loop task's priority and only waits on
+// vTaskDelayUntil(). The network stack runs on the other core.
+void WaterflowSensor::acquisition_task(void* arg) {
+    WaterflowSensor* lead = static_cast<WaterflowSensor*>(arg);
+    TickType_t wake = xTaskGetTickCount();
+
+    for (;;) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(uint32_t(lead->update_interval_secs_ * 1000)));
+        lead->read_sensors();
+    }
+}
+#endif
+
 
 // char const *string22 = R"someToken({
 //   "name": "software rendering list",
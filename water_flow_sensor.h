@@ -5,12 +5,14 @@
 using namespace esphome;
 using namespace sensor;
 using namespace pulse_counter;
+#include "app_defs.h"
 #include "translation_unit.h"
 #include "signature.h"
+#include "flow_change_detector.h"
+#include "over_limit_policy.h"
+#include "spsc_queue.h"
+#include "edge_capture.h"
 
-// This is the units per minute water flow value when presumably there is no water flow.
-// If the plumbing system is working correctly this should be zero.
-extern pulse_counter::pulse_counter_t* g_pulses_base;
 
 
 
@@ -22,6 +24,7 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
     bool in_wf_on_mode_ = false;
 
     int pin_;
+    int channel_;
     TranslationManager& xlate_mgr_;
     SignatureManager signature_mgr_;
 
@@ -30,7 +33,8 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
 
 
     // We get updates every <update_interval_default> but report at
-    // schedule below when we are in wf_off mode
+    // schedule below when we are in wf_off mode. These are the values
+    // in use where the pulses are read, see settings_.
     float report_period_wf_off_mode_secs_ = report_period_wf_off_mode_secs_default_; 
     float report_period_wf_on_mode_secs_ = report_period_wf_on_mode_secs_default_; 
 
@@ -38,11 +42,12 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
 
     float update_interval_secs_ = update_interval_secs_default_; 
 
+    pulse_counter_t pulses_base_ = 0;
+
     struct ReportPeriod {
 
         pulse_counter_t pulses_total_ = 0.0f;
         int secs_ = 0;
-        int last_report_period_secs_ = 0.0f;
         bool report_only_on_change = false;
         
         // Special to report on next add call
@@ -51,12 +56,8 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
         // user can see something when we start.
         bool report_on_next_add = false;
 
-        static const int wf_is_changed_delta_ = 10;
-
         int report_period_secs_;
 
-        pulse_counter_t last_pulses_ = -1;
-
         ReportPeriod(int report_period_secs):
             report_period_secs_(report_period_secs) {
             reset();
@@ -70,26 +71,25 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
             return report_period_secs_;
         }
 
-        int get_last_report_period_secs() const {
-            return last_report_period_secs_;
+        int get_secs() const {
+            return secs_;
         }
 
         bool is_report_only_on_change() const { return report_period_secs_ == 0; }
 
-        bool add(pulse_counter_t pulses, int secs) {
+        // level_changed: the flow change detector saw a new flow level,
+        // which is always reported right away
+        bool add(pulse_counter_t pulses, int secs, bool level_changed) {
             pulses_total_ += pulses;
             secs_ += secs;
-            bool change_of_pulses = abs(last_pulses_ - pulses) > wf_is_changed_delta_;
-            last_pulses_ = pulses;
 
             // ESP_LOGD("main", "report_period.add(%i) pulses_total=%i, secs total=%i"
-            //     ", last_pulses=%i, change=%i, report_on_change=%i"
+            //     ", change=%i, report_on_change=%i"
             //     ", report_period_secs=%i", 
-            //     pulses, pulses_total_, secs_ , last_pulses_,  change_of_pulses,
+            //     pulses, pulses_total_, secs_ , level_changed,
             //     is_report_only_on_change(), report_period_secs_);  
 
-            bool report = (is_report_only_on_change() && change_of_pulses) 
-                || secs_ >= report_period_secs_ || report_on_next_add;
+            bool report = level_changed || secs_ >= report_period_secs_ || report_on_next_add;
             report_on_next_add = false;
 
             return report;
@@ -102,25 +102,142 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
 
         void reset() {
             pulses_total_ = 0;
-            last_report_period_secs_ = secs_;
             secs_ = 0;
-            last_pulses_ = -1;
         }
     } report_period_;
 
+    // A report period's flow, handed from where the pulses are read
+    // to the app (see publish_report())
+    struct Report {
+        float   pulses_per_minute;
+        int     secs;
+        // Whether the flow level changed during the period, and the
+        // levels either side in pulses per update
+        bool    level_changed;
+        float   before;
+        float   after;
+        // The over limit policy as of the end of the period, and whether
+        // it closed the valve during the period
+        OverLimitPolicy policy;
+        bool    valve_closed;
+    };
+
+    // Flow level changes. level_changed_ is set until the change is 
+    // reported.
+    FlowChangeDetector flow_change_;
+    bool level_changed_ = false;
+
+    // The flow over limit decision, taken where the pulses are read so 
+    // a busy loop task cannot hold up closing the valve. valve_closed_
+    // is set until the close is reported.
+    OverLimitPolicy policy_;
+    float max_pulses_plus_ = -1;
+    bool close_valve_ = false;
+    bool valve_closed_ = false;
+
+    // A wwh device's valve pins (see set_valve_pins())
+    static GPIOPin* valve_open_pin_;
+    static GPIOPin* valve_close_pin_;
+
+    // The settings the app changes, as the app set them. With 
+    // APP_ACQUISITION_TASK the task alone touches report_period_, 
+    // flow_change_, policy_ and the wf_on mode once it runs, so the loop task
+    // changes only settings_ and queues a copy for the task to apply
+    // before its next read (see set_settings()).
+    public:
+    struct Settings {
+        float report_period_wf_off_mode_secs;
+        float report_period_wf_on_mode_secs;
+        // FlowChangeDetector's
+        float step;
+        float min_step_pulses;
+        float noise;
+        float threshold;
+        // Above which a read is wf_on mode (see FlowChannel::set_upm_base())
+        pulse_counter_t pulses_base;
+        // The over limit policy's settings, and its state too if 
+        // policy_state is set (see set_over_limit()). max_pulses_plus is
+        // max_upm_plus in pulses per update, < 0 for no limit.
+        OverLimitPolicy policy;
+        bool policy_state;
+        float max_pulses_plus;
+        bool close_valve;
+    };
+    private:
+    Settings settings_;
+
+#ifdef APP_EDGE_CAPTURE
+    // Edge times around a rate jump of at least capture_jump_ratio of the 
+    // rate and capture_min_jump pulses per update, up or down
+    EdgeCapture capture_;
+    float capture_jump_ratio_ = 0.5;
+    int capture_min_jump_ = 10;
+    pulse_counter_t last_pulses_ = 0;
+#endif
+
+    // The last report, for the app. The flow change is pending until
+    // the app takes it (see take_flow_change()).
+    int last_report_period_secs_ = 0;
+    bool flow_change_pending_ = false;
+    float flow_change_before_ = 0;
+    float flow_change_after_ = 0;
+    // See take_verdict()
+    OverLimitPolicy reported_policy_;
+    bool reported_valve_closed_ = false;
+
+    // All the flow sensors on the device. The first one created leads:
+    // only it is polled and its update() reads every sensor's PCNT unit
+    // in one go (see PulseCounterStorage::read_raw_values()), so all the
+    // channels are sampled over the same interval.
+    static WaterflowSensor* sensors_[APP_MAX_FLOW_CHANNELS];
+    static int sensor_count_;
+
+    bool is_lead() const { return sensors_[0] == this; }
+
+#ifdef APP_ACQUISITION_TASK
+    // With APP_ACQUISITION_TASK the PCNT units are read and the reports
+    // made in acquisition_task(), which queues each sensor's reports 
+    // for the lead sensor's loop() to publish. Settings go the other 
+    // way, from the loop task to the task; settings_pending_ is set 
+    // while settings_ did not fit in the queue.
+    SpscQueue<Report, APP_ACQUISITION_QUEUE> reports_;
+    SpscQueue<Settings, 4> settings_queue_;
+    bool settings_pending_ = false;
+    static TaskHandle_t task_;
+    static void acquisition_task(void* arg);
+#endif
+
     public:
 
-    WaterflowSensor(int pin, TranslationManager& xlate_mgr):
+    WaterflowSensor(int pin, int channel, TranslationManager& xlate_mgr):
         pin_(pin),
+        channel_(channel),
         xlate_mgr_(xlate_mgr),
         signature_mgr_(xlate_mgr_),
         report_period_(report_period_wf_off_mode_secs_) {
 
-        set_name("wf");
+        if (sensor_count_ < APP_MAX_FLOW_CHANNELS) {
+            sensors_[sensor_count_++] = this;
+        }
+
+        set_name(channel_ == 0 ? std::string("wf") : "wf" + to_string(channel_));
         set_unit_of_measurement("pulses/min");
         set_icon("mdi:pulse");
         set_accuracy_decimals(2);
         set_force_update(false);
+
+        settings_ = { 
+            report_period_wf_off_mode_secs_, 
+            report_period_wf_on_mode_secs_,
+            flow_change_.step,
+            flow_change_.min_step_pulses,
+            flow_change_.noise,
+            flow_change_.threshold,
+            pulses_base_,
+            policy_,
+            false,
+            max_pulses_plus_,
+            close_valve_ };
     }
 
     void on_start_init( int report_period_wf_off_mode_secs,
@@ -138,6 +255,15 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
         report_period_.report_on_next_add = true;
 
         set_update_interval_secs(1);
+#ifdef APP_ACQUISITION_TASK
+        // Read by acquisition_task()
+        set_update_interval(SCHEDULER_DONT_RUN);
+#else
+        if (!is_lead()) {
+            // Read by the lead sensor's update()
+            set_update_interval(SCHEDULER_DONT_RUN);
+        }
+#endif
         
         set_in_wf_on_mode(false);
 
@@ -146,32 +272,136 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
         set_filter_us(13);
     }
 
+#ifdef APP_EDGE_CAPTURE
+    void setup() override {
+        PulseCounterSensor::setup();
+        if (!is_failed()) {
+            // Alongside the PCNT unit on the same pin
+            pin_->attach_interrupt(EdgeCapture::gpio_intr, &capture_, RISING);
+        }
+    }
+
+    EdgeCapture& get_edge_capture() {
+        return capture_;
+    }
+#endif
+
     // Modes:
     //      Normal
     //      Fast
     //      on change
     //      never on zero (=< base flow)
     void update() override {
-        pulse_counter_t pulses = this->storage_.read_raw_value();
+        read_sensors();
+    }
+
+#ifdef APP_ACQUISITION_TASK
+    void loop() override {
+        if (!is_lead()) {
+            return;
+        }
+        // Started on the first loop, when every sensor's PCNT unit is set up
+        if (task_ == nullptr) {
+            xTaskCreatePinnedToCore(acquisition_task, "wf_acquire", 4096, this,
+                APP_ACQUISITION_PRIORITY, &task_, APP_ACQUISITION_CORE);
+        }
 
-        if (report_period_.add(pulses, update_interval_secs_)) {
-            float value = xlate_mgr_.current->convert_pulses_to_uom(report_period_.get_value_as_pulses_per_minute());
-            // reset() below will save the secs of this period which
-            // the app will retrieve using get_last_period_secs(). This is a
-            // bit of  kludge which we use because we can't, as far as I know,
-            // send more information when we publish_state(). TODO: we could easily use
-            // an alternative to publish_state() to get this data to the app.
-            report_period_.reset();
-            this->publish_state(value);
+        Report report;
+        for (int i = 0; i < sensor_count_; ++i) {
+            if (sensors_[i]->settings_pending_) {
+                sensors_[i]->queue_settings();
+            }
+            while (sensors_[i]->reports_.pop(report)) {
+                sensors_[i]->publish_report(report);
+            }
+        }
+    }
+#endif
+
+    void read_sensors() {
+        PulseCounterStorage* storages[APP_MAX_FLOW_CHANNELS];
+        WaterflowSensor* sensors[APP_MAX_FLOW_CHANNELS];
+        pulse_counter_t pulses[APP_MAX_FLOW_CHANNELS];
+        int count = 0;
+
+        for (int i = 0; i < sensor_count_; ++i) {
+            if (!sensors_[i]->is_failed()) {
+                sensors[count] = sensors_[i];
+                storages[count] = &sensors_[i]->storage_;
+                ++count;
+            }
+        }
+
+        PulseCounterStorage::read_raw_values(storages, pulses, count);
+
+        for (int i = 0; i < count; ++i) {
+            sensors[i]->process_pulses(pulses[i]);
+        }
+    }
+
+    void process_pulses(pulse_counter_t pulses) {
+
+#ifdef APP_ACQUISITION_TASK
+        Settings settings{};
+        bool have_settings = false;
+        while (settings_queue_.pop(settings)) {
+            have_settings = true;
+        }
+        if (have_settings) {
+            apply_settings(settings);
+        }
+#endif
+
+#ifdef APP_EDGE_CAPTURE
+        int jump = abs(int(pulses) - int(last_pulses_));
+        if (jump >= capture_min_jump_ && jump >= capture_jump_ratio_ * std::max(pulses, last_pulses_)) {
+            capture_.trigger();
+        }
+        last_pulses_ = pulses;
+        capture_.update();
+#endif
+
+        bool level_changed = flow_change_.add(pulses);
+        if (level_changed) {
+            level_changed_ = true;
+        }
+
+        // Over limit is reported right away, as a level change is
+        bool was_over = policy_.over_limit;
+        OverLimitPolicy::Verdict verdict = policy_.step(pulses, pulses_base_, 
+            max_pulses_plus_, update_interval_secs_);
+        if (verdict == OverLimitPolicy::Verdict::over_limit && !was_over && close_valve_) {
+            close_valve();
+        }
+        bool over_limit_changed = policy_.over_limit != was_over;
+
+        if (report_period_.add(pulses, update_interval_secs_, level_changed || over_limit_changed)) {
+            Report report = { 
+                report_period_.get_value_as_pulses_per_minute(),
+                report_period_.get_secs(),
+                level_changed_,
+                flow_change_.before,
+                flow_change_.after,
+                policy_,
+                valve_closed_ };
+
+            if (hand_on(report)) {
+                report_period_.reset();
+                level_changed_ = false;
+                valve_closed_ = false;
+            } else {
+                // The queue is full. Keep counting and try again next update.
+                report_period_.report_on_next_add = true;
+            }
         }
 
         //float value = (60000.0f * raw) / float(this->get_update_interval());  // per minute
         //value = xlate_->convert_pulses_to_uom(value);
 
         //if (!only_publish_on_change || )
-        if (pulses > *g_pulses_base && !in_wf_on_mode()) {
+        if (pulses > pulses_base_ && !in_wf_on_mode()) {
             set_in_wf_on_mode(true);
-        } else if (pulses <= *g_pulses_base && in_wf_on_mode()) {
+        } else if (pulses <= pulses_base_ && in_wf_on_mode()) {
             set_in_wf_on_mode(false);
         }
 
@@ -180,41 +410,196 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
         
     }
 
+    // Closes the valve by its pins, at once, from wherever the pulses are
+    // read. The valve switches publish and run automations, which only 
+    // the loop task may do, so they are left to dApp::check_limits() to
+    // set to match when the report of it arrives.
+    void close_valve() {
+        if (valve_close_pin_ == nullptr) {
+            return;
+        }
+        // The switches' interlock: open off before close on
+        valve_open_pin_->digital_write(false);
+        valve_close_pin_->digital_write(true);
+        valve_closed_ = true;
+    }
+
+    // Hands report to the app: queued for the loop task when read in
+    // acquisition_task(), otherwise published now. Returns false if the
+    // queue is full.
+    bool hand_on(const Report& report) {
+#ifdef APP_ACQUISITION_TASK
+        return reports_.push(report);
+#else
+        publish_report(report);
+        return true;
+#endif
+    }
+
+    // Loop task only. The secs and flow change of the report are kept for
+    // the app to get while it handles publish_state(), as a published 
+    // state can carry only the value.
+    void publish_report(const Report& report) {
+        last_report_period_secs_ = report.secs;
+        reported_policy_ = report.policy;
+        reported_valve_closed_ = report.valve_closed;
+        if (report.level_changed) {
+            flow_change_pending_ = true;
+            flow_change_before_ = report.before;
+            flow_change_after_ = report.after;
+        }
+        this->publish_state(xlate_mgr_.current->convert_pulses_to_uom(report.pulses_per_minute));
+    }
+
     void convert_uom(const char* from, float old_calibrate_factor=0) {
         signature_mgr_.convert_uom(from, old_calibrate_factor);
     }
 
-    int get_report_period_secs() const {
-        return report_period_.get_report_period_secs();
+    // Returns true, with the flow before and after in the current uom
+    // per minute, once for each flow level change
+    bool take_flow_change(float& before_upm, float& after_upm) {
+        if (!flow_change_pending_) {
+            return false;
+        }
+        flow_change_pending_ = false;
+
+        float per_minute = 60.0f / update_interval_secs_;
+        before_upm = xlate_mgr_.current->convert_pulses_to_uom(flow_change_before_ * per_minute);
+        after_upm = xlate_mgr_.current->convert_pulses_to_uom(flow_change_after_ * per_minute);
+        return true;
     }
 
     int get_last_report_period_secs() const {
-        return report_period_.get_last_report_period_secs();
+        return last_report_period_secs_;
     }
 
-    void set_report_period_wf_off_mode_secs(float secs) {
-        report_period_wf_off_mode_secs_ = secs; 
-        if (!in_wf_on_mode()) {
-            report_period_.set_report_period_secs(report_period_wf_off_mode_secs_);
+    // The over limit verdict of the last report, for a policy that was
+    // given the reports before. Sets policy's state to the reported one
+    // and valve_closed to whether the valve was closed for it.
+    OverLimitPolicy::Verdict take_verdict(OverLimitPolicy& policy, bool& valve_closed) {
+        OverLimitPolicy::Verdict verdict = OverLimitPolicy::Verdict::ok;
+        if (reported_policy_.over_limit) {
+            verdict = OverLimitPolicy::Verdict::over_limit;
+        } else if (policy.over_limit) {
+            verdict = OverLimitPolicy::Verdict::back_under_limit;
         }
+        policy.secs_over_limit = reported_policy_.secs_over_limit;
+        policy.grace_for_surge = reported_policy_.grace_for_surge;
+        policy.over_limit = reported_policy_.over_limit;
+        valve_closed = reported_valve_closed_;
+        reported_valve_closed_ = false;
+        return verdict;
+    }
+
+    const Settings& get_settings() const {
+        return settings_;
+    }
+
+    // Loop task only. Applied now, or queued for the acquisition task
+    // once it runs.
+    void set_settings(const Settings& settings) {
+        settings_ = settings;
+#ifdef APP_ACQUISITION_TASK
+        if (task_ != nullptr) {
+            queue_settings();
+            return;
+        }
+#endif
+        apply_settings(settings_);
+        // Once
+        settings_.policy_state = false;
+    }
+
+    void set_report_period_wf_off_mode_secs(float secs) {
+        Settings settings = settings_;
+        settings.report_period_wf_off_mode_secs = secs;
+        set_settings(settings);
     }
 
     float get_report_period_wf_off_mode_secs() const {
-        return report_period_wf_off_mode_secs_; 
+        return settings_.report_period_wf_off_mode_secs; 
     }
 
     void set_report_period_wf_on_mode_secs(float secs) {
-        report_period_wf_on_mode_secs_ = secs; 
-        if (in_wf_on_mode()) {
-            report_period_.set_report_period_secs(report_period_wf_on_mode_secs_);
-        }
+        Settings settings = settings_;
+        settings.report_period_wf_on_mode_secs = secs;
+        set_settings(settings);
     }
 
     float get_report_period_wf_on_mode_secs() const {
-        return report_period_wf_on_mode_secs_; 
+        return settings_.report_period_wf_on_mode_secs; 
+    }
+
+    void set_pulses_base(pulse_counter_t pulses) {
+        Settings settings = settings_;
+        settings.pulses_base = pulses;
+        set_settings(settings);
+    }
+
+    // policy's settings and the limit, as max_upm_plus in pulses per 
+    // update. With state, e.g., restored from a snapshot, also policy's 
+    // state. Unchanged settings are not handed on again.
+    void set_over_limit(const OverLimitPolicy& policy, float max_pulses_plus, bool close_valve,
+        bool state=false) {
+        if (!state && policy.test_period_secs == settings_.policy.test_period_secs
+            && policy.allow_initial_surge_seconds == settings_.policy.allow_initial_surge_seconds
+            && max_pulses_plus == settings_.max_pulses_plus && close_valve == settings_.close_valve) {
+            return;
+        }
+        Settings settings = settings_;
+        settings.policy = policy;
+        settings.policy_state = state;
+        settings.max_pulses_plus = max_pulses_plus;
+        settings.close_valve = close_valve;
+        set_settings(settings);
+    }
+
+    // A wwh device's valve pins, as its switches have them (see 
+    // close_valve()). Set before the sensors are read.
+    static void set_valve_pins(GPIOPin* open, GPIOPin* close) {
+        valve_open_pin_ = open;
+        valve_close_pin_ = close;
+    }
+
+    protected:
+    // Where the pulses are read
+    void apply_settings(const Settings& settings) {
+        report_period_wf_off_mode_secs_ = settings.report_period_wf_off_mode_secs;
+        report_period_wf_on_mode_secs_ = settings.report_period_wf_on_mode_secs;
+        report_period_.set_report_period_secs(!in_wf_on_mode_
+            ? report_period_wf_off_mode_secs_
+            : report_period_wf_on_mode_secs_);
+
+        flow_change_.step = settings.step;
+        flow_change_.min_step_pulses = settings.min_step_pulses;
+        flow_change_.noise = settings.noise;
+        flow_change_.threshold = settings.threshold;
+
+        pulses_base_ = settings.pulses_base;
+
+        policy_.test_period_secs = settings.policy.test_period_secs;
+        policy_.allow_initial_surge_seconds = settings.policy.allow_initial_surge_seconds;
+        if (settings.policy_state) {
+            policy_.secs_over_limit = settings.policy.secs_over_limit;
+            policy_.grace_for_surge = settings.policy.grace_for_surge;
+            policy_.over_limit = settings.policy.over_limit;
+        }
+        max_pulses_plus_ = settings.max_pulses_plus;
+        close_valve_ = settings.close_valve;
     }
 
+#ifdef APP_ACQUISITION_TASK
+    // Loop task only
+    void queue_settings() {
+        settings_pending_ = !settings_queue_.push(settings_);
+        if (!settings_pending_) {
+            // Once
+            settings_.policy_state = false;
+        }
+    }
+#endif
 
+    // Where the pulses are read
     bool in_wf_on_mode() const { return in_wf_on_mode_; }
 
     void set_in_wf_on_mode(bool in_wf_on_mode) {
@@ -227,14 +612,22 @@ class WaterflowSensor: public pulse_counter::PulseCounterSensor {
         }
     }
 
-    JsonArray& get_signatures_as_json() {
-        return signature_mgr_.toJson();
+    public:
+
+    JsonArray& get_signatures_as_json(JsonBuffer& jb) {
+        return signature_mgr_.toJson(jb);
     }
 
     bool set_signatures_from_json(const JsonArray& ja) {
         return signature_mgr_.fromJson(ja);
     }
 
+    // See SignatureManager::is_match()
+    template<class F>
+    void match_signatures(float upm, float secs, F on_match) {
+        signature_mgr_.is_match(upm, secs, on_match);
+    }
+
     protected:
     void set_update_interval_secs(float secs) {
         update_interval_secs_ = secs;
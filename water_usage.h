@@ -4,13 +4,16 @@
 #include "esphome.h"
 #include "esphome/components/time/real_time_clock.h"
 #include "app_defs.h"
+#include "flow_config.h"
+#include "app_clock.h"
 using namespace esphome;
 
 
 // #define DEBUG_SESSION
 
-// This is the water flow when presumably there is no water flow.
-extern float* g_upm_base;
+// Names live as long as the device runs, so they are accounted for
+// in the allocation metrics
+typedef tracked_string<AllocSubsystem::usage_names> usage_name_t;
 
 ////////////////////
 // Water usage timed unit definition
@@ -23,10 +26,13 @@ class WaterUsageTimed {
     int             seconds;
     float           usage;
     unsigned int    flags;
-    std::string     name;
+    usage_name_t    name;
 
     public:
 
+    // The lists allocate their units with new[]
+    APP_TRACKED_NEW(AllocSubsystem::usage_lists)
+
     enum {
         start_on_first_usage =      1,
         next_flag_value =           start_on_first_usage << 1
@@ -63,15 +69,15 @@ class WaterUsageTimed {
     }
 
     void setName(const std::string& _name) {
-        name = _name;
+        name.assign(_name.c_str());
     }
 
-    const std::string& getName() const {
+    const usage_name_t& getName() const {
         return name;
     }
 
     void start(unsigned int _flags=0) {
-        start_time = sntp_time->timestamp_now();
+        start_time = app_clock.now();
         set(_flags);
     }
 
@@ -84,11 +90,11 @@ class WaterUsageTimed {
     // }
 
     time_t timeSoFar(time_t endtime=0) {
-        return (endtime ? endtime : sntp_time->timestamp_now()) - start_time;
+        return (endtime ? endtime : app_clock.now()) - start_time;
     }
 
     void close(time_t endtime=0) {
-        seconds = (endtime ? endtime : sntp_time->timestamp_now()) - start_time;
+        seconds = (endtime ? endtime : app_clock.now()) - start_time;
     }
     void addUsage(float usage) {
 
@@ -104,15 +110,15 @@ class WaterUsageTimed {
         usage = f(usage);
     }
 
-    JsonObject& toJson(JsonObject* pjo=nullptr) const {
+    JsonObject& toJson(JsonBuffer& jb, JsonObject* pjo=nullptr) const {
         //JsonBuffer jb;
         if (pjo == nullptr) {
-            // JsonObject& jo = global_json_buffer.createObject();
-            pjo = &global_json_buffer.createObject();
+            pjo = &jb.createObject();
         }
 
         if (!name.empty()) {
-            (*pjo)["name"] = name;
+            // As a std::string so the json buffer gets its own copy
+            (*pjo)["name"] = std::string(name.c_str());
         }
         // Sometimes I see infinitesimal usage amounts (eg, 7e-41), so I ignore 
         // Note: infinitesimal amounts also handled in dapp.cpp so maybe not needed here.
@@ -122,7 +128,7 @@ class WaterUsageTimed {
         (*pjo)["tz"] = sntp_time->get_timezone();
      
         // timed usage is closed when seconds is not zero
-        int _seconds = seconds ? seconds : sntp_time->timestamp_now() - start_time;
+        int _seconds = seconds ? seconds : app_clock.now() - start_time;
 
         (*pjo)["duration_seconds"] = _seconds;
         //jo["duration"] = strftime(buf, sizeof buf, "%T", _seconds);
@@ -208,7 +214,8 @@ class WaterUsageList {
         return closedMax;
     }
 
-    void next() {
+    // Closes the current unit at endtime (now if 0) and starts the next
+    void next(time_t endtime=0) {
         auto indexLast = indexCurrent;
 
         if (indexCurrent != -1) {
@@ -223,7 +230,7 @@ class WaterUsageList {
         }
 
         if (indexLast != -1) {
-            wut[indexLast].close();
+            wut[indexLast].close(endtime);
         }
 
         wut[indexCurrent].init();
@@ -308,13 +315,13 @@ class WaterUsageList {
         return rv;
     }
 
-    JsonObject& currentToJson() {
+    JsonObject& currentToJson(JsonBuffer& jb) {
 
-        JsonObject& jo = global_json_buffer.createObject();
+        JsonObject& jo = jb.createObject();
 
         T& cur = getCurrent();
         if (cur.isStarted()) {
-            jo["current"] = cur.toJson();
+            jo["current"] = cur.toJson(jb);
         }
 
         jo["closed_count"] = countClosed;
@@ -322,18 +329,30 @@ class WaterUsageList {
         return jo;
     }
 
-    JsonObject& toJson() {
+    int get_closed_count() const {
+        return countClosed;
+    }
+
+    // The current unit and the closed ones, most recent first. For a 
+    // page of a long list, first closed units are skipped and at most 
+    // count (all if < 0) are added; the current unit is on the first
+    // page only.
+    JsonObject& toJson(JsonBuffer& jb, int first=0, int count=-1) {
 
-        JsonObject& jo = global_json_buffer.createObject();
+        JsonObject& jo = jb.createObject();
 
-        jo["current"] = wut[indexCurrent].toJson();
+        if (first == 0) {
+            jo["current"] = wut[indexCurrent].toJson(jb);
+        }
 
         // Closed periods go into array
-        JsonArray& ja = global_json_buffer.createArray();
+        JsonArray& ja = jb.createArray();
 
         T* last = nullptr;
-        while ((last = getPreviousClosed(last))) {
-            ja.add(last->toJson());
+        for (int i = 0; (last = getPreviousClosed(last)) && (count < 0 || i < first + count); ++i) {
+            if (i >= first) {
+                ja.add(last->toJson(jb));
+            }
         } 
 
         jo["closed"] = ja;
@@ -357,11 +376,88 @@ typedef WaterUsageList<> WaterUsagePeriodList;
 //                          and then stopped flowing for n minutes
 //                          [start_time != 0 && seconds != 0]
 //
+// A session is split into zones: stretches of steady flow
+// separated by a step change in the flow or a short pause
+// (see WaterUsageSessionList). An irrigation session
+// running one zone valve after another gets one zone per
+// valve. Zone times are seconds from the session start.
 ////////////////////////////////////////////////////////
-
 class WaterUsageSession: public WaterUsageTimed {
     public:
-    WaterUsageSession(): WaterUsageTimed(start_on_first_usage) {
+
+    struct Zone {
+        uint16_t    start;
+        uint16_t    seconds;
+        float       usage;
+    };
+
+    Zone            zones[APP_MAX_SESSION_ZONES];
+    uint8_t         zone_count;
+
+    WaterUsageSession(): 
+        WaterUsageTimed(start_on_first_usage),
+        zone_count(0) {
+    }
+
+    void init() {
+        WaterUsageTimed::init();
+        zone_count = 0;
+    }
+
+    uint16_t zoneOffset(time_t at) const {
+        time_t offset = at - start_time;
+        return offset < 0 ? 0 : (offset > UINT16_MAX ? UINT16_MAX : offset);
+    }
+
+    // Closes the current zone and starts the next one. When there is
+    // no room left the last zone keeps going.
+    void startZone(time_t at) {
+        closeZone(at);
+        if (zone_count < APP_MAX_SESSION_ZONES) {
+            Zone& zone = zones[zone_count++];
+            zone.start = zoneOffset(at);
+            zone.seconds = 0;
+            zone.usage = 0;
+        }
+    }
+
+    void closeZone(time_t at) {
+        if (zone_count) {
+            Zone& zone = zones[zone_count - 1];
+            zone.seconds = zoneOffset(at) - zone.start;
+        }
+    }
+
+    void addZoneUsage(float usage) {
+        if (zone_count) {
+            zones[zone_count - 1].usage += usage;
+        }
+    }
+
+    void convert_uom(std::function<float(float &)>f) {
+        WaterUsageTimed::convert_uom(f);
+        for (int i = 0; i < zone_count; ++i) {
+            zones[i].usage = f(zones[i].usage);
+        }
+    }
+
+    JsonObject& toJson(JsonBuffer& jb, JsonObject* pjo=nullptr) const {
+        JsonObject& jo = WaterUsageTimed::toJson(jb, pjo);
+
+        if (zone_count) {
+            // Compact array: [[start, seconds, usage], ...]
+            JsonArray& ja = jb.createArray();
+            for (int i = 0; i < zone_count; ++i) {
+                JsonArray& jaZone = jb.createArray();
+                jaZone.add(zones[i].start);
+                jaZone.add(zones[i].seconds);
+                jaZone.add(zones[i].usage);
+                ja.add(jaZone);
+            }
+            jo["zones"] = ja;
+        }
+
+        return jo;
     }
 };
 
@@ -390,25 +486,110 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
     // Seconds of water flow of "zero"
     int wf0_secs;
 
+    // A new zone starts when the flow moves this fraction away from 
+    // the zone's mean flow for two samples in a row. 0 splits zones
+    // on pauses only.
+    const float def_zone_step = 0.25;
+    float zone_step;
+
+    // Mean flow of the current zone
+    float zone_upm_;
+    int zone_samples_;
+
+    // A sample away from the zone's flow, waiting on the next one to
+    // tell a step from noise
+    bool zone_pending_;
+    time_t zone_pending_time_;
+    float zone_pending_usage_;
+    float zone_pending_upm_;
+
+    // Zone splitting can be shed when the device is short of time (see 
+    // TickBudget). Usage in the meantime is in the session but no zone,
+    // and the next zone starts when it is back.
+    bool segment_zones_;
+    bool zones_skipped_;
+
+    const FlowConfig& config_;
+
 
     public:
-    WaterUsageSessionList(): 
+    WaterUsageSessionList(const FlowConfig& config): 
         WaterUsageList(), 
         end_session_secs(def_end_session_secs),
-        min_session_secs(def_min_session_secs) {
+        min_session_secs(def_min_session_secs),
+        zone_step(def_zone_step),
+        zone_upm_(0),
+        zone_samples_(0),
+        zone_pending_(false),
+        zone_pending_time_(0),
+        zone_pending_usage_(0),
+        zone_pending_upm_(0),
+        segment_zones_(true),
+        zones_skipped_(false),
+        config_(config) {
 
         // When we start we assume line was dormant
         wf0_secs = end_session_secs;
         time_last_addUsage_call = 0;
     }
 
+    private:
+
+    bool isZoneStep(float upm, float from) const {
+        return zone_step > 0 && fabs(upm - from) > zone_step * from;
+    }
+
+    void startZone(WaterUsageSession& cur, time_t at, float usage, float upm, int samples) {
+        cur.startZone(at);
+        cur.addZoneUsage(usage);
+        zone_upm_ = upm;
+        zone_samples_ = samples;
+        zone_pending_ = false;
+    }
+
+    // The pending sample was noise, it belongs to the current zone
+    void foldZonePending(WaterUsageSession& cur) {
+        if (zone_pending_) {
+            cur.addZoneUsage(zone_pending_usage_);
+            zone_pending_ = false;
+        }
+    }
+
+    // Zone bookkeeping for a sample with flow. sample_start is the 
+    // start of the period the sample covers.
+    void addZoneSample(WaterUsageSession& cur, bool resumed, time_t sample_start, float usage, float upm) {
+        if (resumed) {
+            // Session start or flow back after a pause
+            startZone(cur, sample_start, usage, upm, 1);
+        } else if (!isZoneStep(upm, zone_upm_)) {
+            foldZonePending(cur);
+            cur.addZoneUsage(usage);
+            ++zone_samples_;
+            zone_upm_ += (upm - zone_upm_) / zone_samples_;
+        } else if (zone_pending_ && !isZoneStep(upm, zone_pending_upm_)) {
+            // Two samples at the new flow: the zone changed at the first
+            startZone(cur, zone_pending_time_, zone_pending_usage_ + usage, 
+                (zone_pending_upm_ + upm) / 2, 2);
+        } else {
+            foldZonePending(cur);
+            zone_pending_ = true;
+            zone_pending_time_ = sample_start;
+            zone_pending_usage_ = usage;
+            zone_pending_upm_ = upm;
+        }
+    }
+
+    public:
+
     void clearCurrent() {
         getCurrent().init();
     }
 
+    // upm is the flow the usage was measured at. It tells flow from no
+    // flow and splits the session into zones.
     // Returns: true  - current period was closed
     //          false - otherwise  
-    bool addUsage(float usage) {
+    bool addUsage(float usage, float upm) {
 
         // The rule are simple
         // wf0
@@ -426,7 +607,7 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
         bool rc = false;
 
         int secs_since_last_call;
-        time_t time_this_addUsage_call = sntp_time->timestamp_now();
+        time_t time_this_addUsage_call = app_clock.now();
 
         if (time_last_addUsage_call) {
             secs_since_last_call = time_this_addUsage_call - time_last_addUsage_call;
@@ -438,11 +619,19 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
 
         WaterUsageSession& cur = getCurrent();
 
-        if (usage <= *g_upm_base) {
+        // upm_base is a flow, so compared with the flow, not the usage of 
+        // a report period of any length
+        if (upm <= config_.upm_base) {
 
             // No water flow
-            ESP_LOGD("main", "Session: no waterflow for %i secs, usage=%f, base=%f", 
-              wf0_secs, usage, *g_upm_base); 
+            ESP_LOGD("main", "Session: no waterflow for %i secs, upm=%f, base=%f", 
+              wf0_secs, upm, config_.upm_base); 
+
+            // A pause ends the current zone
+            if (cur.isStarted() && wf0_secs == 0) {
+                foldZonePending(cur);
+                cur.closeZone(time_this_addUsage_call - secs_since_last_call);
+            }
 
             // Increment seconds of no water flow
             wf0_secs += secs_since_last_call;
@@ -476,13 +665,20 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
             }
         } else {
 
-            // We have water flow
-            //if (!cur.isStarted()) {
-                //ESP_LOGD("main", "Session: We have waterflow"); 
+            // We have water flow. Logged at the start only: an app log
+            // line is a heap allocation, too many for every sample.
+            if (!cur.isStarted()) {
                 APP_LOG_LOG("Session: We have waterflow"); 
-            //}
+            }
            
+            bool resumed = !cur.isStarted() || wf0_secs > 0 || zones_skipped_;
             cur.addUsage(usage);
+            if (segment_zones_) {
+                addZoneSample(cur, resumed, time_this_addUsage_call - secs_since_last_call, usage, upm);
+                zones_skipped_ = false;
+            } else {
+                zones_skipped_ = true;
+            }
 
             wf0_secs = 0;
         }
@@ -490,6 +686,38 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
         return rc;
     }
 
+    // Ends the current session at end, without waiting for the
+    // end_session_secs of no flow, e.g., one restored from before the
+    // device was off for longer than that. Returns true if the session
+    // was long enough to keep, and so was closed.
+    bool endSession(time_t end) {
+        WaterUsageSession& cur = getCurrent();
+        bool rc = false;
+
+        if (cur.isStarted()) {
+            if (cur.timeSoFar(end) < min_session_secs) {
+                cur.init();
+            } else {
+                cur.closeZone(end);
+                cur.close(end);
+                next(end);
+                rc = true;
+            }
+        }
+
+        wf0_secs = end_session_secs;
+        time_last_addUsage_call = 0;
+        zone_pending_ = false;
+
+        return rc;
+    }
+
+    // Hides WaterUsageList's: sessions carry their zones, so fewer 
+    // are kept (see APP_MAX_CLOSED_SESSIONS)
+    void set_max_closed(int _closedMax) {
+        WaterUsageList::set_max_closed(std::min(_closedMax, APP_MAX_CLOSED_SESSIONS));
+    }
+
     int get_end_session_secs() const {
         return end_session_secs;
     }
@@ -505,6 +733,17 @@ class WaterUsageSessionList: public WaterUsageList<WaterUsageSession>  {
         min_session_secs = _min_session_secs;
     }
 
+    float get_zone_step() const {
+        return zone_step;
+    }
+    void set_zone_step(float _zone_step) {
+        zone_step = _zone_step;
+    }
+
+    void set_segment_zones(bool segment_zones) {
+        segment_zones_ = segment_zones;
+    }
+
 
 
 };
@@ -522,7 +761,9 @@ class WaterUsageNamed: public WaterUsageTimed {
         active =                   next_flag_value,
         closed =                   active << 1,
         canceled =                 closed << 1,
-        next_flag_value =          canceled << 1
+        // Its usage comes from a known load (see dApp::disaggregate())
+        known_load =               canceled << 1,
+        next_flag_value =          known_load << 1
     };
 
     time_t  expire_time = 0;
@@ -582,8 +823,10 @@ class WaterUsageNamedList: public WaterUsageList<WaterUsageNamed>  {
 
         if (pwun) {
             ESP_LOGD("main", "init name start");
+            reuse(pwun);
             pwun->init();
-            pwun->name = name;
+            pwun->unset(WaterUsageNamed::closed | WaterUsageNamed::canceled | WaterUsageNamed::known_load);
+            pwun->setName(name);
             pwun->expire_time = expire_time;
             pwun->start(WaterUsageNamed::active);
 
@@ -615,10 +858,10 @@ class WaterUsageNamedList: public WaterUsageList<WaterUsageNamed>  {
     }
 
     bool purgeFirstExpired() {
-        time_t now = sntp_time->now().timestamp;
+        time_t now = app_clock.now();
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
-            if (pwun->is(WaterUsageNamed::active) && pwun->expire_time > now) {
+            if (pwun->is(WaterUsageNamed::active) && pwun->expire_time && pwun->expire_time <= now) {
                 close_usage_unit(pwun);
                 return true;
             }
@@ -626,21 +869,58 @@ class WaterUsageNamedList: public WaterUsageList<WaterUsageNamed>  {
         return false;
     }
     
+    // Adds usage to the active units that are not known loads
     void addUsage(float usage) {
 
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
-            if (pwun->is(WaterUsageNamed::active)) {
+            if (pwun->is(WaterUsageNamed::active) && !pwun->is(WaterUsageNamed::known_load)) {
                 pwun->addUsage(usage);
             }
         }
     }
 
+    // Adds a known load's usage to its active unit, which from now on
+    // gets only this usage. Returns false if there is no such unit.
+    bool addLoadUsage(const std::string& name, float usage) {
+        WaterUsageNamed* pwun = findActive(name);
+        if (pwun) {
+            pwun->set(WaterUsageNamed::known_load);
+            pwun->addUsage(usage);
+        }
+        return pwun != nullptr;
+    }
+
+    // Records a unit that is already over, e.g., a matched signature, in
+    // a free unit or the oldest closed one. Returns false if every unit is
+    // active: a record never ends a running named usage.
+    bool add_closed_unit(const std::string& name, time_t start_time, int seconds, float usage) {
+        WaterUsageNamed* pwun = getFirstAvailable();
+        if (!pwun) {
+            pwun = getOldest(WaterUsageNamed::closed);
+        }
+        if (!pwun) {
+            return false;
+        }
+
+        pwun->init();
+        pwun->unset(WaterUsageNamed::active | WaterUsageNamed::canceled | WaterUsageNamed::known_load);
+        pwun->set(WaterUsageNamed::closed);
+        pwun->setName(name);
+        pwun->start_time = start_time;
+        pwun->seconds = seconds;
+        pwun->usage = usage;
+
+        ++countClosed;
+        lastClosed = *pwun;
+        return true;
+    }
+
     WaterUsageNamed* findActive(const std::string& name) {
 
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
-            if (pwun->name == name && pwun->is(WaterUsageNamed::active)) {
+            if (pwun->name.compare(name.c_str()) == 0 && pwun->is(WaterUsageNamed::active)) {
                 return pwun;
             }
         }
@@ -660,26 +940,42 @@ class WaterUsageNamedList: public WaterUsageList<WaterUsageNamed>  {
         return nullptr;
     }
 
+    // An active unit taken for another is dropped, not closed
+    void reuse(WaterUsageNamed* pwun) {
+        if (pwun->is(WaterUsageNamed::active)) {
+            pwun->unset(WaterUsageNamed::active);
+            --countActive_;
+        }
+    }
+
+    // The unit with flags that started first
     WaterUsageNamed* getOldest(unsigned int flags) {
 
         WaterUsageNamed* pwunOldest = nullptr;
 
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
-            if (!pwun->is(flags) && 
+            if (pwun->is(flags) && 
             (pwunOldest == nullptr || pwun->start_time < pwunOldest->start_time )) {
                 pwunOldest = pwun;
             }
         }
 
-        return nullptr;
+        return pwunOldest;
     }
 
-    // Overrides
+    // Overrides. The units not active are freed for reuse (see 
+    // getFirstAvailable()), not just unmarked: a closed unit that 
+    // is no longer closed would otherwise never be taken again.
     void clearClosed() {
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
-            pwun->unset(WaterUsageNamed::closed);
+            if (!pwun->is(WaterUsageNamed::active)) {
+                pwun->init();
+                pwun->start_time = 0;
+                pwun->expire_time = 0;
+                pwun->unset(WaterUsageNamed::closed | WaterUsageNamed::canceled | WaterUsageNamed::known_load);
+            }
         }
 
         countClosed = 0;
@@ -692,19 +988,19 @@ class WaterUsageNamedList: public WaterUsageList<WaterUsageNamed>  {
         }
     }
 
-    JsonObject& toJson() {
+    JsonObject& toJson(JsonBuffer& jb) {
 
-        JsonObject& jo = global_json_buffer.createObject();
+        JsonObject& jo = jb.createObject();
 
-        JsonArray& jaActive = global_json_buffer.createArray();
-        JsonArray& jaClosed = global_json_buffer.createArray();
+        JsonArray& jaActive = jb.createArray();
+        JsonArray& jaClosed = jb.createArray();
 
         int i;
         for (WaterUsageNamed* pwun = &wut[i = 0]; i < closedMax + 1; ++i, ++pwun) {
             if (pwun->is(WaterUsageNamed::active)) {
-                jaActive.add(pwun->toJson());
+                jaActive.add(pwun->toJson(jb));
             } else if (pwun->is(WaterUsageNamed::closed)) {
-                jaClosed.add(pwun->toJson());
+                jaClosed.add(pwun->toJson(jb));
             } 
         }
 